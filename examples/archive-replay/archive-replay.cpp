@@ -0,0 +1,120 @@
+/*
+ ____  _____ _        _
+| __ )| ____| |      / \
+|  _ \|  _| | |     / _ \
+| |_) | |___| |___ / ___ \
+|____/|_____|_____/_/   \_\
+http://bela.io
+*/
+
+const char* helpText =
+"Replay a recording made with `trill-osc --record`\n"
+"  Usage: %s <file> [--from <seconds>]\n"
+"    <file>: the recording\n"
+"    --from <seconds>: start this many seconds into the recording\n"
+"======================\n"
+"\n"
+"The frames of each device in the recording are passed to a Trill object\n"
+"set up with Trill::setupOffline(), as fast as they can be decoded, as a\n"
+"starting point for running the same processing on a recording as on the\n"
+"live devices. The number of frames replayed for each device is printed\n"
+"to the console, followed by how much faster than real time the replay\n"
+"was.\n";
+
+#include <Trill.h>
+#include <TrillArchive.h>
+#include <FrameClock.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <string.h>
+
+struct Replayed {
+	Trill trill;
+	TrillStreamPacket config; // the packet the object was set up for
+	unsigned int numFrames = 0;
+	unsigned int numTouches = 0;
+};
+
+static bool isSameConfig(const TrillStreamPacket& a, const TrillStreamPacket& b)
+{
+	return a.device == b.device && a.mode == b.mode && a.numChannels == b.numChannels
+		&& a.width == b.width && a.scale == b.scale;
+}
+
+int main(int argc, char** argv)
+{
+	std::string path;
+	double from = 0;
+	for(int c = 1; c < argc; ++c)
+	{
+		if(std::string("--help") == std::string(argv[c])) {
+			printf(helpText, argv[0]);
+			return 0;
+		}
+		if(std::string("--from") == std::string(argv[c])) {
+			++c;
+			if(c < argc)
+				from = atof(argv[c]);
+			continue;
+		}
+		path = argv[c];
+	}
+	if(path.empty()) {
+		printf(helpText, argv[0]);
+		return 1;
+	}
+	TrillArchiveReader reader;
+	if(reader.open(path))
+		return 1;
+	const auto& index = reader.getIndex();
+	if(!index.size()) {
+		fprintf(stderr, "%s is empty\n", path.c_str());
+		return 1;
+	}
+	printf("%s: %zu blocks\n", path.c_str(), index.size());
+	if(from > 0 && reader.seekToTimestamp(index[0].minTimestamp + uint64_t(from * 1000000000))) {
+		fprintf(stderr, "The recording is shorter than %f seconds\n", from);
+		return 1;
+	}
+
+	std::map<std::string, std::unique_ptr<Replayed>> devices;
+	FrameClock::Timestamp first = 0;
+	FrameClock::Timestamp last = 0;
+	FrameClock::Timestamp start = FrameClock::now();
+	TrillStreamPacket packet;
+	int ret;
+	while((ret = reader.read(packet)) > 0)
+	{
+		std::unique_ptr<Replayed>& r = devices[std::string(packet.id, packet.idLength)];
+		if(!r || !isSameConfig(r->config, packet)) {
+			if(!r)
+				r.reset(new Replayed);
+			if(r->trill.setupOffline(Trill::Device(packet.device), Trill::Mode(packet.mode), packet.numChannels, packet.width, packet.scale))
+				return 1;
+			r->config = packet;
+		}
+		if(r->trill.parse(packet.payload, packet.payloadSize, false, packet.timestamp))
+			continue;
+		++r->numFrames;
+		if(Trill::CENTROID == r->trill.getMode())
+			r->numTouches += r->trill.getNumTouches();
+		if(!first)
+			first = packet.timestamp;
+		last = packet.timestamp;
+	}
+	FrameClock::Timestamp elapsed = FrameClock::now() - start;
+	if(ret < 0)
+		fprintf(stderr, "The recording is corrupted, stopping early\n");
+	for(auto& d : devices) {
+		Replayed& r = *d.second;
+		printf("%s: %s, %u frames", d.first.c_str(), Trill::getNameFromDevice(r.trill.deviceType()).c_str(), r.numFrames);
+		if(Trill::CENTROID == r.trill.getMode())
+			printf(", %.2f touches per frame", r.numFrames ? r.numTouches / double(r.numFrames) : 0);
+		printf("\n");
+	}
+	double duration = (last - first) / 1e9;
+	printf("Replayed %.3f s of recording in %.3f s (%.0fx real time)\n",
+		duration, elapsed / 1e9, elapsed ? duration / (elapsed / 1e9) : 0);
+	return 0;
+}
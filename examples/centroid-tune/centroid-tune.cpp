@@ -0,0 +1,386 @@
+/*
+ ____  _____ _        _
+| __ )| ____| |      / \
+|  _ \|  _| | |     / _ \
+| |_) | |___| |___ / ___ \
+|____/|_____|_____/_/   \_\
+http://bela.io
+*/
+
+const char* helpText =
+"Find the CentroidDetection settings that best match a labelled recording\n"
+"  Usage: %s <recording> <labels> [options]\n"
+"    <recording>: a recording made with `trill-osc --record` of a device in\n"
+"            DIFF mode\n"
+"    <labels>: a text file describing the touches in the recording, with one\n"
+"            line per interval: `<start> <end> <location> [<location> ...]`,\n"
+"            with times in seconds from the first frame and locations\n"
+"            between 0 and 1, or `?` if only the touch count matters. There\n"
+"            are no touches outside of the intervals. Lines starting with\n"
+"            `#` are ignored.\n"
+"  --id <id> : the device to use, if the recording has more than one\n"
+"  --noise <values> : the noise thresholds to try (default: 0:200:25)\n"
+"  --min-size <values> : the minimum touch sizes to try (default: 0:2000:250)\n"
+"  --adjacent <values> : the adjacent centroid thresholds to try (default: 100:800:100)\n"
+"  --multiplier-bits <values> : the multiplier bits to try (default: 7)\n"
+"  --wrap-around <values> : the wrap around values to try (default: 0)\n"
+"  --radius <distance> : how close a touch has to be to a labelled one to\n"
+"            match it (default: 0.1)\n"
+"  --error-weight <weight> : how much the mean position error, relative to\n"
+"            --radius, adds to the score (default: 1)\n"
+"  --threads <n> : the number of threads to use (default: all cores)\n"
+"  --top <n> : the number of settings to print (default: 10)\n"
+"    <values> is either a comma-separated list, or `<first>:<last>:<step>`\n"
+"======================\n"
+"\n"
+"Every combination of the settings is run on every frame, in parallel, by a\n"
+"CentroidDetectionBatch, which shares the frames among all of them. In each\n"
+"frame, the touches detected are matched to the labelled ones. Unmatched\n"
+"labelled touches are missed, unmatched touches within --radius of a labelled\n"
+"one are split from it and other unmatched touches are spurious. The score of\n"
+"each combination is the number of missed, split and spurious touches per\n"
+"frame, plus the weighted position error of the matched ones. Lower is\n"
+"better.\n";
+
+#include <Trill.h>
+#include <TrillArchive.h>
+#include <CentroidDetection.h>
+#include <CentroidDetectionBatch.h>
+#include <WorkStealingPool.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+enum {
+	kMaxNumCentroids = 5,
+	kNumParameters = 5,
+};
+
+static const char* kParameterNames[kNumParameters] = { "noise", "min-size", "adjacent", "multiplier-bits", "wrap-around" };
+
+struct Label {
+	double start;
+	double end;
+	std::vector<float> locations; // NAN if unknown
+};
+
+struct Config {
+	float parameters[kNumParameters];
+	// accumulated over all frames
+	uint64_t missed = 0;
+	uint64_t split = 0;
+	uint64_t spurious = 0;
+	uint64_t matched = 0;
+	double error = 0;
+	double score = 0;
+};
+
+static int parseValues(const std::string& arg, std::vector<float>& values)
+{
+	values.clear();
+	std::vector<std::string> tokens;
+	std::string token;
+	std::istringstream ss(arg);
+	if(arg.find(':') != std::string::npos) {
+		while(std::getline(ss, token, ':'))
+			tokens.push_back(token);
+		if(3 != tokens.size())
+			return 1;
+		float first = atof(tokens[0].c_str());
+		float last = atof(tokens[1].c_str());
+		float step = atof(tokens[2].c_str());
+		if(step <= 0)
+			return 1;
+		for(unsigned int n = 0; first + n * step <= last + step * 0.001f; ++n)
+			values.push_back(first + n * step);
+	} else {
+		while(std::getline(ss, token, ','))
+			values.push_back(atof(token.c_str()));
+	}
+	return !values.size();
+}
+
+static int loadLabels(const std::string& path, std::vector<Label>& labels)
+{
+	std::ifstream file(path);
+	if(!file) {
+		fprintf(stderr, "Unable to open %s\n", path.c_str());
+		return 1;
+	}
+	std::string line;
+	unsigned int lineNumber = 0;
+	while(std::getline(file, line)) {
+		++lineNumber;
+		std::istringstream ss(line);
+		std::string token;
+		Label label;
+		if(!(ss >> token) || '#' == token[0])
+			continue;
+		label.start = atof(token.c_str());
+		if(!(ss >> label.end) || label.end < label.start) {
+			fprintf(stderr, "%s:%u: invalid interval\n", path.c_str(), lineNumber);
+			return 1;
+		}
+		while(ss >> token)
+			label.locations.push_back("?" == token ? NAN : atof(token.c_str()));
+		if(label.locations.size() > kMaxNumCentroids) {
+			fprintf(stderr, "%s:%u: more than %d touches\n", path.c_str(), lineNumber, kMaxNumCentroids);
+			return 1;
+		}
+		labels.push_back(label);
+	}
+	std::sort(labels.begin(), labels.end(), [](const Label& a, const Label& b) {
+		return a.start < b.start;
+	});
+	return 0;
+}
+
+// match the touches detected in a frame to the labelled ones and add the
+// result to config
+static void score(Config& config, const float* locations, unsigned int numTouches, const Label* label, float radius)
+{
+	unsigned int numLabels = label ? label->locations.size() : 0;
+	bool labelMatched[kMaxNumCentroids] = {false};
+	bool touchMatched[kMaxNumCentroids] = {false};
+	// the closest pairs first
+	while(1) {
+		float best = radius;
+		int bestLabel = -1;
+		int bestTouch = -1;
+		for(unsigned int l = 0; l < numLabels; ++l) {
+			if(labelMatched[l] || isnan(label->locations[l]))
+				continue;
+			for(unsigned int t = 0; t < numTouches; ++t) {
+				float distance = fabsf(locations[t] - label->locations[l]);
+				if(!touchMatched[t] && distance <= best) {
+					best = distance;
+					bestLabel = l;
+					bestTouch = t;
+				}
+			}
+		}
+		if(bestLabel < 0)
+			break;
+		labelMatched[bestLabel] = touchMatched[bestTouch] = true;
+		++config.matched;
+		config.error += best;
+	}
+	// labels without a location take any touch left
+	for(unsigned int l = 0; l < numLabels; ++l) {
+		if(!isnan(label->locations[l]))
+			continue;
+		for(unsigned int t = 0; t < numTouches; ++t) {
+			if(!touchMatched[t]) {
+				labelMatched[l] = touchMatched[t] = true;
+				break;
+			}
+		}
+	}
+	for(unsigned int l = 0; l < numLabels; ++l)
+		config.missed += !labelMatched[l];
+	for(unsigned int t = 0; t < numTouches; ++t) {
+		if(touchMatched[t])
+			continue;
+		bool isNear = false;
+		for(unsigned int l = 0; l < numLabels; ++l)
+			isNear |= fabsf(locations[t] - label->locations[l]) <= radius;
+		if(isNear)
+			++config.split;
+		else
+			++config.spurious;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> paths;
+	std::string id;
+	std::vector<float> values[kNumParameters];
+	parseValues("0:200:25", values[0]);
+	parseValues("0:2000:250", values[1]);
+	parseValues("100:800:100", values[2]);
+	parseValues("7", values[3]);
+	parseValues("0", values[4]);
+	float radius = 0.1;
+	float errorWeight = 1;
+	unsigned int numThreads = 0;
+	unsigned int top = 10;
+	for(int c = 1; c < argc; ++c)
+	{
+		std::string arg = argv[c];
+		if("--help" == arg) {
+			printf(helpText, argv[0]);
+			return 0;
+		}
+		if(arg.size() > 2 && "--" == arg.substr(0, 2)) {
+			if(++c >= argc) {
+				fprintf(stderr, "Missing value for %s\n", arg.c_str());
+				return 1;
+			}
+			std::string value = argv[c];
+			bool found = false;
+			for(unsigned int p = 0; p < kNumParameters; ++p) {
+				if(arg.substr(2) == kParameterNames[p]) {
+					found = true;
+					if(parseValues(value, values[p])) {
+						fprintf(stderr, "Invalid values for %s: %s\n", arg.c_str(), value.c_str());
+						return 1;
+					}
+				}
+			}
+			if(found)
+				continue;
+			if("--id" == arg)
+				id = value;
+			else if("--radius" == arg)
+				radius = atof(value.c_str());
+			else if("--error-weight" == arg)
+				errorWeight = atof(value.c_str());
+			else if("--threads" == arg)
+				numThreads = atoi(value.c_str());
+			else if("--top" == arg)
+				top = atoi(value.c_str());
+			else {
+				fprintf(stderr, "Unknown option %s\n", arg.c_str());
+				return 1;
+			}
+			continue;
+		}
+		paths.push_back(arg);
+	}
+	if(paths.size() != 2) {
+		printf(helpText, argv[0]);
+		return 1;
+	}
+	std::vector<Label> labels;
+	if(loadLabels(paths[1], labels))
+		return 1;
+	TrillArchiveReader reader;
+	if(reader.open(paths[0]))
+		return 1;
+
+	// find the device
+	TrillStreamPacket packet;
+	int ret;
+	while((ret = reader.read(packet)) > 0) {
+		if(TrillStreamPacket::kModeCentroid != packet.mode && (id.empty() || id == std::string(packet.id, packet.idLength)))
+			break;
+	}
+	if(ret <= 0) {
+		fprintf(stderr, "No frames in DIFF mode in %s\n", paths[0].c_str());
+		return 1;
+	}
+	id = std::string(packet.id, packet.idLength);
+	unsigned int numChannels = packet.numChannels;
+	Trill trill;
+	if(trill.setupOffline(Trill::Device(packet.device), Trill::Mode(packet.mode), numChannels, packet.width, packet.scale))
+		return 1;
+	if(Trill::DIFF != trill.getMode())
+		fprintf(stderr, "Warning: %s is in %s mode, not DIFF\n", id.c_str(), Trill::getNameFromMode(trill.getMode()).c_str());
+	printf("Device %s: %s, %u channels\n", id.c_str(), Trill::getNameFromDevice(trill.deviceType()).c_str(), numChannels);
+	FrameClock::Timestamp first = packet.timestamp;
+
+	// every combination of the parameters
+	std::vector<Config> configs(1);
+	for(unsigned int p = 0; p < kNumParameters; ++p) {
+		std::vector<Config> expanded;
+		for(auto& c : configs) {
+			for(auto v : values[p]) {
+				expanded.push_back(c);
+				expanded.back().parameters[p] = v;
+			}
+		}
+		configs.swap(expanded);
+	}
+	std::vector<CentroidDetection> detectors(configs.size());
+	for(size_t n = 0; n < configs.size(); ++n) {
+		const float* p = configs[n].parameters;
+		CentroidDetection& d = detectors[n];
+		d.setup(numChannels, kMaxNumCentroids, 1);
+		d.setNoiseThreshold(p[0]);
+		d.setMinimumTouchSize(p[1]);
+		d.setAdjacentCentroidNoiseThreshold(p[2]);
+		d.setMultiplierBits(p[3]);
+		d.setWrapAround(p[4]);
+	}
+	CentroidDetectionBatch batch(detectors, numThreads);
+	WorkStealingPool pool(batch.getNumThreads());
+	printf("Trying %zu settings on %u threads\n", configs.size(), batch.getNumThreads());
+
+	// frames are processed in blocks, small enough that the results of
+	// all settings fit in a few tens of MB
+	size_t blockSize = std::max(size_t(64), std::min(size_t(4096), (size_t(4) << 20) / (configs.size() * kMaxNumCentroids)));
+	std::vector<float> frames(blockSize * numChannels);
+	std::vector<const Label*> frameLabels(blockSize);
+	std::vector<float> locations(configs.size() * blockSize * kMaxNumCentroids);
+	std::vector<float> sizes(locations.size());
+	std::vector<unsigned int> numTouches(configs.size() * blockSize);
+	size_t numFrames = 0;
+	size_t nextLabel = 0;
+	FrameClock::Timestamp start = FrameClock::now();
+	FrameClock::Timestamp last = first;
+	bool done = false;
+	while(!done) {
+		size_t n = 0;
+		// the first packet was read already
+		for(; n < blockSize && ret > 0; ret = reader.read(packet)) {
+			if(id != std::string(packet.id, packet.idLength) || TrillStreamPacket::kModeCentroid == packet.mode)
+				continue;
+			if(trill.parse(packet.payload, packet.payloadSize, false, packet.timestamp))
+				continue;
+			std::copy(trill.rawData.begin(), trill.rawData.begin() + numChannels, frames.begin() + n * numChannels);
+			double time = (packet.timestamp - first) / 1e9;
+			while(nextLabel < labels.size() && labels[nextLabel].end < time)
+				++nextLabel;
+			frameLabels[n] = nextLabel < labels.size() && labels[nextLabel].start <= time ? &labels[nextLabel] : nullptr;
+			last = packet.timestamp;
+			++n;
+		}
+		if(ret < 0)
+			fprintf(stderr, "The recording is corrupted, stopping early\n");
+		done = ret <= 0;
+		if(!n)
+			break;
+		batch.process(frames.data(), n, numChannels, 0, locations.data(), sizes.data(), numTouches.data(), kMaxNumCentroids);
+		pool.parallelFor(configs.size(), 1, [&](unsigned int, size_t begin, size_t end) {
+			for(size_t c = begin; c < end; ++c) {
+				for(size_t f = 0; f < n; ++f) {
+					size_t k = c * n + f;
+					score(configs[c], locations.data() + k * kMaxNumCentroids, numTouches[k], frameLabels[f], radius);
+				}
+			}
+		});
+		numFrames += n;
+	}
+	double elapsed = (FrameClock::now() - start) / 1e9;
+	if(!numFrames) {
+		fprintf(stderr, "No frames could be parsed\n");
+		return 1;
+	}
+	printf("%zu frames, %.1f s of recording, processed in %.3f s (%.0f frames/s per setting)\n",
+		numFrames, (last - first) / 1e9, elapsed, numFrames * configs.size() / elapsed);
+
+	for(auto& c : configs) {
+		double meanError = c.matched ? c.error / c.matched : 0;
+		c.score = double(c.missed + c.split + c.spurious) / numFrames + errorWeight * meanError / radius;
+	}
+	std::stable_sort(configs.begin(), configs.end(), [](const Config& a, const Config& b) {
+		return a.score < b.score;
+	});
+	for(unsigned int p = 0; p < kNumParameters; ++p)
+		printf("%s ", kParameterNames[p]);
+	printf("| missed split spurious (per frame) | mean error | score\n");
+	for(size_t n = 0; n < std::min(size_t(top), configs.size()); ++n) {
+		const Config& c = configs[n];
+		for(unsigned int p = 0; p < kNumParameters; ++p)
+			printf("%*g ", int(strlen(kParameterNames[p])), c.parameters[p]);
+		printf("| %6.4f %5.4f %8.4f | %10.4f | %.4f\n",
+			c.missed / double(numFrames), c.split / double(numFrames), c.spurious / double(numFrames),
+			c.matched ? c.error / c.matched : 0, c.score);
+	}
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ ____  _____ _        _
+| __ )| ____| |      / \
+|  _ \|  _| | |     / _ \
+| |_) | |___| |___ / ___ \
+|____/|_____|_____/_/   \_\
+http://bela.io
+*/
+
+const char* helpText =
+"Read all the Trill devices on one or more I2C buses from a single thread\n"
+"  Usage: %s <bus> [<bus> ...]\n"
+"    <bus>: a bus to scan for devices (i.e.: the X in /dev/i2c-X)\n"
+"======================\n"
+"\n"
+"All devices are probed and set up concurrently by a TrillExecutor, then\n"
+"they are read at the same time through io_uring (see TrillUring.h), so\n"
+"that reading from several buses takes as long as reading from the\n"
+"slowest of them, without a thread per bus.\n"
+"The number of touches of each device is printed to the console.\n"
+"\n"
+"NOTE: as this program scans several addresses on the i2c buses\n"
+"it could cause non-Trill peripherals connected to them to malfunction.\n";
+
+#include <Trill.h>
+#include <TrillUring.h>
+#include <TrillExecutor.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <string.h>
+
+int gShouldStop;
+
+void interrupt_handler(int var)
+{
+	gShouldStop = true;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<unsigned int> buses;
+	for(int c = 1; c < argc; ++c)
+	{
+		if(std::string("--help") == std::string(argv[c])) {
+			printf(helpText, argv[0]);
+			return 0;
+		}
+		buses.push_back(atoi(argv[c]));
+	}
+	if(!buses.size()) {
+		printf(helpText, argv[0]);
+		return 1;
+	}
+	TrillUring uring;
+	if(uring.setup())
+		return 1;
+	std::vector<std::unique_ptr<Trill>> touchSensors;
+	// probe all addresses and set up the devices found concurrently
+	TrillExecutor executor;
+	for(auto bus : buses) {
+		for(uint8_t addr = 0x20; addr <= 0x50; ++addr) {
+			executor.spawn([bus, addr, &uring, &touchSensors]() {
+				Trill::Device device = Trill::probe(bus, addr);
+				if(Trill::NONE == device)
+					return;
+				std::unique_ptr<Trill> t(new Trill);
+				if(t->setup(bus, device, addr))
+					return;
+				printf("Bus %d: %s at address %#4x\n", bus, Trill::getNameFromDevice(device).c_str(), addr);
+				if(!uring.add(*t))
+					touchSensors.push_back(std::move(t));
+			});
+		}
+	}
+	executor.run();
+	if(!touchSensors.size()) {
+		fprintf(stderr, "No devices found\n");
+		return 1;
+	}
+	uring.setCallback([](Trill& t, int ret) {
+		if(ret)
+			fprintf(stderr, "Error while reading from %#x: %s\n", t.getAddress(), strerror(-ret));
+	});
+	signal(SIGINT, interrupt_handler);
+	while(!gShouldStop) {
+		// read all devices at once and wait for all of them
+		uring.submitReads();
+		while(uring.getNumInFlight())
+			if(uring.processCompletions(uring.getNumInFlight()) < 0)
+				return 1;
+		for(auto& t : touchSensors)
+			printf("%d ", t->getNumTouches());
+		printf("\n");
+		usleep(100000);
+	}
+	return 0;
+}
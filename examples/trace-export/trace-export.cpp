@@ -0,0 +1,86 @@
+/*
+ ____  _____ _        _
+| __ )| ____| |      / \
+|  _ \|  _| | |     / _ \
+| |_) | |___| |___ / ___ \
+|____/|_____|_____/_/   \_\
+http://bela.io
+*/
+
+const char* helpText =
+"Convert a trace of I2C transfers to the Chrome / Perfetto JSON format\n"
+"  Usage: %s <trace> [<json>]\n"
+"    <trace>: a trace saved by TrillTrace::save(), e.g.: with `trill-osc --trace`\n"
+"    <json>: where to write the JSON trace. If omitted, it is written to\n"
+"            the standard output\n"
+"======================\n"
+"\n"
+"Open the JSON trace in https://ui.perfetto.dev or Chrome's about://tracing.\n"
+"Each I2C bus is shown as a process and each device on it as a thread, so\n"
+"that the transfers of all the devices on a bus can be compared on a single\n"
+"timeline. A summary of the time spent in each kind of event is printed to\n"
+"the standard error.\n";
+
+#include <TrillTrace.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> paths;
+	for(int c = 1; c < argc; ++c)
+	{
+		if(std::string("--help") == std::string(argv[c])) {
+			printf(helpText, argv[0]);
+			return 0;
+		}
+		paths.push_back(argv[c]);
+	}
+	if(paths.size() < 1 || paths.size() > 2) {
+		printf(helpText, argv[0]);
+		return 1;
+	}
+	std::vector<TrillTrace::Event> events;
+	if(TrillTrace::load(paths[0], events))
+		return 1;
+	FILE* file = stdout;
+	if(paths.size() > 1) {
+		file = fopen(paths[1].c_str(), "w");
+		if(!file) {
+			fprintf(stderr, "Unable to open %s: %s\n", paths[1].c_str(), strerror(errno));
+			return 1;
+		}
+	}
+	int ret = TrillTrace::writeChromeJson(file, events);
+	if(file != stdout && fclose(file))
+		ret = 1;
+	if(ret) {
+		fprintf(stderr, "Error while writing the JSON trace\n");
+		return 1;
+	}
+
+	enum { kNumKinds = TrillTrace::kSleep + 1 };
+	unsigned int count[kNumKinds] = {0};
+	unsigned int errors[kNumKinds] = {0};
+	double total[kNumKinds] = {0};
+	uint32_t longest[kNumKinds] = {0};
+	for(auto& e : events) {
+		if(e.kind >= kNumKinds)
+			continue;
+		++count[e.kind];
+		errors[e.kind] += !!e.ret;
+		total[e.kind] += e.duration;
+		longest[e.kind] = std::max(longest[e.kind], e.duration);
+	}
+	fprintf(stderr, "%zu events\n", events.size());
+	for(unsigned int k = 0; k < kNumKinds; ++k) {
+		if(!count[k])
+			continue;
+		fprintf(stderr, "%-8s: %8u, %u errors, total %.3f ms, mean %.1f us, longest %.1f us\n",
+			TrillTrace::getKindName(k), count[k], errors[k], total[k] / 1e6, total[k] / count[k] / 1e3, longest[k] / 1e3);
+	}
+	return 0;
+}
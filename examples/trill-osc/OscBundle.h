@@ -0,0 +1,146 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+// Serialise OSC messages made of floats straight into a reusable bundle
+// buffer, without building an oscpkt::Message and an oscpkt::PacketWriter
+// for each of them. Once the buffer has grown to the size of the largest
+// bundle, no more memory is allocated.
+
+// The padded address and type tags of messages of up to maxValues floats
+class OscFloatsAddress
+{
+public:
+	OscFloatsAddress() {}
+	OscFloatsAddress(const std::string& address, unsigned int maxValues)
+	{
+		setup(address, maxValues);
+	}
+	void setup(const std::string& address, unsigned int maxValues)
+	{
+		this->maxValues = maxValues;
+		pattern.assign(padded(address.size() + 1), 0);
+		memcpy(pattern.data(), address.c_str(), address.size());
+		typeTags.assign(padded(maxValues + 2), 0);
+		typeTags[0] = ',';
+		memset(typeTags.data() + 1, 'f', maxValues);
+	}
+	static size_t padded(size_t size)
+	{
+		return (size + 3) & ~3;
+	}
+private:
+	friend class OscBundle;
+	std::vector<char> pattern;
+	std::vector<char> typeTags;
+	unsigned int maxValues = 0;
+};
+
+class OscBundle
+{
+public:
+	// start a new bundle with the given OSC (NTP) timetag
+	void begin(uint64_t timetag)
+	{
+		numMessages = 0;
+		pos = 0;
+		reserve(kHeaderSize);
+		memcpy(buffer.data(), "#bundle", 8);
+		pos = 8;
+		put32(timetag >> 32);
+		put32(timetag);
+	}
+	// append a message with numValues floats. Returns 0 on success
+	int add(const OscFloatsAddress& address, const float* values, unsigned int numValues)
+	{
+		if(numValues > address.maxValues || address.pattern.empty())
+			return 1;
+		size_t tagsSize = OscFloatsAddress::padded(numValues + 2);
+		size_t size = address.pattern.size() + tagsSize + numValues * sizeof(uint32_t);
+		reserve(sizeof(uint32_t) + size);
+		put32(size);
+		memcpy(buffer.data() + pos, address.pattern.data(), address.pattern.size());
+		pos += address.pattern.size();
+		// the type tags of fewer values are a prefix of those of
+		// maxValues, followed by padding
+		memcpy(buffer.data() + pos, address.typeTags.data(), numValues + 1);
+		memset(buffer.data() + pos + numValues + 1, 0, tagsSize - numValues - 1);
+		pos += tagsSize;
+		for(unsigned int n = 0; n < numValues; ++n)
+		{
+			uint32_t value;
+			memcpy(&value, values + n, sizeof(value));
+			put32(value);
+		}
+		++numMessages;
+		return 0;
+	}
+	// append a message with a single int32, ignoring the type tags of
+	// address. Returns 0 on success
+	int addInt32(const OscFloatsAddress& address, int32_t value)
+	{
+		if(address.pattern.empty())
+			return 1;
+		size_t size = address.pattern.size() + 4 + sizeof(uint32_t);
+		reserve(sizeof(uint32_t) + size);
+		put32(size);
+		memcpy(buffer.data() + pos, address.pattern.data(), address.pattern.size());
+		pos += address.pattern.size();
+		memcpy(buffer.data() + pos, ",i\0\0", 4);
+		pos += 4;
+		put32(value);
+		++numMessages;
+		return 0;
+	}
+	// the number of bytes add() appends to the bundle
+	static size_t getSize(const OscFloatsAddress& address, unsigned int numValues)
+	{
+		return sizeof(uint32_t) + address.pattern.size() + OscFloatsAddress::padded(numValues + 2) + numValues * sizeof(uint32_t);
+	}
+	// the number of bytes addInt32() appends to the bundle
+	static size_t getInt32Size(const OscFloatsAddress& address)
+	{
+		return sizeof(uint32_t) + address.pattern.size() + 4 + sizeof(uint32_t);
+	}
+	unsigned int getNumMessages() const { return numMessages; }
+	const char* data() const { return buffer.data(); }
+	size_t size() const { return pos; }
+	// the first message in the bundle, to send it on its own
+	const char* firstMessage(size_t& size) const
+	{
+		uint32_t s;
+		memcpy(&s, buffer.data() + kHeaderSize, sizeof(s));
+		size = ntohl(s);
+		return buffer.data() + kHeaderSize + sizeof(s);
+	}
+	// the current time as an OSC timetag
+	static uint64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		const uint64_t kEpochOffset = 2208988800u; // 1900 to 1970
+		uint64_t seconds = ts.tv_sec + kEpochOffset;
+		uint64_t fraction = ((uint64_t)ts.tv_nsec << 32) / 1000000000;
+		return (seconds << 32) | fraction;
+	}
+private:
+	enum { kHeaderSize = 16 };
+	void reserve(size_t size)
+	{
+		if(buffer.size() < pos + size)
+			buffer.resize(pos + size);
+	}
+	void put32(uint32_t value)
+	{
+		value = htonl(value);
+		memcpy(buffer.data() + pos, &value, sizeof(value));
+		pos += sizeof(value);
+	}
+	std::vector<char> buffer;
+	size_t pos = 0;
+	unsigned int numMessages = 0;
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+// A bounded, lock-free queue for exactly one producer thread and one
+// consumer thread. Slots are preallocated and reused: the producer fills
+// a slot in place between beginPush() and commitPush(), and the consumer
+// reads it in place between front() and pop().
+template <typename T>
+class SpscQueue
+{
+public:
+	// capacity is rounded up to a power of two
+	SpscQueue(size_t capacity = 256)
+	{
+		size_t size = 1;
+		while(size < capacity)
+			size <<= 1;
+		slots.resize(size);
+		mask = size - 1;
+	}
+	// get the next free slot, or nullptr if the queue is full
+	T* beginPush()
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) > mask)
+			return nullptr;
+		return &slots[t & mask];
+	}
+	// make the slot returned by beginPush() visible to the consumer
+	void commitPush()
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// get the oldest slot, or nullptr if the queue is empty
+	T* front()
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots[h & mask];
+	}
+	// release the slot returned by front() to the producer
+	void pop()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+private:
+	std::vector<T> slots;
+	size_t mask;
+	// keep the two indices on separate cache lines
+	char pad0[64];
+	std::atomic<size_t> head = {0};
+	char pad1[64];
+	std::atomic<size_t> tail = {0};
+};
@@ -9,8 +9,19 @@ http://bela.io
 
 const char* helpText =
 "An OSC client to manage Trill devices."
-"  Usage: %s [--port <inPort>] [[--auto <bus> ] <remote>]\n"
+"  Usage: %s [--port <inPort>] [--shm] [--stream <url> [--stream-only]] [--record <file>] [--trace <file>] [[--auto <bus> ] <remote>]\n"
 "  --port <inPort> :  set the port where to listen for OSC messages\n"
+"  --shm : also publish every reading to the POSIX shared memory object\n"
+"          `/trill-<id>`, which local processes can read with TrillShmReader\n"
+"  --stream <url> : also send every reading in the compact binary format of\n"
+"          TrillStream.h to <url>, which is one of `udp:<host>:<port>`,\n"
+"          `tcp:<host>:<port>` or `unix:<path>`\n"
+"  --stream-only : send readings only to the --stream, and not as OSC\n"
+"  --record <file> : also write every reading to <file>, in the compressed\n"
+"          format of TrillArchive.h, which archive-replay can play back\n"
+"  --trace <file> : trace all I2C transfers with the devices and save the\n"
+"          trace to <file> on exit, which trace-export can convert for\n"
+"          Chrome or Perfetto\n"
 "\n"
 "  `--auto <bus> <remote> : this is useful for debugging: automatically detect\n"
 "                          all the Trill devices on <bus> (corresponding to /dev/i2c-<bus>)\n"
@@ -22,6 +33,10 @@ const char* helpText =
 "scans several addresses on the i2c bus, which could cause non-Trill\n"
 "peripherals connected to it to malfunction.\n"
 "\n"
+"Each i2c bus in use is read from its own thread, so a slow or unresponsive\n"
+"device only delays the other devices on the same bus. Commands are applied\n"
+"in the order they are received for each bus, between readings.\n"
+"\n"
 "Command reference:\n"
 "Send commands to `/trill/commands/<command>`, with 0 or more arguments.\n"
 "\n"
@@ -34,8 +49,18 @@ const char* helpText =
 "	/trill/commands/deleteAll\n"
 "set whether all devices `should` read (and send) new data automatically or not:\n"
 "	/trill/commands/autoReadAll <float>should \n"
-"change the scanning rate so that there is a `ms` sleep in between reads (and sends):\n"
+"change the scanning rate so that devices are read (and sent) every `ms`:\n"
 "	/trill/commands/loopSleep, ms\n"
+"set whether the readings of each sweep are sent as a single bundle (default)\n"
+"or as individual messages:\n"
+"	/trill/commands/bundle <float>should\n"
+"read all devices that read automatically on each bus together every `ms`,\n"
+"so that their frames are acquired at the same time (see TrillSweep.h).\n"
+"Devices then only scan when they are read. The sweeps on different buses\n"
+"are aligned to the same clock. If `settleUs` is not 0, each sweep first\n"
+"triggers a scan on all devices and waits `settleUs` before reading them.\n"
+"Use 0 `ms` to go back to reading each device on its own (default):\n"
+"	/trill/commands/sync <float>ms <float>settleUs\n"
 "\n"
 "Instance commands: they all start with a string id\n"
 "\n"
@@ -51,6 +76,26 @@ const char* helpText =
 "	/trill/commands/autoRead <string>id <float>should\n"
 "ask the device to read (and send) data once\n"
 "	/trill/commands/readI2C, <string>id\n"
+"set the period in `ms` at which the device is read when `autoRead` is on.\n"
+"Use 0 to follow the global `loopSleep` (default)\n"
+"	/trill/commands/setReadPeriod <string>id <float>ms\n"
+"read the device whenever its EVT pin, connected to the specified `gpio`, has\n"
+"an `edge` (rising (default), falling or both) instead of periodically. Use a\n"
+"negative `gpio` to go back to periodic reads\n"
+"	/trill/commands/setEventPin <string>id <float>gpio <string>edge\n"
+"\n"
+"Send policies: by default every reading of a device is sent. These commands\n"
+"make a device only send what is worth sending:\n"
+"only send a reading if any of its values changed by more than `epsilon` since\n"
+"the last reading sent. Use a negative value to send all readings (default)\n"
+"	/trill/commands/setSendThreshold <string>id <float>epsilon\n"
+"send at most `rate` readings per second. Use 0 for no limit (default)\n"
+"	/trill/commands/setSendRate <string>id <float>rate\n"
+"send a reading after `seconds` even if it didn't change. Use 0 to never\n"
+"send unchanged readings (default)\n"
+"	/trill/commands/setKeepalive <string>id <float>seconds\n"
+"in raw/baseline/diff mode, send values smaller than `deadband` as 0 (default: 0)\n"
+"	/trill/commands/setDeadband <string>id <float>deadband\n"
 "\n"
 "More instance commands, which map directly to the C++ API http://docs.bela.io/classTrill.html\n"
 "	/trill/commands/updateBaseline <string>id\n"
@@ -58,12 +103,28 @@ const char* helpText =
 "	/trill/commands/setScanSettings <string>id <float>speed <float>num_bits\n"
 "	/trill/commands/setPrescaler <string>id <float>value\n"
 "	/trill/commands/setNoiseThreshold <string>id <float>value\n"
+"	/trill/commands/setChannelMask <string>id <float or int>mask\n"
+"	/trill/commands/setTransmissionFormat <string>id <float>width <float>shift\n"
+"	/trill/commands/setTimerPeriod <string>id <float>ms\n"
+"	/trill/commands/setScanTrigger <string>id <string>trigger // trigger is a string: disabled, i2c, timer or i2cOrTimer\n"
+"	/trill/commands/setEventMode <string>id <string>mode // mode is a string: touch, change or always\n"
+"	/trill/commands/setIDACValue <string>id <float>value\n"
+"	/trill/commands/setMinimumTouchSize <string>id <float>size\n"
+"These run as tasks on the thread of the device's bus, in the order they are\n"
+"received for each device. While a command waits for the device to acknowledge\n"
+"it, the other devices on the bus keep being read; the device itself is not\n"
+"read until its commands have completed.\n"
 "\n"
 "Outbound messages:\n"
 "messages in response to commands will be sent to:\n"
 "	/trill/commandreply\n"
 "\n"
 "Readings:\n"
+"all readings taken at the same time are sent in a single OSC bundle, unless\n"
+"disabled with the `bundle` command.\n"
+"When `sync` is on, the readings of each sweep are preceded by the ID of the\n"
+"sweep, which is the same for all buses:\n"
+"	/trill/readings/sweep <int>sweepId\n"
 "1D devices in centroid mode:\n"
 "	/trill/readings/<id>/touches <num-touches> <loc0> <pos0> <loc1> <pos1> ...\n"
 "2D devices in centroid mode (compoundTouch):\n"
@@ -75,26 +136,49 @@ const char* helpText =
 ;
 
 #include <Trill.h>
+#include <TrillArchive.h>
+#include <TrillShm.h>
+#include <TrillStream.h>
+#include <TrillTrace.h>
+#include <TrillSweep.h>
+#include <TrillExecutor.h>
 #include <vector>
+#include <deque>
+#include <functional>
 #include <string>
 #include <memory>
 #include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #define OSCPKT_OSTREAM_OUTPUT
 #include "oscpkt.hh"
 #include <iostream> // needed for udp.hh
 #include "udp.hh"
+#include "OscBundle.h"
+#include "SpscQueue.h"
 
 #include <signal.h>
 int shouldStop = 0;
+// the defaults for new buses
 bool gAutoReadAll = 0;
 unsigned int gLoopSleep = 20;
-
-void interrupt_handler(int var)
-{
-	shouldStop = true;
-}
+unsigned int gSyncPeriod = 0;
+unsigned int gSyncSettle = 0;
+bool gShm = false;
+bool gBundle = true;
+bool gOscReadings = true;
 
 typedef enum {
 	DONT,
@@ -102,58 +186,1005 @@ typedef enum {
 	ALWAYS,
 } ShouldRead;
 
+// Edge events on a GPIO connected to the EVT pin of a device, via sysfs.
+// The file descriptor becomes ready with EPOLLPRI on each edge.
+class GpioEvent
+{
+public:
+	~GpioEvent();
+	int setup(unsigned int gpio, const std::string& edge);
+	int getFd() const { return fd; }
+	void clear();
+private:
+	int fd = -1;
+};
+
+// Decide whether a reading should be sent, based on the last one sent
+class SendPolicy
+{
+public:
+	bool shouldSend(const float* values, unsigned int len, FrameClock::Timestamp now);
+	float epsilon = -1; // only send changes larger than this. Negative to send everything
+	float maxRate = 0; // in readings per second, or 0 for unlimited
+	float keepalive = 0; // in seconds, or 0 to never send unchanged readings
+	float deadband = 0; // raw values smaller than this are sent as 0
+private:
+	std::vector<float> last;
+	FrameClock::Timestamp lastTime = 0;
+	bool sent = false;
+};
+
+bool SendPolicy::shouldSend(const float* values, unsigned int len, FrameClock::Timestamp now)
+{
+	float elapsed = (now - lastTime) / 1000000000.f;
+	if(sent && maxRate > 0 && elapsed * maxRate < 1)
+		return false;
+	bool send = !sent || epsilon < 0 || len != last.size()
+		|| (keepalive > 0 && elapsed >= keepalive);
+	for(unsigned int n = 0; n < len && !send; ++n)
+		send = fabsf(values[n] - last[n]) > epsilon;
+	if(send) {
+		// doesn't allocate unless len grows
+		last.assign(values, values + len);
+		lastTime = now;
+		sent = true;
+	}
+	return send;
+}
+
+// Send TrillStreamPackets to a UDP, TCP or Unix socket. Packets added in
+// one sweep are sent together: in one datagram, or in one write on a
+// stream socket. If a stream socket can't keep up, whole packets are
+// dropped.
+class StreamSender
+{
+public:
+	~StreamSender();
+	int setup(const std::string& url);
+	void add(const TrillStreamPacket& packet);
+	void send();
+private:
+	int connect();
+	void disconnect();
+	enum {
+		kMaxDatagram = 8192,
+		kMaxPending = 65536,
+	};
+	std::string url;
+	int fd = -1;
+	int type;
+	struct sockaddr_storage addr;
+	socklen_t addrLen = 0;
+	std::vector<uint8_t> buffer;
+	size_t size = 0;
+	FrameClock::Timestamp lastConnect = 0;
+};
+
 struct TrillDev {
+	TrillDev(const std::string& id, Trill* t, ShouldRead shouldRead) :
+		id(id), t(t), shouldRead(shouldRead) {}
+	std::string id;
 	std::unique_ptr<Trill> t;
 	ShouldRead shouldRead;
+	std::unique_ptr<TrillShmPublisher> shm;
+	unsigned int readPeriod = 0; // in ms, or 0 to follow the bus' loopSleep
+	std::unique_ptr<GpioEvent> evt;
+	// precomputed addresses of the readings
+	OscFloatsAddress touchesAddress;
+	OscFloatsAddress touchXYAddress;
+	OscFloatsAddress diffAddress;
+	SendPolicy policy;
+	std::vector<float> values; // scratch space for the current reading
+	bool synced = false; // whether it's set to scan only when read
+	// commands waiting to run on the bus' executor, the first of which
+	// is running. The device is not read until they have completed
+	std::deque<std::function<void()>> pending;
+	bool deleted = false; // whether it has to be freed once pending completes
+	Trill::ScanTriggerMode syncedTrigger = Trill::kScanTriggerI2c; // the scan trigger to restore once it leaves the sweep
 };
 
-std::map<std::string, struct TrillDev> gTouchSensors;
+// A message from a bus thread to the main thread
+struct Outbound {
+	enum {
+		kMaxValues = 32,
+		kMaxPayload = 64,
+	};
+	typedef enum {
+		kReading, ///< a reading of dev, to be sent
+		kMessage, ///< msg, to be sent
+		kCreated, ///< dev has been created
+		kDeleted, ///< dev has been removed from its bus and can be freed
+	} Type;
+	Type type;
+	TrillDev* dev;
+	const OscFloatsAddress* address;
+	unsigned int numValues;
+	float values[kMaxValues];
+	bool hasSweep;
+	uint32_t sweepId;
+	TrillStreamPacket packet;
+	uint8_t payload[kMaxPayload];
+	oscpkt::Message msg;
+};
+
+// Each I2C bus is serviced by its own thread, so that a slow or
+// unresponsive device only delays the other devices on the same bus.
+// The main thread passes the OSC commands to the thread of the bus they
+// apply to, which passes back readings and replies; both directions go
+// through lock-free queues, so the main thread never waits for a bus. A
+// bus thread only waits when its outbound queue is full and what it has
+// to push can't be dropped, until the main thread makes room.
+// Devices are owned by the bus thread until it sends them back to the
+// main thread to be freed, after all of their readings.
+class Bus
+{
+public:
+	Bus(unsigned int number, int outboundFd);
+	~Bus();
+	// called from the main thread
+	bool post(const oscpkt::Message& msg);
+	// called from the main thread once it has popped from outbound
+	void notifySpace();
+	SpscQueue<Outbound> outbound;
+private:
+	typedef enum {
+		kFdCommand,
+		kFdTimer,
+		kFdGpio,
+	} FdKind;
+	void loop();
+	int parseCommand(oscpkt::Message& msg);
+	int newTrillDev(const std::string& id, Trill::Device device, uint8_t i2cAddr, ShouldRead shouldRead);
+	void deleteTrillDev(const std::string& id);
+	void createAllDevices();
+	void readDevice(TrillDev& dev, const TrillSweep* sweep = nullptr);
+	void readSweep();
+	unsigned int getReadPeriod(const TrillDev& dev);
+	void updateSchedules();
+	void runOnDevice(TrillDev& dev, const std::function<void()>& task);
+	void runCommand(TrillDev& dev, const std::string& command, const std::function<int(Trill&)>& apply);
+	void pushDeleted(TrillDev* dev);
+	Outbound* waitPush();
+	void commitPush();
+	void send(const oscpkt::Message& msg);
+	void sendTrillDev(const std::string& command, const TrillDev& dev);
+	void sendReply(const std::string& command, const std::string& id, int ret);
+	SpscQueue<oscpkt::Message> commands;
+	std::map<std::string, std::unique_ptr<TrillDev>> devices;
+	// one timerfd for each read period in use
+	std::map<unsigned int, int> schedules;
+	std::thread thread;
+	std::atomic<bool> shouldStop = {false};
+	unsigned int number;
+	int epoll = -1;
+	int commandFd = -1;
+	int outboundFd;
+	// signalled by the main thread when there is room in outbound
+	int spaceFd = -1;
+	std::atomic<bool> waitingForSpace = {false};
+	bool pushed = false;
+	bool autoReadAll;
+	unsigned int loopSleep;
+	unsigned int syncPeriod;
+	unsigned int syncSettle;
+	TrillSweep sweep;
+	// runs the commands of the devices, so that the waits for their
+	// acks don't stop the other devices from being read
+	TrillExecutor executor;
+	unsigned int droppedReadings = 0;
+};
+
+std::map<unsigned int, std::unique_ptr<Bus>> gBuses;
+// the bus of each device, for routing commands
+std::map<std::string, unsigned int> gDeviceBus;
 oscpkt::UdpSocket gSock;
+std::unique_ptr<StreamSender> gStream;
+std::unique_ptr<TrillArchiveWriter> gRecord;
+
+// everything the main loop waits for is a file descriptor in gEpoll. The
+// kind of each is stored in the upper half of epoll_event.data.u64
+typedef enum {
+	kFdSignal,
+	kFdSocket,
+	kFdOutbound,
+} FdKind;
+int gEpoll = -1;
+// signalled by the bus threads when they have pushed to their outbound queue
+int gOutboundFd = -1;
+// the readings of the current sweep
+OscBundle gReadings;
+// bundles are sent before they grow past this, so that they fit in a
+// single UDP datagram on an Ethernet link (1500-byte MTU minus the IP
+// and UDP headers)
+const size_t kMaxBundleSize = 1472;
+OscFloatsAddress gSweepAddress("/trill/readings/sweep", 0);
+bool gReadingsHaveSweep = false; // whether gReadings has a sweep marker
+uint32_t gReadingsSweepId;
 
 int parseOsc(oscpkt::Message& msg);
-int sendOscFloats(const std::string& address, float* values, unsigned int size);
-int sendOscTrillDev(const std::string& command, const std::string& id, const TrillDev& trillDev);
-int sendOscReply(const std::string& command, const std::string& id, int ret);
+int sendOsc(const oscpkt::Message& msg);
 std::vector<std::string> split(const std::string& s, char delimiter);
 
-int newTrillDev(const std::string& id, unsigned int i2cBus, Trill::Device device, uint8_t i2cAddr, ShouldRead shouldRead)
+static int writeFile(const std::string& path, const std::string& value)
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if(!f)
+		return 1;
+	int ret = fputs(value.c_str(), f) < 0;
+	ret |= fclose(f);
+	return ret;
+}
+
+GpioEvent::~GpioEvent()
+{
+	// closing the fd also removes it from any epoll set
+	if(fd >= 0)
+		close(fd);
+}
+
+int GpioEvent::setup(unsigned int gpio, const std::string& edge)
+{
+	std::string dir = "/sys/class/gpio/gpio" + std::to_string(gpio);
+	if(access(dir.c_str(), F_OK))
+		writeFile("/sys/class/gpio/export", std::to_string(gpio));
+	if(writeFile(dir + "/direction", "in") || writeFile(dir + "/edge", edge)) {
+		fprintf(stderr, "Unable to set up gpio %u for %s edges\n", gpio, edge.c_str());
+		return 1;
+	}
+	fd = open((dir + "/value").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to open gpio %u: %s\n", gpio, strerror(errno));
+		return 1;
+	}
+	clear();
+	return 0;
+}
+
+void GpioEvent::clear()
+{
+	char value[4];
+	lseek(fd, 0, SEEK_SET);
+	if(read(fd, value, sizeof(value)) < 0)
+		fprintf(stderr, "Unable to read gpio: %s\n", strerror(errno));
+}
+
+int epollAdd(int epoll, int fd, unsigned int kind, uint32_t events = EPOLLIN)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.u64 = (uint64_t(kind) << 32) | uint32_t(fd);
+	if(epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) && EEXIST != errno) {
+		fprintf(stderr, "Unable to watch fd %d: %s\n", fd, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// gSock gets a new file descriptor every time it binds or connects
+void watchSocket()
+{
+	if(gSock.socketHandle() >= 0)
+		epollAdd(gEpoll, gSock.socketHandle(), kFdSocket);
+}
+
+static void signalFd(int fd)
+{
+	uint64_t value = 1;
+	if(write(fd, &value, sizeof(value)) != sizeof(value))
+		fprintf(stderr, "Unable to signal fd %d: %s\n", fd, strerror(errno));
+}
+
+StreamSender::~StreamSender()
+{
+	disconnect();
+}
+
+int StreamSender::setup(const std::string& url)
+{
+	this->url = url;
+	std::vector<std::string> tokens = split(url, ':');
+	memset(&addr, 0, sizeof(addr));
+	if(2 == tokens.size() && "unix" == tokens[0]) {
+		struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+		if(tokens[1].size() >= sizeof(un->sun_path)) {
+			fprintf(stderr, "Path too long: %s\n", tokens[1].c_str());
+			return 1;
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, tokens[1].c_str());
+		addrLen = sizeof(*un);
+		type = SOCK_STREAM;
+	} else if(3 == tokens.size() && ("udp" == tokens[0] || "tcp" == tokens[0])) {
+		type = "udp" == tokens[0] ? SOCK_DGRAM : SOCK_STREAM;
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = type;
+		struct addrinfo* result;
+		int ret = getaddrinfo(tokens[1].c_str(), tokens[2].c_str(), &hints, &result);
+		if(ret) {
+			fprintf(stderr, "Unable to resolve %s: %s\n", url.c_str(), gai_strerror(ret));
+			return 1;
+		}
+		memcpy(&addr, result->ai_addr, result->ai_addrlen);
+		addrLen = result->ai_addrlen;
+		freeaddrinfo(result);
+	} else {
+		fprintf(stderr, "Invalid stream url: %s\n", url.c_str());
+		return 1;
+	}
+	buffer.resize(SOCK_DGRAM == type ? kMaxDatagram : kMaxPending);
+	return connect();
+}
+
+int StreamSender::connect()
+{
+	disconnect();
+	lastConnect = FrameClock::now();
+	fd = socket(addr.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to create socket for %s: %s\n", url.c_str(), strerror(errno));
+		return 1;
+	}
+	if(::connect(fd, (struct sockaddr*)&addr, addrLen) && EINPROGRESS != errno) {
+		fprintf(stderr, "Unable to connect to %s: %s\n", url.c_str(), strerror(errno));
+		disconnect();
+		return 1;
+	}
+	return 0;
+}
+
+void StreamSender::disconnect()
+{
+	if(fd >= 0)
+		close(fd);
+	fd = -1;
+	size = 0;
+}
+
+void StreamSender::add(const TrillStreamPacket& packet)
+{
+	if(SOCK_DGRAM == type && size + packet.getSize() > buffer.size())
+		send();
+	size += packet.encode(buffer.data() + size, buffer.size() - size);
+}
+
+void StreamSender::send()
+{
+	if(fd < 0) {
+		size = 0;
+		// try reconnecting once a second
+		if(FrameClock::now() - lastConnect > 1000000000)
+			connect();
+		return;
+	}
+	if(!size)
+		return;
+	ssize_t ret = ::send(fd, buffer.data(), size, MSG_NOSIGNAL);
+	if(ret < 0) {
+		if(EAGAIN == errno || EWOULDBLOCK == errno || ENOTCONN == errno) {
+			// not connected yet or not keeping up
+			ret = 0;
+		} else if(SOCK_STREAM == type) {
+			fprintf(stderr, "Lost connection to %s: %s\n", url.c_str(), strerror(errno));
+			disconnect();
+			return;
+		} else {
+			// e.g.: no one listening on the other end yet
+			ret = size;
+		}
+	}
+	// keep what wasn't sent for next time. A stream socket may have
+	// written part of a packet, which then has to be completed
+	memmove(buffer.data(), buffer.data() + ret, size - ret);
+	size -= ret;
+}
+
+static std::string baseAddress = "/trill/";
+std::string commandReplyAddress = baseAddress + "commandreply/";
+
+Bus::Bus(unsigned int number, int outboundFd) :
+	number(number), outboundFd(outboundFd), autoReadAll(gAutoReadAll), loopSleep(gLoopSleep),
+	syncPeriod(gSyncPeriod), syncSettle(gSyncSettle)
+{
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	commandFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	spaceFd = eventfd(0, EFD_CLOEXEC);
+	if(epoll < 0 || commandFd < 0 || spaceFd < 0 || epollAdd(epoll, commandFd, kFdCommand))
+		fprintf(stderr, "Unable to set up bus %u: %s\n", number, strerror(errno));
+	thread = std::thread(&Bus::loop, this);
+}
+
+Bus::~Bus()
+{
+	shouldStop = true;
+	signalFd(commandFd);
+	signalFd(spaceFd);
+	thread.join();
+	for(auto& schedule : schedules)
+		close(schedule.second);
+	close(commandFd);
+	close(spaceFd);
+	close(epoll);
+}
+
+bool Bus::post(const oscpkt::Message& msg)
+{
+	oscpkt::Message* slot = commands.beginPush();
+	if(!slot) {
+		fprintf(stderr, "Too many commands pending on bus %u\n", number);
+		return false;
+	}
+	*slot = msg;
+	commands.commitPush();
+	signalFd(commandFd);
+	return true;
+}
+
+void Bus::loop()
+{
+	const unsigned int kMaxEvents = 16;
+	struct epoll_event events[kMaxEvents];
+	while(!shouldStop) {
+		int timeout = -1;
+		if(executor.getNumTasks()) {
+			// wake up when the first command task is due
+			FrameClock::Timestamp wakeup = executor.getNextWakeup();
+			FrameClock::Timestamp now = FrameClock::now();
+			timeout = wakeup > now ? (wakeup - now + 999999) / 1000000 : 0;
+		}
+		int ret = epoll_wait(epoll, events, kMaxEvents, timeout);
+		if(ret < 0) {
+			if(EINTR == errno)
+				continue;
+			fprintf(stderr, "epoll_wait failed on bus %u: %s\n", number, strerror(errno));
+			break;
+		}
+		// commands may add or remove devices and timers, so they are
+		// processed after everything else in this batch
+		bool hasCommands = false;
+		for(int n = 0; n < ret; ++n) {
+			FdKind kind = FdKind(events[n].data.u64 >> 32);
+			int fd = int(events[n].data.u64 & 0xffffffff);
+			switch(kind) {
+			case kFdCommand:
+			{
+				uint64_t count;
+				if(read(fd, &count, sizeof(count)) == sizeof(count))
+					hasCommands = true;
+				break;
+			}
+			case kFdTimer:
+			{
+				uint64_t expirations;
+				if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					break;
+				if(syncPeriod) {
+					// there is only one schedule
+					readSweep();
+					break;
+				}
+				for(auto& schedule : schedules) {
+					if(fd != schedule.second)
+						continue;
+					for(auto& d : devices) {
+						TrillDev& dev = *d.second;
+						if(ALWAYS == dev.shouldRead && !dev.evt && getReadPeriod(dev) == schedule.first && dev.pending.empty())
+							readDevice(dev);
+					}
+				}
+				break;
+			}
+			case kFdGpio:
+				for(auto& d : devices) {
+					TrillDev& dev = *d.second;
+					if(dev.evt && fd == dev.evt->getFd()) {
+						dev.evt->clear();
+						if(DONT != dev.shouldRead && dev.pending.empty())
+							readDevice(dev);
+					}
+				}
+				break;
+			}
+		}
+		if(hasCommands) {
+			oscpkt::Message* msg;
+			while(!shouldStop && (msg = commands.front())) {
+				parseCommand(*msg);
+				commands.pop();
+			}
+			updateSchedules();
+		}
+		if(executor.getNumTasks())
+			executor.runOnce();
+		// one wake-up of the main thread for all that was pushed in
+		// this batch
+		if(pushed) {
+			pushed = false;
+			signalFd(outboundFd);
+		}
+	}
+}
+
+Outbound* Bus::waitPush()
+{
+	Outbound* out;
+	while(!(out = outbound.beginPush()) && !shouldStop) {
+		// the main thread isn't keeping up. Ask it to signal us once
+		// it has made room, checking again in case it just did
+		waitingForSpace = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if((out = outbound.beginPush())) {
+			waitingForSpace = false;
+			break;
+		}
+		signalFd(outboundFd);
+		uint64_t value;
+		if(read(spaceFd, &value, sizeof(value)) != sizeof(value) && EINTR != errno) {
+			fprintf(stderr, "Unable to wait for bus %u's queue: %s\n", number, strerror(errno));
+			return nullptr;
+		}
+	}
+	return out;
+}
+
+void Bus::notifySpace()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(waitingForSpace.exchange(false))
+		signalFd(spaceFd);
+}
+
+void Bus::commitPush()
+{
+	outbound.commitPush();
+	pushed = true;
+}
+
+void Bus::send(const oscpkt::Message& msg)
+{
+	Outbound* out = waitPush();
+	if(!out)
+		return;
+	out->type = Outbound::kMessage;
+	out->msg = msg;
+	commitPush();
+}
+
+void Bus::sendTrillDev(const std::string& command, const TrillDev& dev)
 {
-	gTouchSensors[id] = {std::unique_ptr<Trill>(new Trill(i2cBus, device, i2cAddr)), shouldRead};
-	Trill& t = *gTouchSensors[id].t;
+	oscpkt::Message msg(commandReplyAddress + "/" + command);
+	msg.pushStr(dev.id);
+	Trill& t = *dev.t;
+	msg.pushStr(Trill::getNameFromDevice(t.deviceType()));
+	msg.pushFloat(t.getAddress());
+	msg.pushStr(Trill::getNameFromMode(t.getMode()));
+	send(msg);
+}
+
+void Bus::sendReply(const std::string& command, const std::string& id, int ret)
+{
+	oscpkt::Message msg(commandReplyAddress + command);
+	msg.pushStr(id);
+	msg.pushFloat(ret);
+	send(msg);
+}
+
+unsigned int Bus::getReadPeriod(const TrillDev& dev)
+{
+	if(syncPeriod)
+		return syncPeriod;
+	return std::max(1u, dev.readPeriod ? dev.readPeriod : loopSleep);
+}
+
+// create a timer for each read period used by devices that are read
+// automatically and close the timers no longer in use
+void Bus::updateSchedules()
+{
+	std::set<unsigned int> periods;
+	for(auto& d : devices)
+		if(ALWAYS == d.second->shouldRead && !d.second->evt)
+			periods.insert(getReadPeriod(*d.second));
+	for(auto it = schedules.begin(); it != schedules.end(); ) {
+		if(periods.count(it->first)) {
+			++it;
+		} else {
+			close(it->second);
+			it = schedules.erase(it);
+		}
+	}
+	for(auto period : periods) {
+		if(schedules.count(period))
+			continue;
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(fd < 0) {
+			fprintf(stderr, "Unable to create timer: %s\n", strerror(errno));
+			continue;
+		}
+		struct itimerspec spec;
+		spec.it_interval.tv_sec = period / 1000;
+		spec.it_interval.tv_nsec = (period % 1000) * 1000000;
+		spec.it_value = spec.it_interval;
+		int flags = 0;
+		if(syncPeriod) {
+			// start on a multiple of the period, so that the sweeps
+			// of all buses happen at the same time
+			uint64_t periodNs = period * 1000000ull;
+			uint64_t start = (FrameClock::now() / periodNs + 1) * periodNs;
+			spec.it_value.tv_sec = start / 1000000000;
+			spec.it_value.tv_nsec = start % 1000000000;
+			flags = TFD_TIMER_ABSTIME;
+		}
+		if(timerfd_settime(fd, flags, &spec, nullptr) || epollAdd(epoll, fd, kFdTimer)) {
+			fprintf(stderr, "Unable to start timer: %s\n", strerror(errno));
+			close(fd);
+			continue;
+		}
+		schedules[period] = fd;
+	}
+}
+
+// read all devices that read automatically at the same time
+void Bus::readSweep()
+{
+	sweep.clear();
+	for(auto& d : devices) {
+		TrillDev& dev = *d.second;
+		// devices running commands sit this sweep out
+		if(!dev.pending.empty())
+			continue;
+		bool inSweep = ALWAYS == dev.shouldRead && !dev.evt;
+		// devices in the sweep only scan when they are read, so that
+		// all their scans start together
+		if(inSweep != dev.synced) {
+			if(inSweep) {
+				dev.syncedTrigger = dev.t->getScanTrigger();
+				dev.t->setScanTrigger(Trill::kScanTriggerI2c);
+			} else {
+				dev.t->setScanTrigger(dev.syncedTrigger);
+			}
+			dev.synced = inSweep;
+		}
+		if(inSweep)
+			sweep.add(*dev.t);
+	}
+	// IDs count the periods of CLOCK_MONOTONIC, so that they are the
+	// same on all buses
+	uint64_t periodNs = syncPeriod * 1000000ull;
+	sweep.setNextSweepId((FrameClock::now() + periodNs / 2) / periodNs);
+	sweep.sweep(syncSettle);
+	for(auto& d : devices)
+		if(d.second->synced && d.second->pending.empty())
+			readDevice(*d.second, &sweep);
+}
+
+// read the device and send the reading, or just send the reading if the
+// device has been read as part of a sweep
+void Bus::readDevice(TrillDev& dev, const TrillSweep* sweep)
+{
+	// readings that were explicitly requested are always sent
+	bool force = ShouldRead::ONCE == dev.shouldRead;
+	if(force)
+		dev.shouldRead = ShouldRead::DONT;
+	Trill& t = *(dev.t);
+	if(!sweep)
+		t.readI2C();
+	if(dev.shm)
+		dev.shm->publish(t);
+	float* values = dev.values.data();
+	unsigned int len = 0;
+	const OscFloatsAddress* address;
+	if(Trill::CENTROID == t.getMode()) {
+		unsigned int numTouches = 0;
+		if(t.is2D()) {
+			float size = t.compoundTouchSize();
+			float touchY = t.compoundTouchLocation();
+			float touchX = t.compoundTouchHorizontalLocation();
+			values[1] = touchX;
+			values[2] = touchY;
+			values[3] = size;
+			numTouches = size > 0;
+			len = 1 + numTouches * 3;
+		} else {
+			numTouches = t.getNumTouches();
+			for(unsigned int i = 0; i < numTouches; i++) {
+				values[1 + i * 2] = t.touchLocation(i);
+				values[1 + i * 2 + 1] = t.touchSize(i);
+			}
+			len = 1 + numTouches * 2;
+		}
+		values[0] = numTouches;
+		address = t.is2D() ? &dev.touchXYAddress : &dev.touchesAddress;
+	} else {
+		// only the channels enabled by setChannelMask() are read
+		len = std::min(size_t(t.getNumChannels()), t.rawData.size());
+		for(unsigned int n = 0; n < len; ++n)
+			values[n] = fabsf(t.rawData[n]) < dev.policy.deadband ? 0 : t.rawData[n];
+		address = &dev.diffAddress;
+	}
+	if(!len || !(dev.policy.shouldSend(values, len, FrameClock::now()) || force))
+		return;
+	// readings are dropped rather than waited for if the main thread
+	// can't keep up
+	Outbound* out = outbound.beginPush();
+	if(!out) {
+		if(!droppedReadings++)
+			fprintf(stderr, "Bus %u: dropping readings\n", number);
+		return;
+	}
+	out->type = Outbound::kReading;
+	out->dev = &dev;
+	out->address = address;
+	out->numValues = std::min(len, (unsigned int)Outbound::kMaxValues);
+	std::copy(values, values + out->numValues, out->values);
+	out->hasSweep = sweep;
+	out->sweepId = sweep ? sweep->getSweepId() : 0;
+	TrillStreamPacket& packet = out->packet;
+	size_t payloadSize;
+	const uint8_t* payload = t.getPayload(payloadSize);
+	packet.payloadSize = std::min(payloadSize, size_t(Outbound::kMaxPayload));
+	memcpy(out->payload, payload, packet.payloadSize);
+	packet.payload = out->payload;
+	packet.timestamp = sweep ? sweep->getTimestamp(t) : t.getFrameTimestamp();
+	packet.frameId = t.getFrameIdUnwrapped();
+	packet.scale = t.getRawScale();
+	packet.mode = t.getMode();
+	packet.device = t.deviceType();
+	packet.width = t.getTransmissionWidth();
+	packet.numChannels = t.getNumChannels();
+	packet.id = dev.id.c_str();
+	packet.idLength = std::min(dev.id.size(), size_t(255));
+	commitPush();
+}
+
+int Bus::newTrillDev(const std::string& id, Trill::Device device, uint8_t i2cAddr, ShouldRead shouldRead)
+{
+	deleteTrillDev(id);
+	std::unique_ptr<TrillDev> dev(new TrillDev(id, new Trill(number, device, i2cAddr), shouldRead));
+	Trill& t = *dev->t;
 	if(Trill::NONE == t.deviceType()) {
-		gTouchSensors.erase(id);
+		// let the main thread know that the id is not in use
+		pushDeleted(dev.release());
 		return -1;
 	}
+	if(gShm) {
+		std::string name = "/trill-" + id;
+		std::unique_ptr<TrillShmPublisher> shm(new TrillShmPublisher);
+		if(!shm->setup(name))
+			dev->shm = std::move(shm);
+	}
+	std::string address = baseAddress + "readings/" + id;
+	dev->touchesAddress.setup(address + "/touches", 11);
+	dev->touchXYAddress.setup(address + "/touchXY", 4);
+	dev->diffAddress.setup(address + "/diff", t.rawData.size());
+	dev->values.resize(std::max(size_t(11), t.rawData.size()));
 	// ensure the sensor scans continuously even though we read it only
 	// occasionally
 	t.setAutoScanInterval(1);
 	printf("Device id: %s\n", id.c_str());
 	t.printDetails();
-	sendOscTrillDev("new", id, gTouchSensors[id]);
+	Outbound* out = waitPush();
+	if(out) {
+		out->type = Outbound::kCreated;
+		out->dev = dev.get();
+		commitPush();
+	}
+	sendTrillDev("new", *dev);
+	devices[id] = std::move(dev);
 	return 0;
 }
 
-void createAllDevicesOnBus(unsigned int i2cBus, bool autoRead) {
-	printf("Trill devices detected on bus %d\n", i2cBus);
+void Bus::deleteTrillDev(const std::string& id)
+{
+	auto it = devices.find(id);
+	if(it == devices.end())
+		return;
+	// the device may still have readings in the outbound queue, so
+	// it is freed by the main thread, after those
+	it->second->evt.reset();
+	sweep.remove(*it->second->t);
+	if(it->second->pending.empty()) {
+		pushDeleted(it->second.release());
+	} else {
+		// its commands' task pushes it once the running one completes
+		it->second->deleted = true;
+		it->second.release();
+	}
+	devices.erase(it);
+}
+
+void Bus::pushDeleted(TrillDev* dev)
+{
+	Outbound* out = waitPush();
+	if(out) {
+		out->type = Outbound::kDeleted;
+		out->dev = dev;
+		commitPush();
+	}
+}
+
+// queue a task that uses the device. The tasks of each device run one
+// after the other on the executor, so that a task waiting for an ack
+// lets the bus thread read the other devices in the meantime
+void Bus::runOnDevice(TrillDev& dev, const std::function<void()>& task)
+{
+	dev.pending.push_back(task);
+	if(dev.pending.size() > 1)
+		return; // the device's tasks are already running
+	TrillDev* d = &dev;
+	executor.spawn([this, d]() {
+		while(!d->pending.empty() && !d->deleted) {
+			d->pending.front()();
+			d->pending.pop_front();
+		}
+		if(d->deleted) {
+			d->pending.clear();
+			pushDeleted(d);
+		}
+	});
+}
+
+// run a command that maps to a method of Trill and reply with its result
+void Bus::runCommand(TrillDev& dev, const std::string& command, const std::function<int(Trill&)>& apply)
+{
+	runOnDevice(dev, [this, &dev, command, apply]() {
+		sendReply(command, dev.id, apply(*dev.t));
+	});
+}
+
+void Bus::createAllDevices() {
+	printf("Trill devices detected on bus %d\n", number);
 	for(uint8_t addr = 0x20; addr <= 0x50; ++addr)
 	{
-		Trill::Device device = Trill::probe(i2cBus, addr);
+		Trill::Device device = Trill::probe(number, addr);
 		if(Trill::NONE != device)
 		{
-			std::string id = std::to_string(i2cBus) + "-" + std::to_string(addr) + "-" + Trill::getNameFromDevice(device);
-			ShouldRead shouldRead = autoRead ? ALWAYS : DONT;
-			newTrillDev(id, i2cBus, device, addr, shouldRead);
+			std::string id = std::to_string(number) + "-" + std::to_string(addr) + "-" + Trill::getNameFromDevice(device);
+			ShouldRead shouldRead = autoReadAll ? ALWAYS : DONT;
+			newTrillDev(id, device, addr, shouldRead);
+		}
+	}
+}
+
+Bus* getBus(unsigned int number)
+{
+	std::unique_ptr<Bus>& bus = gBuses[number];
+	if(!bus)
+		bus.reset(new Bus(number, gOutboundFd));
+	return bus.get();
+}
+
+int sendReadings()
+{
+	if(!gReadings.getNumMessages())
+		return 0;
+	bool ok;
+	if(gBundle) {
+		ok = gSock.sendPacket(gReadings.data(), gReadings.size());
+	} else {
+		size_t size;
+		const char* data = gReadings.firstMessage(size);
+		ok = gSock.sendPacket(data, size);
+	}
+	gReadings.begin(OscBundle::now());
+	gReadingsHaveSweep = false;
+	if(!ok) {
+		fprintf(stderr, "could not send\n");
+		return -1;
+	}
+	return 0;
+}
+
+// process everything the bus threads have sent
+void processOutbound()
+{
+	uint64_t count;
+	if(read(gOutboundFd, &count, sizeof(count)) != sizeof(count))
+		return;
+	for(auto& b : gBuses) {
+		Bus& bus = *b.second;
+		Outbound* out;
+		while((out = bus.outbound.front())) {
+			switch(out->type) {
+			case Outbound::kReading:
+				if(gStream)
+					gStream->add(out->packet);
+				if(gRecord)
+					gRecord->add(out->packet);
+				if(gOscReadings) {
+					size_t size = OscBundle::getSize(*out->address, out->numValues);
+					if(out->hasSweep)
+						size += OscBundle::getInt32Size(gSweepAddress);
+					// a bundle that is too large is dropped or
+					// fragmented: send what we have first
+					if(gBundle && gReadings.getNumMessages() && gReadings.size() + size > kMaxBundleSize)
+						sendReadings();
+					if(out->hasSweep && (!gReadingsHaveSweep || gReadingsSweepId != out->sweepId)) {
+						gReadings.addInt32(gSweepAddress, out->sweepId);
+						if(!gBundle)
+							sendReadings();
+						gReadingsHaveSweep = true;
+						gReadingsSweepId = out->sweepId;
+					}
+					gReadings.add(*out->address, out->values, out->numValues);
+					if(!gBundle)
+						sendReadings();
+				}
+				break;
+			case Outbound::kMessage:
+				sendOsc(out->msg);
+				break;
+			case Outbound::kCreated:
+				gDeviceBus[out->dev->id] = b.first;
+				break;
+			case Outbound::kDeleted:
+			{
+				auto it = gDeviceBus.find(out->dev->id);
+				// unless the id has moved to a different bus
+				if(it != gDeviceBus.end() && it->second == b.first)
+					gDeviceBus.erase(it);
+				delete out->dev;
+				break;
+			}
+			}
+			bus.outbound.pop();
+		}
+		bus.notifySpace();
+	}
+}
+
+// process all the packets waiting on the socket
+void processInbound(unsigned int inPort)
+{
+	while(!shouldStop && gSock.isOk() && gSock.receiveNextPacket(0)) {
+		static bool connected = false;
+		if(!connected) {
+			std::vector<std::string> origin = split(gSock.packetOrigin().asString(), ':');
+			if(origin.size() != 2) {
+				fprintf(stderr, "Something wrong with the address we received from\n");
+				continue;
+			}
+			std::cout << "Connecting to " << origin[0] << ":" << origin[1] << "\n";
+			gSock.connectTo(origin[0], origin[1]);
+			gSock.bindTo(inPort);
+			watchSocket();
+			connected = true;
+		}
+
+		oscpkt::PacketReader pr(gSock.packetData(), gSock.packetSize());
+		oscpkt::Message *msg;
+		while (!shouldStop && pr.isOk() && (msg = pr.popMessage()) != 0) {
+			std::cout << "Received " << *msg << "\n";
+			parseOsc(*msg);
 		}
 	}
 }
 
-static std::string baseAddress = "/trill/";
 int main(int argc, char** argv)
 {
 	int i2cBus = -1;
 	unsigned int inPort = 7562;
 	std::string remote = "localhost:7563";
+	std::string tracePath;
 
+	gEpoll = epoll_create1(EPOLL_CLOEXEC);
+	gOutboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(gEpoll < 0 || gOutboundFd < 0 || epollAdd(gEpoll, gOutboundFd, kFdOutbound)) {
+		fprintf(stderr, "Unable to create epoll instance: %s\n", strerror(errno));
+		return 1;
+	}
+	// SIGINT is delivered through a signalfd, so that the main loop only
+	// ever waits in epoll_wait(). This is done before any bus thread
+	// starts, so that they all inherit the signal mask
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, nullptr);
+	int signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(signalFd < 0 || epollAdd(gEpoll, signalFd, kFdSignal)) {
+		fprintf(stderr, "Unable to handle signals\n");
+		return 1;
+	}
 	int c = 1;
 	while(c < argc)
 	{
@@ -170,6 +1201,35 @@ int main(int argc, char** argv)
 				}
 			}
 		}
+		if(std::string("--shm") == std::string(argv[c])) {
+			gShm = true;
+		}
+		if(std::string("--stream") == std::string(argv[c])) {
+			++c;
+			if(c < argc) {
+				gStream.reset(new StreamSender);
+				if(gStream->setup(argv[c]))
+					return 1;
+			}
+		}
+		if(std::string("--record") == std::string(argv[c])) {
+			++c;
+			if(c < argc) {
+				gRecord.reset(new TrillArchiveWriter);
+				if(gRecord->open(argv[c]))
+					return 1;
+			}
+		}
+		if(std::string("--trace") == std::string(argv[c])) {
+			++c;
+			if(c < argc) {
+				tracePath = argv[c];
+				TrillTrace::enable(true);
+			}
+		}
+		if(std::string("--stream-only") == std::string(argv[c])) {
+			gOscReadings = false;
+		}
 		if(std::string("--auto") == std::string(argv[c])) {
 			++c;
 			if(c < argc) {
@@ -188,95 +1248,54 @@ int main(int argc, char** argv)
 			gSock.connectTo(spl[0], std::stoi(spl[1]));
 			std::cout << "Detecting all devices on bus " << i2cBus << ", sending to " << remote << "\n(remote address will be reset when the first inbound message is received)\n";
 			gAutoReadAll = true;
-			createAllDevicesOnBus(i2cBus, gAutoReadAll);
+			oscpkt::Message msg(baseAddress + "command/createAll");
+			msg.pushFloat(i2cBus);
+			parseOsc(msg);
 		}
 		++c;
 	}
 	std::cout << "Listening on port " << inPort << "\n";
 
-	signal(SIGINT, interrupt_handler);
 	gSock.bindTo(inPort);
+	watchSocket();
 
-	std::string address;
+	const unsigned int kMaxEvents = 16;
+	struct epoll_event events[kMaxEvents];
+	gReadings.begin(OscBundle::now());
 	while(!shouldStop) {
-		for(auto& touchSensor : gTouchSensors) {
-			if(ShouldRead::DONT == touchSensor.second.shouldRead)
+		int ret = epoll_wait(gEpoll, events, kMaxEvents, -1);
+		if(ret < 0) {
+			if(EINTR == errno)
 				continue;
-			if(ShouldRead::ONCE == touchSensor.second.shouldRead)
-				touchSensor.second.shouldRead = ShouldRead::DONT;
-			Trill& t = *(touchSensor.second.t);
-			t.readI2C();
-			address = baseAddress + "readings/" + touchSensor.first;
-			if(Trill::CENTROID == t.getMode()) {
-				float values[11];
-				unsigned int len = 0;
-				unsigned int numTouches = 0;
-				if(t.is2D()) {
-					address += "/touchXY";
-					float size = t.compoundTouchSize();
-					float touchY = t.compoundTouchLocation();
-					float touchX = t.compoundTouchHorizontalLocation();
-					values[1] = touchX;
-					values[2] = touchY;
-					values[3] = size;
-					numTouches = size > 0;
-					len = 1 + numTouches * 3;
-				} else {
-					address += "/touches";
-					numTouches = t.getNumTouches();
-					for(unsigned int i = 0; i < numTouches; i++) {
-						values[1 + i * 2] = t.touchLocation(i);
-						values[1 + i * 2 + 1] = t.touchSize(i);
-					}
-					len = 1 + numTouches * 2;
-				}
-				values[0] = numTouches;
-				sendOscFloats(address, values, len);
-			} else {
-				address += "/diff";
-				sendOscFloats(address, t.rawData.data(), t.rawData.size());
-			}
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
 		}
-		// process incoming mesages
-		while(!shouldStop && gSock.isOk() && gSock.receiveNextPacket(1)) {// timeout
-			static bool connected = false;
-			if(!connected) {
-				std::vector<std::string> origin = split(gSock.packetOrigin().asString(), ':');
-				if(origin.size() != 2) {
-					fprintf(stderr, "Something wrong with the address we received from\n");
-					continue;
-				}
-				std::cout << "Connecting to " << origin[0] << ":" << origin[1] << "\n";
-				gSock.connectTo(origin[0], origin[1]);
-				gSock.bindTo(inPort);
-				connected = true;
-			}
-
-			oscpkt::PacketReader pr(gSock.packetData(), gSock.packetSize());
-			oscpkt::Message *msg;
-			while (!shouldStop && pr.isOk() && (msg = pr.popMessage()) != 0) {
-				std::cout << "Received " << *msg << "\n";
-				parseOsc(*msg);
-			}
-
-		}
-		int sleep = gLoopSleep;
-		// sleep overall about gLoopSleep ms, but if it's too large, do it
-		// in smaller chunks to be reactive to incoming messages
-		int chunk = 10; // chunks of 10ms
-		int slept = 0;
-		while(!shouldStop && sleep > 0) {
-			if(sleep >= chunk) {
-				sleep -= chunk;
-				slept += chunk;
-				usleep(chunk * 1000);
-			} else {
-				slept += sleep;
-				usleep(sleep * 1000);
-				sleep = 0;
+		// everything received in this batch goes out as one sweep
+		gReadings.begin(OscBundle::now());
+		for(int n = 0; n < ret; ++n) {
+			FdKind kind = FdKind(events[n].data.u64 >> 32);
+			switch(kind) {
+			case kFdSignal:
+				shouldStop = true;
+				break;
+			case kFdSocket:
+				processInbound(inPort);
+				break;
+			case kFdOutbound:
+				processOutbound();
+				break;
 			}
 		}
+		sendReadings();
+		if(gStream)
+			gStream->send();
 	}
+	// stop all bus threads
+	gBuses.clear();
+	if(gRecord && gRecord->close())
+		return 1;
+	if(tracePath.size() && TrillTrace::save(tracePath))
+		return 1;
 	return 0;
 }
 
@@ -294,8 +1313,9 @@ std::vector<std::string> split(const std::string& s, char delimiter)
 	return tokens;
 }
 
-int sendOscList();
-
+// Commands are parsed here only to route them: all but the commands that
+// only concern the main thread are applied by the bus threads, in
+// Bus::parseCommand().
 int parseOsc(oscpkt::Message& msg)
 {
 	oscpkt::Message::ArgReader args = msg.partialMatch(baseAddress + "command/");
@@ -312,6 +1332,109 @@ int parseOsc(oscpkt::Message& msg)
 	const std::string command = tokens.back();
 	printf("Command: %s\n", command.c_str());
 
+	// tmp variables for args parsing
+	float value0;
+	float value1;
+
+	// global commands
+	if("bundle" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("bundle %f\n", value0);
+		sendReadings();
+		gBundle = value0;
+		return 0;
+	} else if("createAll" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		getBus(value0)->post(msg);
+		return 0;
+	} else if("listAll" == command || "deleteAll" == command || "autoReadAll" == command || "loopSleep" == command || "sync" == command) {
+		// keep track of the settings for buses created later
+		if("f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+			if("autoReadAll" == command)
+				gAutoReadAll = value0;
+			if("loopSleep" == command)
+				gLoopSleep = value0;
+		}
+		if("sync" == command && "ff" == typeTags && args.popFloat(value0).popFloat(value1).isOkNoMoreArgs()) {
+			gSyncPeriod = value0;
+			gSyncSettle = value1;
+		}
+		for(auto& b : gBuses)
+			b.second->post(msg);
+		return 0;
+	}
+
+	//instance commands: they all start with an id
+	// check and retrieve first argument: id
+	if(typeTags[0] != 's') {
+		std::cerr << "Unknown message or wrong argument list " << msg << "\n";
+		return -1;
+	}
+	std::string id;
+	args.popStr(id);
+	if("new" == command) {
+		float bus;
+		if(typeTags.size() < 2 || 'f' != typeTags[1] || !args.popFloat(bus)) {
+			std::cerr << "Unknown message or wrong argument list " << msg << "\n";
+			return 1;
+		}
+		auto it = gDeviceBus.find(id);
+		if(it != gDeviceBus.end() && it->second != bus) {
+			// the id moves to a different bus
+			oscpkt::Message del(baseAddress + "command/delete");
+			del.pushStr(id);
+			gBuses[it->second]->post(del);
+		}
+		gDeviceBus[id] = bus;
+		getBus(bus)->post(msg);
+		return 0;
+	}
+	auto it = gDeviceBus.find(id);
+	if(it == gDeviceBus.end()) {
+		fprintf(stderr, "Unknown id: %s at %s\n", id.c_str(), msg.addressPattern().c_str());
+		return -1;
+	}
+	gBuses[it->second]->post(msg);
+	return 0;
+}
+
+static int getScanTriggerFromName(const std::string& name, Trill::ScanTriggerMode& mode)
+{
+	const std::map<std::string, Trill::ScanTriggerMode> modes = {
+		{"disabled", Trill::kScanTriggerDisabled},
+		{"i2c", Trill::kScanTriggerI2c},
+		{"timer", Trill::kScanTriggerTimer},
+		{"i2cOrTimer", Trill::kScanTriggerI2cOrTimer},
+	};
+	auto it = modes.find(name);
+	if(it == modes.end()) {
+		fprintf(stderr, "Unknown scan trigger: %s\n", name.c_str());
+		return 1;
+	}
+	mode = it->second;
+	return 0;
+}
+
+static int getEventModeFromName(const std::string& name, Trill::EventMode& mode)
+{
+	const std::map<std::string, Trill::EventMode> modes = {
+		{"touch", Trill::kEventModeTouch},
+		{"change", Trill::kEventModeChange},
+		{"always", Trill::kEventModeAlways},
+	};
+	auto it = modes.find(name);
+	if(it == modes.end()) {
+		fprintf(stderr, "Unknown event mode: %s\n", name.c_str());
+		return 1;
+	}
+	mode = it->second;
+	return 0;
+}
+
+int Bus::parseCommand(oscpkt::Message& msg)
+{
+	oscpkt::Message::ArgReader args = msg.partialMatch(baseAddress + "command/");
+	std::string typeTags = msg.typeTags();
+	const std::string command = split(msg.addressPattern(), '/').back();
+
 	// tmp variables for args parsing
 	float value0;
 	float value1;
@@ -320,26 +1443,47 @@ int parseOsc(oscpkt::Message& msg)
 	// global commands
 	if("listAll" == command && args.isOkNoMoreArgs()) {
 		printf("listAll\n");
-		sendOscList();
+		for(auto& d : devices)
+			sendTrillDev("list", *d.second);
 		return 0;
 	} else if("createAll" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs())
 	{
 		printf("createAll %f\n", value0);
-		createAllDevicesOnBus(value0, gAutoReadAll);
+		createAllDevices();
 		return 0;
 	} else if ("deleteAll" == command && args.isOkNoMoreArgs()) {
 		printf("deleteAll\n");
-		gTouchSensors.clear();
+		while(devices.size())
+			deleteTrillDev(devices.begin()->first);
 		return 0;
 	} else if ("autoReadAll" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
 		printf("autoReadAll %f\n", value0);
-		gAutoReadAll = value0;
-		for(auto& t : gTouchSensors)
-			t.second.shouldRead = gAutoReadAll ? ALWAYS : DONT;
+		autoReadAll = value0;
+		for(auto& d : devices)
+			d.second->shouldRead = autoReadAll ? ALWAYS : DONT;
 		return 0;
 	} else if ("loopSleep" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
 		printf("loopSleep %f\n", value0);
-		gLoopSleep = value0;
+		loopSleep = value0;
+		return 0;
+	} else if ("sync" == command && "ff" == typeTags && args.popFloat(value0).popFloat(value1).isOkNoMoreArgs()) {
+		printf("sync %f %f\n", value0, value1);
+		syncPeriod = value0;
+		syncSettle = value1;
+		if(!syncPeriod) {
+			// go back to the scan trigger each device had before
+			for(auto& d : devices) {
+				TrillDev& dev = *d.second;
+				if(dev.synced)
+					runOnDevice(dev, [&dev]() { dev.t->setScanTrigger(dev.syncedTrigger); });
+				dev.synced = false;
+			}
+		}
+		// recreate the schedules for the new mode
+		for(auto& s : schedules)
+			close(s.second);
+		schedules.clear();
+		updateSchedules();
 		return 0;
 	}
 
@@ -354,7 +1498,7 @@ int parseOsc(oscpkt::Message& msg)
 	typeTags = typeTags.substr(1);// peel it off
 
 	// only "new" can use a non-existing id
-	if(gTouchSensors.find(id) == gTouchSensors.end() && "new" != command) {
+	if(devices.find(id) == devices.end() && "new" != command) {
 		fprintf(stderr, "Unknown id: %s at %s\n", id.c_str(), msg.addressPattern().c_str());
 		return -1;
 	}
@@ -380,49 +1524,135 @@ int parseOsc(oscpkt::Message& msg)
 		}
 		if(ok) {
 			printf("new %s %f %s %f\n", id.c_str(), bus, deviceName.c_str(), i2cAddr);
-			newTrillDev(id, bus, Trill::getDeviceFromName(deviceName), i2cAddr, gAutoReadAll ? ALWAYS : DONT);
+			newTrillDev(id, Trill::getDeviceFromName(deviceName), i2cAddr, autoReadAll ? ALWAYS : DONT);
 			return 0;
 		} else {
 			std::cerr << "Unknown message or wrong argument list " << msg << "\n";
 			return 1;
 		}
 	} else if ("delete" == command) {
-		gTouchSensors.erase(id);
+		deleteTrillDev(id);
 		printf("delete\n");
 		return 0;
 	}
 	// commands below need to access a device. If we get to this line, the
-	// device exists in gTouchSensors
-	Trill& t = *(gTouchSensors[id].t);
+	// device exists in devices
+	TrillDev& dev = *devices[id];
 	int ret;
 	printf("id: %s - ", id.c_str());
 	if ("autoRead" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
 		printf("autoRead: %f\n", value0);
-		gTouchSensors[id].shouldRead = value0 ? ALWAYS : DONT;
+		dev.shouldRead = value0 ? ALWAYS : DONT;
 	} else if ("readI2C" == command && args.isOkNoMoreArgs()) {
 		printf("readI2C\n");
-		gTouchSensors[id].shouldRead = ONCE;
-	} // commands below simply map to the corresponding methods of the Trill class
+		dev.shouldRead = ONCE;
+		if(dev.pending.empty())
+			readDevice(dev);
+		else
+			runOnDevice(dev, [this, &dev]() { readDevice(dev); });
+	} else if ("setReadPeriod" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setReadPeriod: %f\n", value0);
+		dev.readPeriod = std::max(0.f, value0);
+	} else if ("setSendThreshold" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setSendThreshold: %f\n", value0);
+		dev.policy.epsilon = value0;
+	} else if ("setSendRate" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setSendRate: %f\n", value0);
+		dev.policy.maxRate = std::max(0.f, value0);
+	} else if ("setKeepalive" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setKeepalive: %f\n", value0);
+		dev.policy.keepalive = std::max(0.f, value0);
+	} else if ("setDeadband" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setDeadband: %f\n", value0);
+		dev.policy.deadband = std::max(0.f, value0);
+	} else if ("setEventPin" == command && ("f" == typeTags || "fs" == typeTags) && args.popFloat(value0)) {
+		str0 = "rising";
+		if("fs" == typeTags)
+			args.popStr(str0);
+		if(!args.isOkNoMoreArgs()) {
+			std::cerr << "Unknown message or wrong argument list " << msg << "\n";
+			return 1;
+		}
+		printf("setEventPin: %f %s\n", value0, str0.c_str());
+		dev.evt.reset();
+		ret = 0;
+		if(value0 >= 0) {
+			std::unique_ptr<GpioEvent> evt(new GpioEvent);
+			ret = evt->setup(value0, str0) || epollAdd(epoll, evt->getFd(), kFdGpio, EPOLLPRI);
+			if(!ret) {
+				// make sure we also get an event on the frame after
+				// a touch ends
+				runOnDevice(dev, [&dev]() { dev.t->setEventMode(Trill::kEventModeChange); });
+				dev.evt = std::move(evt);
+			}
+		}
+		sendReply(command, id, ret);
+	} // commands below simply map to the corresponding methods of the Trill class,
+	// and run on the executor
 	else if("updateBaseline" == command && args.isOkNoMoreArgs()) {
 		printf("updateBaseline\n");
-		ret = t.updateBaseline();
-		sendOscReply(command, id, ret);
+		runCommand(dev, command, [](Trill& t) { return t.updateBaseline(); });
 	} else if ("setScanSettings" == command && "ff" == typeTags && args.popFloat(value0).popFloat(value1).isOkNoMoreArgs()) {
 		printf("setScanSettings %f %f\n", value0, value1);
-		ret = t.setScanSettings(value0, value1);
-		sendOscReply(command, id, ret);
+		runCommand(dev, command, [=](Trill& t) { return t.setScanSettings(value0, value1); });
 	} else if ("setPrescaler" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
 		printf("setPrescaler %f\n", value0);
-		ret = t.setPrescaler(value0);
-		sendOscReply(command, id, ret);
+		runCommand(dev, command, [=](Trill& t) { return t.setPrescaler(value0); });
 	} else if ("setNoiseThreshold" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
 		printf("setNoiseThreshold %f\n", value0);
-		ret = t.setNoiseThreshold(value0);
-		sendOscReply(command, id, ret);
+		runCommand(dev, command, [=](Trill& t) { return t.setNoiseThreshold(value0); });
 	} else if ("setMode" == command && "s" == typeTags && args.popStr(str0).isOkNoMoreArgs()) {
 		printf("setMode: %s\n", str0.c_str());
-		ret = t.setMode(Trill::getModeFromName(str0));
-		sendOscReply(command, id, ret);
+		runCommand(dev, command, [=](Trill& t) { return t.setMode(Trill::getModeFromName(str0)); });
+	} else if ("setChannelMask" == command && ("f" == typeTags || "i" == typeTags)) {
+		// masks of more than 24 channels can't be represented exactly
+		// as a float, so an int32 is also accepted
+		uint32_t mask;
+		if("i" == typeTags) {
+			int32_t value;
+			args.popInt32(value);
+			mask = value;
+		} else {
+			args.popFloat(value0);
+			mask = value0;
+		}
+		if(!args.isOkNoMoreArgs()) {
+			std::cerr << "Unknown message or wrong argument list " << msg << "\n";
+			return 1;
+		}
+		printf("setChannelMask %#x\n", mask);
+		runCommand(dev, command, [=](Trill& t) { return t.setChannelMask(mask); });
+	} else if ("setTransmissionFormat" == command && "ff" == typeTags && args.popFloat(value0).popFloat(value1).isOkNoMoreArgs()) {
+		printf("setTransmissionFormat %f %f\n", value0, value1);
+		runCommand(dev, command, [=](Trill& t) { return t.setTransmissionFormat(value0, value1); });
+	} else if ("setTimerPeriod" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setTimerPeriod %f\n", value0);
+		runCommand(dev, command, [=](Trill& t) { return t.setTimerPeriod(value0); });
+	} else if ("setScanTrigger" == command && "s" == typeTags && args.popStr(str0).isOkNoMoreArgs()) {
+		printf("setScanTrigger: %s\n", str0.c_str());
+		Trill::ScanTriggerMode mode;
+		if(getScanTriggerFromName(str0, mode)) {
+			sendReply(command, id, 1);
+		} else if(dev.synced) {
+			// a device in the sweep gets it once it leaves the sweep
+			dev.syncedTrigger = mode;
+			sendReply(command, id, 0);
+		} else {
+			runCommand(dev, command, [=](Trill& t) { return t.setScanTrigger(mode); });
+		}
+	} else if ("setEventMode" == command && "s" == typeTags && args.popStr(str0).isOkNoMoreArgs()) {
+		printf("setEventMode: %s\n", str0.c_str());
+		Trill::EventMode mode;
+		if(getEventModeFromName(str0, mode))
+			sendReply(command, id, 1);
+		else
+			runCommand(dev, command, [=](Trill& t) { return t.setEventMode(mode); });
+	} else if ("setIDACValue" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setIDACValue %f\n", value0);
+		runCommand(dev, command, [=](Trill& t) { return t.setIDACValue(value0); });
+	} else if ("setMinimumTouchSize" == command && "f" == typeTags && args.popFloat(value0).isOkNoMoreArgs()) {
+		printf("setMinimumTouchSize %f\n", value0);
+		runCommand(dev, command, [=](Trill& t) { return t.setMinimumTouchSize(value0); });
 	} else {
 		std::cerr << "Unknown message or wrong argument list " << msg << "\n";
 		return 1;
@@ -441,40 +1671,3 @@ int sendOsc(const oscpkt::Message& msg)
 	}
 	return 0;
 }
-
-int sendOscFloats(const std::string& address, float* values, unsigned int size)
-{
-	if(!size)
-		return 0;
-	oscpkt::Message msg(address);
-	for(unsigned int n = 0; n < size; ++n)
-		msg.pushFloat(values[n]);
-	return sendOsc(msg);
-}
-
-std::string commandReplyAddress = baseAddress + "commandreply/";
-int sendOscList()
-{
-	for(auto& d : gTouchSensors)
-		sendOscTrillDev("list", d.first, d.second);
-	return 0;
-}
-
-int sendOscTrillDev(const std::string& command, const std::string& id, const TrillDev& trillDev)
-{
-	oscpkt::Message msg(commandReplyAddress + "/" + command);
-	msg.pushStr(id);
-	Trill& t = *trillDev.t;
-	msg.pushStr(Trill::getNameFromDevice(t.deviceType()));
-	msg.pushFloat(t.getAddress());
-	msg.pushStr(Trill::getNameFromMode(t.getMode()));
-	return sendOsc(msg);
-}
-
-int sendOscReply(const std::string& command, const std::string& id, int ret)
-{
-	oscpkt::Message msg(commandReplyAddress + command);
-	msg.pushStr(id);
-	msg.pushFloat(ret);
-	return sendOsc(msg);
-}
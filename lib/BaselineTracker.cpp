@@ -0,0 +1,123 @@
+#include "BaselineTracker.h"
+#include "Trill.h"
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BASELINE_TRACKER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BASELINE_TRACKER_SSE2
+#endif
+
+BaselineTracker::BaselineTracker(unsigned int numChannels, float timeConstant, float touchThreshold, float noiseThreshold)
+{
+	setup(numChannels, timeConstant, touchThreshold, noiseThreshold);
+}
+
+int BaselineTracker::setup(unsigned int numChannels, float timeConstant, float touchThreshold, float noiseThreshold)
+{
+	this->numChannels = numChannels;
+	baseline.assign(numChannels, 0);
+	diff.assign(numChannels, 0);
+	setTimeConstant(timeConstant);
+	setTouchThreshold(touchThreshold);
+	setNoiseThreshold(noiseThreshold);
+	updateBaseline();
+	return 0;
+}
+
+void BaselineTracker::setTimeConstant(float timeConstant)
+{
+	if(timeConstant < 1)
+		timeConstant = 1;
+	coefficient = 1 - expf(-1.f / timeConstant);
+}
+
+void BaselineTracker::setTouchThreshold(float threshold)
+{
+	touchThreshold = threshold;
+}
+
+void BaselineTracker::setNoiseThreshold(float threshold)
+{
+	noiseThreshold = threshold;
+}
+
+void BaselineTracker::updateBaseline()
+{
+	shouldResetBaseline = true;
+}
+
+void BaselineTracker::process(const float* rawData)
+{
+	float* base = baseline.data();
+	float* out = diff.data();
+	if(shouldResetBaseline)
+	{
+		for(unsigned int n = 0; n < numChannels; ++n)
+			base[n] = rawData[n];
+		shouldResetBaseline = false;
+	}
+	uint32_t mask = 0;
+	unsigned int n = 0;
+#if defined(BASELINE_TRACKER_NEON)
+	const float32x4_t vCoeff = vdupq_n_f32(coefficient);
+	const float32x4_t vTouch = vdupq_n_f32(touchThreshold);
+	const float32x4_t vNoise = vdupq_n_f32(noiseThreshold);
+	const uint32_t bitsArr[4] = { 1, 2, 4, 8 };
+	const uint32x4_t vBits = vld1q_u32(bitsArr);
+	for(; n + 4 <= numChannels; n += 4)
+	{
+		float32x4_t b = vld1q_f32(base + n);
+		float32x4_t d = vsubq_f32(vld1q_f32(rawData + n), b);
+		uint32x4_t touched = vcgtq_f32(d, vTouch);
+		// only untouched channels move their baseline
+		float32x4_t step = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(d, vCoeff)), touched));
+		vst1q_f32(base + n, vaddq_f32(b, step));
+		uint32x4_t active = vcgeq_f32(d, vNoise);
+		vst1q_f32(out + n, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(d), active)));
+		uint64x2_t m = vpaddlq_u32(vandq_u32(touched, vBits));
+		if(n < 32)
+			mask |= uint32_t(vgetq_lane_u64(m, 0) + vgetq_lane_u64(m, 1)) << n;
+	}
+#elif defined(BASELINE_TRACKER_SSE2)
+	const __m128 vCoeff = _mm_set1_ps(coefficient);
+	const __m128 vTouch = _mm_set1_ps(touchThreshold);
+	const __m128 vNoise = _mm_set1_ps(noiseThreshold);
+	for(; n + 4 <= numChannels; n += 4)
+	{
+		__m128 b = _mm_loadu_ps(base + n);
+		__m128 d = _mm_sub_ps(_mm_loadu_ps(rawData + n), b);
+		__m128 touched = _mm_cmpgt_ps(d, vTouch);
+		// only untouched channels move their baseline
+		__m128 step = _mm_andnot_ps(touched, _mm_mul_ps(d, vCoeff));
+		_mm_storeu_ps(base + n, _mm_add_ps(b, step));
+		__m128 active = _mm_cmpge_ps(d, vNoise);
+		_mm_storeu_ps(out + n, _mm_and_ps(d, active));
+		if(n < 32)
+			mask |= uint32_t(_mm_movemask_ps(touched)) << n;
+	}
+#endif
+	for(; n < numChannels; ++n)
+	{
+		float d = rawData[n] - base[n];
+		bool touched = d > touchThreshold;
+		if(!touched)
+			base[n] += d * coefficient;
+		out[n] = d >= noiseThreshold ? d : 0;
+		if(touched && n < 32)
+			mask |= 1u << n;
+	}
+	touchedMask = mask;
+}
+
+int BaselineTracker::process(Trill& trill)
+{
+	if(Trill::RAW != trill.getMode())
+		return 1;
+	if(trill.getNumChannels() != numChannels)
+		return 2;
+	process(trill.rawData.data());
+	return 0;
+}
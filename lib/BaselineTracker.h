@@ -0,0 +1,89 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+class Trill;
+
+/**
+ * \brief Host-side baseline tracking for data read in Trill::RAW mode.
+ *
+ * The baseline of each channel follows the raw readings through a slow
+ * one-pole low-pass filter, which compensates for drift caused e.g.: by
+ * temperature and humidity. While a channel is touched, i.e.: while its
+ * reading exceeds the baseline by more than the touch threshold, its
+ * baseline is frozen, so that long touches are not absorbed into it.
+ *
+ * The output is equivalent to what the device returns in Trill::DIFF
+ * mode: the difference between the raw reading and the baseline, set to
+ * zero where it is below the noise threshold. This way, RAW data can be
+ * streamed once and both the RAW and DIFF views derived from it, without
+ * switching the mode of the device or disturbing its readings with
+ * Trill::updateBaseline().
+ */
+class BaselineTracker
+{
+public:
+	BaselineTracker() {};
+	/**
+	 * @param numChannels the number of channels.
+	 * @param timeConstant the time constant of the baseline filter,
+	 * expressed in frames.
+	 * @param touchThreshold how far above the baseline a reading has to
+	 * be for the channel to be considered touched.
+	 * @param noiseThreshold readings whose difference from the baseline
+	 * is below this value are set to 0 in the output.
+	 */
+	BaselineTracker(unsigned int numChannels, float timeConstant, float touchThreshold, float noiseThreshold);
+	/**
+	 * \copydoc BaselineTracker::BaselineTracker(unsigned int, float, float, float)
+	 */
+	int setup(unsigned int numChannels, float timeConstant, float touchThreshold, float noiseThreshold);
+	void setTimeConstant(float timeConstant);
+	void setTouchThreshold(float threshold);
+	void setNoiseThreshold(float threshold);
+	/**
+	 * Reset the baseline of all channels to the next frame that will
+	 * be processed. This is the host-side equivalent of
+	 * Trill::updateBaseline().
+	 */
+	void updateBaseline();
+	/**
+	 * Process a frame of raw readings.
+	 *
+	 * @param rawData an array containing one value per channel.
+	 */
+	void process(const float* rawData);
+	/**
+	 * Process the current frame of a Trill device in Trill::RAW mode.
+	 *
+	 * @return 0 on success, or an error code if the device is in a
+	 * different mode.
+	 */
+	int process(Trill& trill);
+	/**
+	 * Get the number of channels.
+	 */
+	unsigned int getNumChannels() const { return numChannels; }
+	/**
+	 * Get the DIFF-equivalent readings for the last frame.
+	 */
+	const float* getDiff() const { return diff.data(); }
+	/**
+	 * Get the current baseline.
+	 */
+	const float* getBaseline() const { return baseline.data(); }
+	/**
+	 * Get a bitmask of the channels that were touched in the last frame.
+	 * Only valid for the first 32 channels.
+	 */
+	uint32_t getTouchedMask() const { return touchedMask; }
+private:
+	std::vector<float> baseline;
+	std::vector<float> diff;
+	unsigned int numChannels = 0;
+	float coefficient;
+	float touchThreshold;
+	float noiseThreshold;
+	uint32_t touchedMask = 0;
+	bool shouldResetBaseline = true;
+};
@@ -1,4 +1,13 @@
 #include "CentroidDetection.h"
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CENTROID_DETECTION_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CENTROID_DETECTION_SSE2
+#endif
 
 // a small helper class, whose main purpose is to wrap the #include
 // and make all the variables related to it private and multi-instance safe
@@ -9,11 +18,151 @@ public:
 	typedef uint8_t BYTE;
 	typedef uint8_t BOOL;
 	WORD* CSD_waSnsDiff;
+	const uint32_t* activeMask; // one bit per element of CSD_waSnsDiff, set if non-zero
 	WORD wMinimumCentroidSize = 0;
 	BYTE SLIDER_BITS = 7;
 	WORD wAdjacentCentroidNoiseThreshold = 400; // Trough between peaks needed to identify two centroids
-	// calculateCentroids is defined here:
+	// calculateCentroids is defined here. It is the reference
+	// implementation from the firmware, which calculateCentroidsSparse()
+	// below has to match.
 #include "calculateCentroids.h"
+	// Return the index of the first active sensor in [from, to), or `to`
+	// if there is none.
+	BYTE nextActiveSensor(unsigned int from, unsigned int to) {
+		unsigned int n = from;
+		while(n < to) {
+			uint32_t word = activeMask[n >> 5] >> (n & 31);
+			if(word) {
+				n += __builtin_ctz(word);
+				return n < to ? n : to;
+			}
+			n = (n | 31) + 1;
+		}
+		return to;
+	}
+	// Same as calculateCentroids(), but stretches of inactive sensors
+	// are skipped in one go using activeMask, so that the per-sensor
+	// state machine only runs on the sensors that are part of a centroid.
+	WORD calculateCentroidsSparse(WORD *centroidBuffer, WORD *sizeBuffer, BYTE maxNumCentroids, BYTE minSensor, BYTE maxSensor, BYTE numSensors) {
+		signed char lastActiveSensor = -1;
+		BYTE centroidIndex = 0, sensorIndex, actualHardwareIndex;
+		BYTE wrappedAround = 0;
+		BYTE inCentroid = 0;
+		WORD peakValue = 0, troughDepth = 0;
+		long temp;
+
+		WORD lastSensorVal, currentSensorVal, currentWeightedSum, currentUnweightedSum;
+		BYTE currentStart = 0, currentLength;
+
+		for(sensorIndex = 0; sensorIndex < maxNumCentroids; sensorIndex++) {
+			centroidBuffer[sensorIndex] = 0xFFFF;
+			sizeBuffer[sensorIndex] = 0;
+		}
+
+		currentSensorVal = 0;
+
+		for(sensorIndex = 0, actualHardwareIndex = minSensor; sensorIndex < numSensors; sensorIndex++)
+		{
+			if(!inCentroid) {
+				// We are never out of a centroid after wrapping
+				// around, as that terminates the loop. Jump to the next
+				// sensor that can start a centroid: if there is none
+				// before the end, there won't be any more centroids.
+				BYTE next = nextActiveSensor(actualHardwareIndex, maxSensor);
+				if(next >= maxSensor)
+					break;
+				sensorIndex += next - actualHardwareIndex;
+				actualHardwareIndex = next;
+				if(sensorIndex >= numSensors)
+					break;
+				currentSensorVal = 0;
+			}
+			lastSensorVal = currentSensorVal;
+
+			currentSensorVal = CSD_waSnsDiff[actualHardwareIndex++];
+			if(currentSensorVal > 0) {
+				lastActiveSensor = sensorIndex;
+			}
+			if(actualHardwareIndex == maxSensor)
+			{
+				actualHardwareIndex = minSensor;
+				wrappedAround = 1;
+			}
+
+			if(inCentroid) {
+				if(currentSensorVal == 0) {
+					if(currentUnweightedSum > wMinimumCentroidSize)
+					{
+						temp = ((long)currentWeightedSum << SLIDER_BITS) / currentUnweightedSum;
+						centroidBuffer[centroidIndex] = (currentStart << SLIDER_BITS) + (WORD)temp;
+						sizeBuffer[centroidIndex] = currentUnweightedSum;
+						centroidIndex++;
+					}
+
+					inCentroid = 0;
+					if(wrappedAround) {
+						break;
+					}
+					if(centroidIndex >= maxNumCentroids)
+						break;
+					continue;
+				}
+
+				if(currentSensorVal > peakValue)
+					peakValue = currentSensorVal;
+				if(peakValue - currentSensorVal > troughDepth)
+					troughDepth = peakValue - currentSensorVal;
+
+				if(sensorIndex >= 2) {
+					if(troughDepth > wAdjacentCentroidNoiseThreshold && currentSensorVal > lastSensorVal + wAdjacentCentroidNoiseThreshold) {
+						if(currentUnweightedSum > wMinimumCentroidSize)
+						{
+							temp = ((long)currentWeightedSum << SLIDER_BITS) / currentUnweightedSum;
+							centroidBuffer[centroidIndex] = (currentStart << SLIDER_BITS) + (WORD)temp;
+							sizeBuffer[centroidIndex] = currentUnweightedSum;
+							centroidIndex++;
+						}
+						inCentroid = 0;
+						if(wrappedAround){
+							break;
+						}
+						if(centroidIndex >= maxNumCentroids)
+							break;
+						inCentroid = 1;
+						currentStart = sensorIndex;
+						currentUnweightedSum = peakValue = currentSensorVal;
+						currentLength = 1;
+						currentWeightedSum = 0;
+						troughDepth = 0;
+						continue;
+					}
+				}
+
+				currentUnweightedSum += currentSensorVal;
+				currentWeightedSum += currentLength * currentSensorVal;
+				currentLength++;
+			}
+			else {
+				// we skipped here, so this sensor is active
+				currentStart = sensorIndex;
+				currentUnweightedSum = peakValue = currentSensorVal;
+				currentLength = 1;
+				currentWeightedSum = 0;
+				troughDepth = 0;
+				inCentroid = 1;
+			}
+		}
+
+		if(inCentroid && currentUnweightedSum > wMinimumCentroidSize)
+		{
+			temp = ((long)currentWeightedSum << SLIDER_BITS) / currentUnweightedSum;
+			centroidBuffer[centroidIndex] = (currentStart << SLIDER_BITS) + (WORD)temp;
+			sizeBuffer[centroidIndex] = currentUnweightedSum;
+			centroidIndex++;
+		}
+
+		return (lastActiveSensor << 8) | currentStart;
+	}
 	void processCentroids(WORD *wVCentroid, WORD *wVCentroidSize, BYTE MAX_NUM_CENTROIDS, BYTE FIRST_SENSOR_V, BYTE LAST_SENSOR_V, BYTE numSensors) {
 		long temp;
 		signed char firstActiveSensor;
@@ -21,10 +170,99 @@ public:
 		BOOL bActivityDetected;
 		BYTE counter;
 		WORD posEndOfLoop = (LAST_SENSOR_V - FIRST_SENSOR_V) << SLIDER_BITS;
+		// the firmware code calls calculateCentroids(); have it call
+		// the sparse version instead
+#define calculateCentroids calculateCentroidsSparse
 #include "processCentroids.h"
+#undef calculateCentroids
 	}
 };
 
+// Gather numReadings values from rawData through order, scale them to the
+// 12-bit range that the detection algorithm is tuned for, subtract the
+// noise threshold, clip and quantise them into dst. The bit corresponding
+// to each non-zero output is set in activeMask.
+static void quantise(const float* rawData, const unsigned int* order, bool contiguous, size_t numReadings, float threshold, uint16_t* dst, uint32_t* activeMask)
+{
+	const float scale = 1 << 12;
+	size_t n = 0;
+	memset(activeMask, 0, sizeof(activeMask[0]) * ((numReadings + 31) / 32));
+#if defined(CENTROID_DETECTION_NEON)
+	const float32x4_t vScale = vdupq_n_f32(scale);
+	const float32x4_t vThreshold = vdupq_n_f32(threshold);
+	const float32x4_t vZero = vdupq_n_f32(0);
+	const float32x4_t vMax = vdupq_n_f32(65535);
+	const uint16_t bitsArr[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint16x8_t vBits = vld1q_u16(bitsArr);
+	for(; n + 8 <= numReadings; n += 8)
+	{
+		float32x4_t v[2];
+		for(unsigned int k = 0; k < 2; ++k)
+		{
+			const unsigned int b = n + k * 4;
+			if(contiguous) {
+				v[k] = vld1q_f32(rawData + b);
+			} else {
+				v[k] = vZero;
+				v[k] = vld1q_lane_f32(rawData + order[b + 0], v[k], 0);
+				v[k] = vld1q_lane_f32(rawData + order[b + 1], v[k], 1);
+				v[k] = vld1q_lane_f32(rawData + order[b + 2], v[k], 2);
+				v[k] = vld1q_lane_f32(rawData + order[b + 3], v[k], 3);
+			}
+			v[k] = vsubq_f32(vmulq_f32(v[k], vScale), vThreshold);
+			v[k] = vminq_f32(vmaxq_f32(v[k], vZero), vMax);
+		}
+		uint16x8_t q = vcombine_u16(vmovn_u32(vcvtq_u32_f32(v[0])), vmovn_u32(vcvtq_u32_f32(v[1])));
+		vst1q_u16(dst + n, q);
+		uint64x2_t m = vpaddlq_u32(vpaddlq_u16(vandq_u16(vtstq_u16(q, q), vBits)));
+		uint32_t mask = vgetq_lane_u64(m, 0) + vgetq_lane_u64(m, 1);
+		activeMask[n >> 5] |= mask << (n & 31);
+	}
+#elif defined(CENTROID_DETECTION_SSE2)
+	const __m128 vScale = _mm_set1_ps(scale);
+	const __m128 vThreshold = _mm_set1_ps(threshold);
+	const __m128 vZero = _mm_setzero_ps();
+	const __m128 vMax = _mm_set1_ps(65535);
+	const __m128i vBias32 = _mm_set1_epi32(0x8000);
+	const __m128i vBias16 = _mm_set1_epi16(-0x8000);
+	for(; n + 8 <= numReadings; n += 8)
+	{
+		__m128i v[2];
+		for(unsigned int k = 0; k < 2; ++k)
+		{
+			const unsigned int b = n + k * 4;
+			__m128 f;
+			if(contiguous)
+				f = _mm_loadu_ps(rawData + b);
+			else
+				f = _mm_set_ps(rawData[order[b + 3]], rawData[order[b + 2]], rawData[order[b + 1]], rawData[order[b]]);
+			f = _mm_sub_ps(_mm_mul_ps(f, vScale), vThreshold);
+			f = _mm_min_ps(_mm_max_ps(f, vZero), vMax);
+			// SSE2 has no unsigned saturating pack: shift into the
+			// signed range and back
+			v[k] = _mm_sub_epi32(_mm_cvttps_epi32(f), vBias32);
+		}
+		__m128i q = _mm_xor_si128(_mm_packs_epi32(v[0], v[1]), vBias16);
+		_mm_storeu_si128((__m128i*)(dst + n), q);
+		__m128i zero = _mm_cmpeq_epi16(q, _mm_setzero_si128());
+		uint32_t mask = ~_mm_movemask_epi8(_mm_packs_epi16(zero, zero)) & 0xff;
+		activeMask[n >> 5] |= mask << (n & 31);
+	}
+#endif
+	for(; n < numReadings; ++n)
+	{
+		float val = rawData[contiguous ? n : order[n]] * scale;
+		val -= threshold;
+		if(val < 0)
+			val = 0;
+		if(val > 65535)
+			val = 65535;
+		dst[n] = val;
+		if(dst[n])
+			activeMask[n >> 5] |= 1u << (n & 31);
+	}
+}
+
 CentroidDetection::CentroidDetection(unsigned int numReadings, unsigned int maxNumCentroids, float sizeScale)
 {
 	setup(numReadings, maxNumCentroids, sizeScale);
@@ -35,6 +273,35 @@ CentroidDetection::CentroidDetection(const std::vector<unsigned int>& order, uns
 	setup(order, maxNumCentroids, sizeScale);
 }
 
+CentroidDetection::CentroidDetection(const CentroidDetection& other)
+{
+	*this = other;
+}
+
+CentroidDetection& CentroidDetection::operator=(const CentroidDetection& other)
+{
+	centroids = other.centroids;
+	sizes = other.sizes;
+	centroidBuffer = other.centroidBuffer;
+	sizeBuffer = other.sizeBuffer;
+	maxNumCentroids = other.maxNumCentroids;
+	order = other.order;
+	orderIsContiguous = other.orderIsContiguous;
+	num_sensors = other.num_sensors;
+	data = other.data;
+	activeMask = other.activeMask;
+	sizeScale = other.sizeScale;
+	locationScale = other.locationScale;
+	// the settings in cc must not be shared between copies
+	if(other.cc)
+		cc = std::shared_ptr<CalculateCentroids>(new CalculateCentroids(*other.cc));
+	else
+		cc = nullptr;
+	num_touches = other.num_touches;
+	noiseThreshold = other.noiseThreshold;
+	return *this;
+}
+
 int CentroidDetection::setup(unsigned int numReadings, unsigned int maxNumCentroids, float sizeScale)
 {
 	std::vector<unsigned int> order;
@@ -46,6 +313,9 @@ int CentroidDetection::setup(unsigned int numReadings, unsigned int maxNumCentro
 int CentroidDetection::setup(const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale)
 {
 	this->order = order;
+	orderIsContiguous = true;
+	for(unsigned int n = 0; n < order.size(); ++n)
+		orderIsContiguous &= (order[n] == n);
 	setWrapAround(0);
 	this->maxNumCentroids = maxNumCentroids;
 	centroidBuffer.resize(maxNumCentroids);
@@ -53,6 +323,7 @@ int CentroidDetection::setup(const std::vector<unsigned int>& order, unsigned in
 	centroids.resize(maxNumCentroids);
 	sizes.resize(maxNumCentroids);
 	data.resize(order.size());
+	activeMask.resize((order.size() + 31) / 32);
 	setSizeScale(sizeScale);
 	setNoiseThreshold(0);
 	cc = std::shared_ptr<CalculateCentroids>(new CalculateCentroids());
@@ -74,28 +345,31 @@ void CentroidDetection::setMultiplierBits(unsigned int n)
 
 void CentroidDetection::process(const DATA_T* rawData)
 {
-	for(unsigned int n = 0; n < order.size(); ++n)
-	{
-		float val = rawData[order[n]] * (1 << 12);
-		val -= noiseThreshold;
-		if(val < 0)
-			val = 0;
-		data[n] = val;
-	}
+	num_touches = process(rawData, centroids.data(), sizes.data());
+}
+
+unsigned int CentroidDetection::process(const DATA_T* rawData, DATA_T* locations, DATA_T* touchSizes)
+{
+	quantise(rawData, order.data(), orderIsContiguous, order.size(), noiseThreshold, data.data(), activeMask.data());
 	cc->CSD_waSnsDiff = data.data();
+	cc->activeMask = activeMask.data();
 	cc->processCentroids(centroidBuffer.data(), sizeBuffer.data(), maxNumCentroids, 0, order.size(), num_sensors);
 
-	unsigned int locations = 0;
 	// Look for 1st instance of 0xFFFF (no touch) in the buffer
 	unsigned int i;
 	for(i = 0; i < centroidBuffer.size(); ++i)
 	{
 		if(0xffff == centroidBuffer[i])
 			break;// at the first non-touch, break
-		centroids[i] = centroidBuffer[i] / locationScale;
-		sizes[i] = sizeBuffer[i] / sizeScale;
+		locations[i] = centroidBuffer[i] / locationScale;
+		touchSizes[i] = sizeBuffer[i] / sizeScale;
 	}
-	num_touches = i;
+	return i;
+}
+
+unsigned int CentroidDetection::getMaxNumCentroids() const
+{
+	return maxNumCentroids;
 }
 
 void CentroidDetection::setSizeScale(float sizeScale)
@@ -113,6 +387,11 @@ void CentroidDetection::setNoiseThreshold(DATA_T threshold)
 	noiseThreshold = threshold;
 }
 
+void CentroidDetection::setAdjacentCentroidNoiseThreshold(DATA_T threshold)
+{
+	cc->wAdjacentCentroidNoiseThreshold = threshold;
+}
+
 unsigned int CentroidDetection::getNumTouches() const
 {
 	return num_touches;
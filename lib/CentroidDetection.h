@@ -10,12 +10,34 @@ public:
 	CentroidDetection() {};
 	CentroidDetection(unsigned int numReadings, unsigned int maxNumCentroids, float sizeScale);
 	CentroidDetection(const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale);
+	CentroidDetection(const CentroidDetection& other);
+	CentroidDetection& operator=(const CentroidDetection& other);
 	int setup(unsigned int numReadings, unsigned int maxNumCentroids, float sizeScale);
 	int setup(const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale);
 	void process(const DATA_T* rawData);
+	/**
+	 * Same as process(), but write the results to the provided arrays
+	 * instead of storing them in the object.
+	 * The getters are not affected by this call.
+	 *
+	 * @param locations an array of at least getMaxNumCentroids() elements
+	 * @param touchSizes an array of at least getMaxNumCentroids() elements
+	 *
+	 * @return the number of touches detected.
+	 */
+	unsigned int process(const DATA_T* rawData, DATA_T* locations, DATA_T* touchSizes);
+	unsigned int getMaxNumCentroids() const;
 	void setSizeScale(float sizeScale);
 	void setMinimumTouchSize(DATA_T minSize);
 	void setNoiseThreshold(DATA_T threshold);
+	/**
+	 * Set how deep the trough between two peaks has to be, and how
+	 * much the readings have to rise again after it, for the peaks to
+	 * be detected as two separate centroids. This is in units of the
+	 * readings scaled to 12 bits, after subtracting the noise
+	 * threshold. Defaults to 400.
+	 */
+	void setAdjacentCentroidNoiseThreshold(DATA_T threshold);
 	/**
 	 * Set how many of the values at the beginning of `rawData` can be
 	 * joined in a single centroid with those at the end of `rawData` if a
@@ -42,8 +64,10 @@ private:
 	std::vector<WORD> sizeBuffer;
 	unsigned int maxNumCentroids;
 	std::vector<unsigned int> order;
+	bool orderIsContiguous;
 	unsigned int num_sensors;
 	std::vector<WORD> data;
+	std::vector<uint32_t> activeMask;
 	float sizeScale;
 	float locationScale;
 	std::shared_ptr<CalculateCentroids> cc;
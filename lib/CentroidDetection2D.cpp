@@ -0,0 +1,96 @@
+#include "CentroidDetection2D.h"
+
+CentroidDetection2D::CentroidDetection2D(const std::vector<unsigned int>& rowOrder, const std::vector<unsigned int>& columnOrder, unsigned int maxNumCentroids, float sizeScale)
+{
+	setup(rowOrder, columnOrder, maxNumCentroids, sizeScale);
+}
+
+int CentroidDetection2D::setup(const std::vector<unsigned int>& rowOrder, const std::vector<unsigned int>& columnOrder, unsigned int maxNumCentroids, float sizeScale)
+{
+	if(rowOrder.size() < 2 || columnOrder.size() < 2)
+		return 1;
+	if(rows.setup(rowOrder, maxNumCentroids, sizeScale))
+		return 1;
+	if(columns.setup(columnOrder, maxNumCentroids, sizeScale))
+		return 1;
+	return 0;
+}
+
+void CentroidDetection2D::process(const DATA_T* rawData)
+{
+	rows.process(rawData);
+	columns.process(rawData);
+}
+
+void CentroidDetection2D::setSizeScale(float sizeScale)
+{
+	rows.setSizeScale(sizeScale);
+	columns.setSizeScale(sizeScale);
+}
+
+void CentroidDetection2D::setMinimumTouchSize(DATA_T minSize)
+{
+	rows.setMinimumTouchSize(minSize);
+	columns.setMinimumTouchSize(minSize);
+}
+
+void CentroidDetection2D::setNoiseThreshold(DATA_T threshold)
+{
+	rows.setNoiseThreshold(threshold);
+	columns.setNoiseThreshold(threshold);
+}
+
+void CentroidDetection2D::setMultiplierBits(unsigned int n)
+{
+	rows.setMultiplierBits(n);
+	columns.setMultiplierBits(n);
+}
+
+unsigned int CentroidDetection2D::getNumTouches() const
+{
+	return rows.getNumTouches();
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::touchLocation(unsigned int touch_num) const
+{
+	if(touch_num >= rows.getNumTouches())
+		return -1;
+	return rows.touchLocation(touch_num);
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::touchSize(unsigned int touch_num) const
+{
+	return rows.touchSize(touch_num);
+}
+
+unsigned int CentroidDetection2D::getNumHorizontalTouches() const
+{
+	return columns.getNumTouches();
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::touchHorizontalLocation(unsigned int touch_num) const
+{
+	if(touch_num >= columns.getNumTouches())
+		return -1;
+	return columns.touchLocation(touch_num);
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::touchHorizontalSize(unsigned int touch_num) const
+{
+	return columns.touchSize(touch_num);
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::compoundTouchLocation() const
+{
+	return rows.compoundTouchLocation();
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::compoundTouchHorizontalLocation() const
+{
+	return columns.compoundTouchLocation();
+}
+
+CentroidDetection2D::DATA_T CentroidDetection2D::compoundTouchSize() const
+{
+	return rows.compoundTouchSize();
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <CentroidDetection.h>
+
+/**
+ * \brief Detect touches on a grid of row and column electrodes.
+ *
+ * This is the host-side equivalent of what the firmware of Trill Square
+ * and Trill Hex does, for custom grids wired to e.g.: Trill Craft.
+ * Each axis is processed with the same fixed-point algorithm used by
+ * CentroidDetection.
+ *
+ * The row electrodes sense the vertical position and the column
+ * electrodes sense the horizontal position. Touches are reported with
+ * the same semantics as Trill's 2D devices: touch `n` is located at
+ * touchHorizontalLocation(n), touchLocation(n), where the centroids on
+ * each axis are paired up in the order in which they are found along
+ * the axis. The two axes may detect a different number of touches,
+ * e.g.: when two fingers are on the same row.
+ */
+class CentroidDetection2D
+{
+public:
+	typedef CentroidDetection::DATA_T DATA_T;
+	CentroidDetection2D() {};
+	/**
+	 * @param rowOrder the channels connected to the row electrodes,
+	 * from top to bottom.
+	 * @param columnOrder the channels connected to the column
+	 * electrodes, from left to right.
+	 * @param maxNumCentroids the maximum number of touches to detect on
+	 * each axis.
+	 * @param sizeScale the value that a touch size is divided by.
+	 */
+	CentroidDetection2D(const std::vector<unsigned int>& rowOrder, const std::vector<unsigned int>& columnOrder, unsigned int maxNumCentroids, float sizeScale);
+	/**
+	 * \copydoc CentroidDetection2D::CentroidDetection2D(const std::vector<unsigned int>&, const std::vector<unsigned int>&, unsigned int, float)
+	 */
+	int setup(const std::vector<unsigned int>& rowOrder, const std::vector<unsigned int>& columnOrder, unsigned int maxNumCentroids, float sizeScale);
+	/**
+	 * Detect touches in a frame of readings.
+	 *
+	 * @param rawData the readings of all channels, indexed as in the
+	 * orders passed to setup().
+	 */
+	void process(const DATA_T* rawData);
+	void setSizeScale(float sizeScale);
+	void setMinimumTouchSize(DATA_T minSize);
+	void setNoiseThreshold(DATA_T threshold);
+	void setMultiplierBits(unsigned int n);
+	/**
+	 * Get the number of touches on the vertical axis.
+	 */
+	unsigned int getNumTouches() const;
+	/**
+	 * Get the vertical location of a touch, or -1 if no such touch
+	 * exists.
+	 */
+	DATA_T touchLocation(unsigned int touch_num) const;
+	/**
+	 * Get the size of a touch on the vertical axis, or 0 if no such
+	 * touch exists.
+	 */
+	DATA_T touchSize(unsigned int touch_num) const;
+	/**
+	 * Get the number of touches on the horizontal axis.
+	 */
+	unsigned int getNumHorizontalTouches() const;
+	/**
+	 * Get the horizontal location of a touch, or -1 if no such touch
+	 * exists.
+	 */
+	DATA_T touchHorizontalLocation(unsigned int touch_num) const;
+	/**
+	 * Get the size of a touch on the horizontal axis, or 0 if no such
+	 * touch exists.
+	 */
+	DATA_T touchHorizontalSize(unsigned int touch_num) const;
+	DATA_T compoundTouchLocation() const;
+	DATA_T compoundTouchHorizontalLocation() const;
+	DATA_T compoundTouchSize() const;
+private:
+	CentroidDetection rows;
+	CentroidDetection columns;
+};
@@ -0,0 +1,66 @@
+#include "CentroidDetectionBatch.h"
+#include <algorithm>
+
+enum {
+	kFramesPerChunk = 16,
+};
+
+CentroidDetectionBatch::CentroidDetectionBatch(const std::vector<CentroidDetection>& detectors, unsigned int numThreads)
+{
+	setup(detectors, numThreads);
+}
+
+int CentroidDetectionBatch::setup(const std::vector<CentroidDetection>& detectors, unsigned int numThreads)
+{
+	pool = std::unique_ptr<WorkStealingPool>(new WorkStealingPool(numThreads));
+	this->detectors.assign(pool->getNumWorkers(), detectors);
+	maxNumCentroids = 0;
+	for(auto& d : detectors)
+		maxNumCentroids = std::max(maxNumCentroids, d.getMaxNumCentroids());
+	return 0;
+}
+
+int CentroidDetectionBatch::process(const DATA_T* data, size_t numFrames, size_t frameStride,
+		DATA_T* locations, DATA_T* sizes, unsigned int* numTouches,
+		size_t touchStride)
+{
+	return process(data, numFrames, frameStride, numFrames * frameStride, locations, sizes, numTouches, touchStride);
+}
+
+int CentroidDetectionBatch::process(const DATA_T* data, size_t numFrames, size_t frameStride, size_t sensorStride,
+		DATA_T* locations, DATA_T* sizes, unsigned int* numTouches,
+		size_t touchStride)
+{
+	if(!pool)
+		return -1;
+	if(touchStride < maxNumCentroids)
+		return 1;
+	size_t numSensors = getNumSensors();
+	pool->parallelFor(numSensors * numFrames, kFramesPerChunk,
+		[&](unsigned int worker, size_t begin, size_t end) {
+			std::vector<CentroidDetection>& ds = detectors[worker];
+			for(size_t n = begin; n < end; ++n)
+			{
+				size_t sensor = n / numFrames;
+				CentroidDetection& d = ds[sensor];
+				numTouches[n] = d.process(data + sensor * sensorStride + (n - sensor * numFrames) * frameStride,
+					locations + n * touchStride, sizes + n * touchStride);
+			}
+		});
+	return 0;
+}
+
+unsigned int CentroidDetectionBatch::getNumSensors() const
+{
+	return detectors.size() ? detectors[0].size() : 0;
+}
+
+unsigned int CentroidDetectionBatch::getMaxNumCentroids() const
+{
+	return maxNumCentroids;
+}
+
+unsigned int CentroidDetectionBatch::getNumThreads() const
+{
+	return pool ? pool->getNumWorkers() : 0;
+}
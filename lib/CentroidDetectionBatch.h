@@ -0,0 +1,86 @@
+#pragma once
+#include <CentroidDetection.h>
+#include <WorkStealingPool.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * \brief Run CentroidDetection on blocks of frames from several sensors.
+ *
+ * Each sensor is configured through its own CentroidDetection object,
+ * which is copied at setup(): later changes to the original objects have
+ * no effect.
+ *
+ * Each frame of each sensor is processed independently, so the work is
+ * spread across a WorkStealingPool. Every worker owns private copies of
+ * the detectors and no memory is allocated while processing.
+ */
+class CentroidDetectionBatch
+{
+public:
+	typedef CentroidDetection::DATA_T DATA_T;
+	CentroidDetectionBatch() {};
+	/**
+	 * @param detectors one configured detector per sensor.
+	 * @param numThreads the number of threads to use, including the
+	 * one calling process(). If 0, one per hardware thread is used.
+	 */
+	CentroidDetectionBatch(const std::vector<CentroidDetection>& detectors, unsigned int numThreads = 0);
+	/**
+	 * \copydoc CentroidDetectionBatch::CentroidDetectionBatch(const std::vector<CentroidDetection>&, unsigned int)
+	 */
+	int setup(const std::vector<CentroidDetection>& detectors, unsigned int numThreads = 0);
+	/**
+	 * Detect the centroids in a block of frames.
+	 *
+	 * All arrays are laid out as [sensor][frame][element], with one
+	 * sensor per detector passed to setup().
+	 *
+	 * @param data the input readings. Frame `f` of sensor `s` starts at
+	 * `data + (s * numFrames + f) * frameStride`.
+	 * @param numFrames the number of frames per sensor.
+	 * @param frameStride the distance between consecutive frames, in
+	 * elements. This must be large enough for every detector's order.
+	 * @param locations the output locations. Touch `t` of frame `f` of
+	 * sensor `s` is at `(s * numFrames + f) * touchStride + t`.
+	 * @param sizes the output sizes, laid out as @p locations.
+	 * @param numTouches the number of touches detected in each frame, at
+	 * `s * numFrames + f`.
+	 * @param touchStride the distance between consecutive frames in
+	 * @p locations and @p sizes, in elements. It has to be at least
+	 * getMaxNumCentroids().
+	 *
+	 * @return 0 on success, or an error code otherwise.
+	 */
+	int process(const DATA_T* data, size_t numFrames, size_t frameStride,
+			DATA_T* locations, DATA_T* sizes, unsigned int* numTouches,
+			size_t touchStride);
+	/**
+	 * Same as process(const DATA_T*, size_t, size_t, DATA_T*, DATA_T*, unsigned int*, size_t),
+	 * but with frame `f` of sensor `s` starting at
+	 * `data + s * sensorStride + f * frameStride`.
+	 *
+	 * With a @p sensorStride of 0, all detectors process the same
+	 * frames, e.g.: to compare different configurations of a detector
+	 * on the same data without copying it once per detector.
+	 */
+	int process(const DATA_T* data, size_t numFrames, size_t frameStride, size_t sensorStride,
+			DATA_T* locations, DATA_T* sizes, unsigned int* numTouches,
+			size_t touchStride);
+	/**
+	 * Get the number of sensors.
+	 */
+	unsigned int getNumSensors() const;
+	/**
+	 * Get the largest number of centroids that a detector can return.
+	 */
+	unsigned int getMaxNumCentroids() const;
+	/**
+	 * Get the number of threads used by process().
+	 */
+	unsigned int getNumThreads() const;
+private:
+	std::unique_ptr<WorkStealingPool> pool;
+	std::vector<std::vector<CentroidDetection>> detectors; // [worker][sensor]
+	unsigned int maxNumCentroids = 0;
+};
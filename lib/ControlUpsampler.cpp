@@ -0,0 +1,348 @@
+#include "ControlUpsampler.h"
+#include "Trill.h"
+#include <algorithm>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONTROL_UPSAMPLER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONTROL_UPSAMPLER_SSE2
+#endif
+
+constexpr unsigned int ControlUpsampler::kHistory;
+// the kBandLimited kernel spans kTaps frames, kTaps / 2 of which are
+// after the point being rendered
+static constexpr unsigned int kTaps = 8;
+static constexpr unsigned int kPhases = 256;
+
+static float lanczos(float x)
+{
+	const float a = kTaps / 2;
+	if(0 == x)
+		return 1;
+	if(fabsf(x) >= a)
+		return 0;
+	float px = float(M_PI) * x;
+	return a * sinf(px) * sinf(px / a) / (px * px);
+}
+
+// how many frames after the one preceding the point being rendered
+// each type needs
+static unsigned int getFramesAhead(ControlUpsampler::Type type)
+{
+	switch(type)
+	{
+	case ControlUpsampler::kHold:
+		return 0;
+	case ControlUpsampler::kLinear:
+		return 1;
+	case ControlUpsampler::kCubic:
+		return 2;
+	case ControlUpsampler::kBandLimited:
+		return kTaps / 2;
+	}
+	return 0;
+}
+
+ControlUpsampler::ControlUpsampler(unsigned int numChannels, float sampleRate, Type type, float latency)
+{
+	setup(numChannels, sampleRate, type, latency);
+}
+
+int ControlUpsampler::setup(unsigned int numChannels, float sampleRate, Type type, float latency)
+{
+	if(sampleRate <= 0)
+		return 1;
+	this->numChannels = numChannels;
+	this->type = type;
+	samplePeriod = 1000000000.0 / sampleRate;
+	setLatency(latency);
+	values.assign(numChannels * 2 * kHistory, 0);
+	valuePointers.resize(numChannels);
+	// one row of weights per phase, including both ends
+	kernel.resize((kPhases + 1) * kTaps);
+	for(unsigned int p = 0; p <= kPhases; ++p)
+	{
+		float* w = kernel.data() + p * kTaps;
+		float f = p / float(kPhases);
+		float sum = 0;
+		for(unsigned int n = 0; n < kTaps; ++n)
+		{
+			// tap n is frame n - kTaps / 2 + 1 relative to the one
+			// preceding the point being rendered
+			w[n] = lanczos(f + kTaps / 2 - 1 - float(n));
+			sum += w[n];
+		}
+		// so that a constant input gives a constant output
+		for(unsigned int n = 0; n < kTaps; ++n)
+			w[n] /= sum;
+	}
+	reset();
+	return 0;
+}
+
+void ControlUpsampler::setLatency(float latency)
+{
+	this->latency = latency * 1000000000.0;
+}
+
+float ControlUpsampler::getMinimumLatency() const
+{
+	uint32_t n = count.load(std::memory_order_acquire);
+	if(n < 2)
+		return 0;
+	uint32_t frames = std::min(n - 1, 8u);
+	double period = double(getTime(n - 1) - getTime(n - 1 - frames)) / frames;
+	return period * getFramesAhead(type) / 1000000000.0;
+}
+
+void ControlUpsampler::reset()
+{
+	count.store(0);
+	segment = 0;
+	numUnderruns = 0;
+}
+
+void ControlUpsampler::push(const float* frame, FrameClock::Timestamp timestamp)
+{
+	uint32_t n = count.load(std::memory_order_relaxed);
+	unsigned int slot = n % kHistory;
+	for(unsigned int c = 0; c < numChannels; ++c)
+	{
+		float* channel = values.data() + c * 2 * kHistory;
+		channel[slot] = frame[c];
+		channel[slot + kHistory] = frame[c];
+	}
+	times[slot] = timestamp;
+	count.store(n + 1, std::memory_order_release);
+}
+
+int ControlUpsampler::push(Trill& trill)
+{
+	if(Trill::CENTROID == trill.getMode())
+		return 1;
+	if(trill.getNumChannels() != numChannels)
+		return 2;
+	push(trill.rawData.data(), trill.getFrameTimestamp());
+	return 0;
+}
+
+// c0 + u * (c1 + u * (c2 + u * c3)), with u = u0 + n * du
+static void renderPolynomial(float* out, unsigned int numSamples, float u0, float du, float c0, float c1, float c2, float c3)
+{
+	unsigned int n = 0;
+#if defined(CONTROL_UPSAMPLER_NEON)
+	const float idxArr[4] = { 0, 1, 2, 3 };
+	const float32x4_t vIdx = vld1q_f32(idxArr);
+	const float32x4_t vU0 = vdupq_n_f32(u0);
+	const float32x4_t vDu = vdupq_n_f32(du);
+	const float32x4_t vC0 = vdupq_n_f32(c0);
+	const float32x4_t vC1 = vdupq_n_f32(c1);
+	const float32x4_t vC2 = vdupq_n_f32(c2);
+	const float32x4_t vC3 = vdupq_n_f32(c3);
+	for(; n + 4 <= numSamples; n += 4)
+	{
+		float32x4_t u = vmlaq_f32(vU0, vaddq_f32(vdupq_n_f32(n), vIdx), vDu);
+		float32x4_t v = vmlaq_f32(vC2, vC3, u);
+		v = vmlaq_f32(vC1, v, u);
+		v = vmlaq_f32(vC0, v, u);
+		vst1q_f32(out + n, v);
+	}
+#elif defined(CONTROL_UPSAMPLER_SSE2)
+	const __m128 vIdx = _mm_setr_ps(0, 1, 2, 3);
+	const __m128 vU0 = _mm_set1_ps(u0);
+	const __m128 vDu = _mm_set1_ps(du);
+	const __m128 vC0 = _mm_set1_ps(c0);
+	const __m128 vC1 = _mm_set1_ps(c1);
+	const __m128 vC2 = _mm_set1_ps(c2);
+	const __m128 vC3 = _mm_set1_ps(c3);
+	for(; n + 4 <= numSamples; n += 4)
+	{
+		__m128 u = _mm_add_ps(vU0, _mm_mul_ps(_mm_add_ps(_mm_set1_ps(n), vIdx), vDu));
+		__m128 v = _mm_add_ps(vC2, _mm_mul_ps(vC3, u));
+		v = _mm_add_ps(vC1, _mm_mul_ps(v, u));
+		v = _mm_add_ps(vC0, _mm_mul_ps(v, u));
+		_mm_storeu_ps(out + n, v);
+	}
+#endif
+	for(; n < numSamples; ++n)
+	{
+		float u = u0 + n * du;
+		out[n] = c0 + u * (c1 + u * (c2 + u * c3));
+	}
+}
+
+static float dotTaps(const float* x, const float* w)
+{
+#if defined(CONTROL_UPSAMPLER_NEON)
+	float32x4_t v = vmulq_f32(vld1q_f32(x), vld1q_f32(w));
+	v = vmlaq_f32(v, vld1q_f32(x + 4), vld1q_f32(w + 4));
+	float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+	return vget_lane_f32(vpadd_f32(s, s), 0);
+#elif defined(CONTROL_UPSAMPLER_SSE2)
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(w));
+	v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(x + 4), _mm_loadu_ps(w + 4)));
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+#else
+	float sum = 0;
+	for(unsigned int n = 0; n < kTaps; ++n)
+		sum += x[n] * w[n];
+	return sum;
+#endif
+}
+
+// render the samples from start to end, which all fall between frame
+// `segment` and the next one, or past the latest one if hold
+void ControlUpsampler::renderSegment(float* const* outputs, unsigned int start, unsigned int end, uint32_t oldest, uint32_t newest, bool hold, float u0, float du)
+{
+	unsigned int numSamples = end - start;
+	if(hold || kHold == type)
+	{
+		for(unsigned int c = 0; c < numChannels; ++c)
+			std::fill(outputs[c] + start, outputs[c] + end, getValue(c, segment));
+		return;
+	}
+	if(kLinear == type)
+	{
+		for(unsigned int c = 0; c < numChannels; ++c)
+		{
+			float p1 = getValue(c, segment);
+			float p2 = getValue(c, segment + 1);
+			renderPolynomial(outputs[c] + start, numSamples, u0, du, p1, p2 - p1, 0, 0);
+		}
+		return;
+	}
+	// frames are indexed relative to oldest, so that the comparisons
+	// survive the wrapping of the counters
+	uint32_t pos = segment - oldest;
+	uint32_t range = newest - oldest;
+	if(kCubic == type)
+	{
+		// missing neighbours are replaced by the ends of the segment,
+		// which makes the tangent there that of a straight line
+		uint32_t prev = pos > 0 ? segment - 1 : segment;
+		uint32_t next = pos + 2 <= range ? segment + 2 : segment + 1;
+		double t0 = getTime(prev);
+		double t1 = getTime(segment);
+		double t2 = getTime(segment + 1);
+		double t3 = getTime(next);
+		// the tangents in units of the segment
+		float k1 = (t2 - t1) / (t2 - t0);
+		float k2 = (t2 - t1) / (t3 - t1);
+		for(unsigned int c = 0; c < numChannels; ++c)
+		{
+			float p0 = getValue(c, prev);
+			float p1 = getValue(c, segment);
+			float p2 = getValue(c, segment + 1);
+			float p3 = getValue(c, next);
+			float m1 = (p2 - p0) * k1;
+			float m2 = (p3 - p1) * k2;
+			renderPolynomial(outputs[c] + start, numSamples, u0, du,
+				p1, m1, 3 * (p2 - p1) - 2 * m1 - m2, 2 * (p1 - p2) + m1 + m2);
+		}
+		return;
+	}
+	// kBandLimited
+	uint32_t first = segment - (kTaps / 2 - 1);
+	bool complete = pos >= kTaps / 2 - 1 && pos + kTaps / 2 <= range;
+	for(unsigned int n = start; n < end; ++n)
+	{
+		// interpolate the weights between the two nearest phases
+		float f = std::min(std::max(u0 + (n - start) * du, 0.f), 1.f) * kPhases;
+		unsigned int phase = std::min(unsigned(f), kPhases - 1);
+		float frac = f - phase;
+		const float* w0 = kernel.data() + phase * kTaps;
+		const float* w1 = w0 + kTaps;
+		float w[kTaps];
+		for(unsigned int t = 0; t < kTaps; ++t)
+			w[t] = w0[t] + frac * (w1[t] - w0[t]);
+		for(unsigned int c = 0; c < numChannels; ++c)
+		{
+			if(complete)
+			{
+				outputs[c][n] = dotTaps(getChannel(c) + first % kHistory, w);
+			} else {
+				// clamp the taps to the frames available
+				float sum = 0;
+				for(unsigned int t = 0; t < kTaps; ++t)
+				{
+					int32_t tap = int32_t(pos) - int32_t(kTaps / 2 - 1) + int32_t(t);
+					tap = std::max(0, std::min(tap, int32_t(range)));
+					sum += getValue(c, oldest + tap) * w[t];
+				}
+				outputs[c][n] = sum;
+			}
+		}
+	}
+}
+
+void ControlUpsampler::process(float* const* outputs, unsigned int numFrames, FrameClock::Timestamp time)
+{
+	if(!numFrames)
+		return;
+	uint32_t n = count.load(std::memory_order_acquire);
+	if(!n)
+	{
+		for(unsigned int c = 0; c < numChannels; ++c)
+			std::fill(outputs[c], outputs[c] + numFrames, 0);
+		return;
+	}
+	// push() may overwrite older frames while we are running
+	uint32_t oldest = n > kHistory / 2 ? n - kHistory / 2 : 0;
+	uint32_t newest = n - 1;
+	if(segment - oldest > newest - oldest)
+		segment = oldest;
+	// times relative to the current segment, to keep their precision
+	FrameClock::Timestamp base = getTime(segment);
+	auto relative = [base](FrameClock::Timestamp t) {
+		return double(int64_t(t - base));
+	};
+	double blockStart = double(int64_t(time - base)) - latency;
+	bool underrun = false;
+	unsigned int framesAhead = getFramesAhead(type);
+	unsigned int start = 0;
+	while(start < numFrames)
+	{
+		double s = blockStart + start * samplePeriod;
+		while(segment != newest && relative(getTime(segment + 1)) <= s)
+			++segment;
+		while(segment != oldest && relative(getTime(segment)) > s)
+			--segment;
+		double t1 = relative(getTime(segment));
+		unsigned int end = numFrames;
+		bool hold = false;
+		float u0 = 0;
+		float du = 0;
+		if(s < t1)
+		{
+			// before the oldest frame: hold it until it's reached
+			hold = true;
+			end = std::min(numFrames, start + (unsigned int)ceil((t1 - s) / samplePeriod));
+		} else if(segment == newest) {
+			hold = true;
+		} else {
+			double t2 = relative(getTime(segment + 1));
+			end = std::min(numFrames, start + (unsigned int)ceil((t2 - s) / samplePeriod));
+			u0 = (s - t1) / (t2 - t1);
+			du = samplePeriod / (t2 - t1);
+		}
+		if(s >= t1 && newest - segment < framesAhead)
+			underrun = true;
+		end = std::max(end, start + 1);
+		renderSegment(outputs, start, end, oldest, newest, hold, u0, du);
+		start = end;
+	}
+	if(underrun)
+		++numUnderruns;
+}
+
+void ControlUpsampler::getValues(float* output, FrameClock::Timestamp time)
+{
+	for(unsigned int c = 0; c < numChannels; ++c)
+		valuePointers[c] = output + c;
+	process(valuePointers.data(), 1, time);
+}
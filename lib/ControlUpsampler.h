@@ -0,0 +1,149 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "FrameClock.h"
+
+class Trill;
+
+/**
+ * \brief Turn timestamped control-rate frames into audio-rate signals.
+ *
+ * Frames arrive at a few hundred Hz and at irregular times, so holding
+ * the latest value until the next one arrives produces audible steps
+ * ("zipper noise") when the values drive audio parameters. This class
+ * keeps a short history of frames, each with one value per channel,
+ * and renders them into per-sample or per-block signals at a fixed
+ * latency behind real time, interpolating between frames with one of:
+ * - #kHold: the latest frame, i.e.: no interpolation.
+ * - #kLinear: straight lines between consecutive frames.
+ * - #kCubic: a cubic Hermite spline through the frames, with tangents
+ *   that account for the actual time between frames.
+ * - #kBandLimited: a Lanczos-windowed sinc kernel 8 frames wide, which
+ *   has no corners at the frames and the least aliasing of the frame
+ *   rate into the audio band.
+ *
+ * Each type needs to see some frames after the point being rendered,
+ * see getMinimumLatency(). When those haven't arrived yet, e.g.: because
+ * the latency is too short for the jitter of the frames, the output is
+ * interpolated from the frames available, holding the latest one past
+ * its time, and an underrun is counted.
+ *
+ * Memory is only allocated by setup(), so push() and process() can be
+ * called from an audio callback. push() can also be called from a
+ * different thread than process(), e.g.: the one reading the device, as
+ * long as each of them is only called from one thread and no more than
+ * kHistory / 2 frames are pushed while process() runs.
+ */
+class ControlUpsampler
+{
+public:
+	typedef enum {
+		kHold,
+		kLinear,
+		kCubic,
+		kBandLimited,
+	} Type;
+	/**
+	 * The number of frames retained.
+	 */
+	static constexpr unsigned int kHistory = 32;
+	ControlUpsampler() {};
+	/**
+	 * @param numChannels the number of values in each frame.
+	 * @param sampleRate the rate of the output, in Hz. Use the audio
+	 * sample rate for per-sample signals or the block rate for
+	 * per-block ones.
+	 * @param type the interpolation type.
+	 * @param latency how far behind the requested time the output is
+	 * rendered, in seconds.
+	 */
+	ControlUpsampler(unsigned int numChannels, float sampleRate, Type type = kCubic, float latency = 0.01);
+	/**
+	 * \copydoc ControlUpsampler::ControlUpsampler(unsigned int, float, Type, float)
+	 */
+	int setup(unsigned int numChannels, float sampleRate, Type type = kCubic, float latency = 0.01);
+	void setType(Type type) { this->type = type; }
+	/**
+	 * Set how far behind the requested time the output is rendered, in
+	 * seconds. Only the last kHistory / 2 frames are used, so the
+	 * latency should be shorter than that many frames.
+	 */
+	void setLatency(float latency);
+	/**
+	 * Get the latency needed by the current type, in seconds, based on
+	 * the interval between the last frames pushed. Add a margin for
+	 * the jitter of the frame timestamps.
+	 */
+	float getMinimumLatency() const;
+	/**
+	 * Forget all frames. This must not be called while push() or
+	 * process() are running.
+	 */
+	void reset();
+	/**
+	 * Add a frame.
+	 *
+	 * @param values one value per channel.
+	 * @param timestamp the time of the frame. Frames must be pushed in
+	 * order of time.
+	 */
+	void push(const float* values, FrameClock::Timestamp timestamp);
+	/**
+	 * Add the current frame of a Trill device that isn't in
+	 * Trill::CENTROID mode, using the values in Trill::rawData and
+	 * Trill::getFrameTimestamp(). For touches, push their locations
+	 * and sizes instead, e.g.: as filtered by TouchFilter, so that
+	 * each channel follows the same touch.
+	 *
+	 * @return 0 on success, or an error code if the device is in
+	 * Trill::CENTROID mode or has a different number of channels.
+	 */
+	int push(Trill& trill);
+	/**
+	 * Render the signals for a block of samples.
+	 *
+	 * @param outputs one buffer of @p numFrames samples per channel.
+	 * @param numFrames the number of samples in the block.
+	 * @param time the time of the first sample. The output at each
+	 * sample is the interpolated value at that time minus the
+	 * latency.
+	 */
+	void process(float* const* outputs, unsigned int numFrames, FrameClock::Timestamp time);
+	/**
+	 * Render one value per channel, e.g.: once per audio block.
+	 *
+	 * @param values one value per channel.
+	 * @param time the time to render, before subtracting the latency.
+	 */
+	void getValues(float* values, FrameClock::Timestamp time);
+	/**
+	 * Get the number of calls to process() or getValues() that had to
+	 * hold the latest frame because the frames needed for the
+	 * interpolation were not available yet.
+	 */
+	unsigned int getNumUnderruns() const { return numUnderruns; }
+	/**
+	 * Get the number of channels.
+	 */
+	unsigned int getNumChannels() const { return numChannels; }
+private:
+	const float* getChannel(unsigned int channel) const { return values.data() + channel * 2 * kHistory; }
+	float getValue(unsigned int channel, uint32_t frame) const { return getChannel(channel)[frame % kHistory]; }
+	FrameClock::Timestamp getTime(uint32_t frame) const { return times[frame % kHistory]; }
+	void renderSegment(float* const* outputs, unsigned int start, unsigned int end, uint32_t oldest, uint32_t newest, bool hold, float u0, float du);
+	// one value per channel per frame, channel-major. Each frame is
+	// written twice, kHistory apart, so that any window of frames
+	// is contiguous
+	std::vector<float> values;
+	FrameClock::Timestamp times[kHistory];
+	std::vector<float*> valuePointers; // for getValues()
+	std::vector<float> kernel; // kBandLimited weights, per phase
+	std::atomic<uint32_t> count{0}; // frames pushed
+	uint32_t segment = 0; // the frame preceding the last sample rendered
+	unsigned int numChannels = 0;
+	unsigned int numUnderruns = 0;
+	Type type = kCubic;
+	double samplePeriod = 0; // ns
+	double latency = 0; // ns
+};
@@ -0,0 +1,104 @@
+#include "FrameClock.h"
+#include <time.h>
+#include <math.h>
+
+enum {
+	kMaxFrameGap = 256, // beyond this, we assume we lost track
+	kLockCount = 16,
+};
+
+FrameClock::FrameClock(double nominalPeriod, double bandwidth)
+{
+	setup(nominalPeriod, bandwidth);
+}
+
+int FrameClock::setup(double nominalPeriod, double bandwidth)
+{
+	if(nominalPeriod <= 0 || bandwidth <= 0)
+		return 1;
+	this->nominalPeriod = nominalPeriod * 1000000000.0;
+	this->bandwidth = bandwidth;
+	reset();
+	return 0;
+}
+
+void FrameClock::reset()
+{
+	count = 0;
+	period = nominalPeriod;
+	updateCoefficients();
+}
+
+void FrameClock::updateCoefficients()
+{
+	// coefficients of a critically damped second-order DLL, as in
+	// F. Adriaensen, "Using a DLL to filter time", 2005
+	double omega = 2 * M_PI * bandwidth * period / 1000000000.0;
+	b = sqrt(2) * omega;
+	c = omega * omega;
+}
+
+int FrameClock::update(uint32_t frameId, Timestamp hostTime)
+{
+	if(!nominalPeriod)
+		return 1;
+	uint32_t gap = frameId - lastFrameId;
+	if(count && !gap)
+		return 1; // same frame as last time
+	if(!count || gap > kMaxFrameGap)
+	{
+		// (re)start from this observation
+		frameTime = hostTime;
+		lastFrameId = frameId;
+		period = nominalPeriod;
+		count = 1;
+		return 0;
+	}
+	double predicted = frameTime + gap * period;
+	double err = double(hostTime) - predicted;
+	frameTime = predicted + b * err;
+	period += c * err / gap;
+	// the device clock is not that bad: if we end up here, something
+	// went wrong and we'd better start afresh
+	if(period < nominalPeriod * 0.5 || period > nominalPeriod * 2)
+	{
+		count = 0;
+		return update(frameId, hostTime);
+	}
+	lastFrameId = frameId;
+	if(count < kLockCount)
+		count++;
+	return 0;
+}
+
+FrameClock::Timestamp FrameClock::getFrameTime(uint32_t frameId) const
+{
+	if(!count)
+		return 0;
+	int32_t frames = frameId - lastFrameId;
+	return frameTime + frames * period + 0.5;
+}
+
+double FrameClock::getPeriod() const
+{
+	return period / 1000000000.0;
+}
+
+double FrameClock::getDrift() const
+{
+	if(!nominalPeriod)
+		return 0;
+	return period / nominalPeriod - 1;
+}
+
+bool FrameClock::isLocked() const
+{
+	return count >= kLockCount;
+}
+
+FrameClock::Timestamp FrameClock::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return Timestamp(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+
+/**
+ * \brief Recover a smooth device clock from a sequence of frame IDs.
+ *
+ * When a Trill device scans on its timer, consecutive frames are
+ * generated at a fixed period of the device's 32kHz clock, which may
+ * deviate by 10% or more from its nominal frequency. The host receive
+ * times of those frames are affected by bus, scheduling and syscall
+ * jitter.
+ *
+ * This class implements a second-order delay-locked loop that maps the
+ * unwrapped frame ID sequence to a smoothed timeline expressed in
+ * CLOCK_MONOTONIC nanoseconds, estimating the actual frame period along
+ * the way. Frames don't need to be observed contiguously: gaps in the
+ * frame IDs are accounted for.
+ */
+class FrameClock
+{
+public:
+	/**
+	 * A CLOCK_MONOTONIC time, in nanoseconds.
+	 */
+	typedef uint64_t Timestamp;
+	FrameClock() {};
+	/**
+	 * @param nominalPeriod the nominal duration of a frame, in seconds.
+	 * @param bandwidth the bandwidth of the loop, in Hz. Lower values
+	 * give smoother timestamps but slower convergence.
+	 */
+	FrameClock(double nominalPeriod, double bandwidth = 0.5);
+	/**
+	 * \copydoc FrameClock::FrameClock(double, double)
+	 */
+	int setup(double nominalPeriod, double bandwidth = 0.5);
+	/**
+	 * Forget all past observations, keeping the current settings.
+	 */
+	void reset();
+	/**
+	 * Pass a new observation to the estimator.
+	 *
+	 * @param frameId the unwrapped frame ID, as returned by
+	 * Trill::getFrameIdUnwrapped().
+	 * @param hostTime the time at which the frame was received.
+	 *
+	 * @return 0 if the observation was used, or 1 if it was discarded
+	 * (e.g.: because it refers to a frame that was already observed).
+	 */
+	int update(uint32_t frameId, Timestamp hostTime);
+	/**
+	 * Get the smoothed timestamp for the specified frame.
+	 * Frames that have not been observed yet are extrapolated from
+	 * the current estimate.
+	 */
+	Timestamp getFrameTime(uint32_t frameId) const;
+	/**
+	 * Get the estimated frame period, in seconds.
+	 */
+	double getPeriod() const;
+	/**
+	 * Get the relative deviation of the estimated frame period from
+	 * the nominal one (e.g.: 0.1 means that frames are 10% longer than
+	 * nominal).
+	 */
+	double getDrift() const;
+	/**
+	 * Whether enough observations have been received for the
+	 * estimates to be meaningful.
+	 */
+	bool isLocked() const;
+	/**
+	 * Get the current CLOCK_MONOTONIC time.
+	 */
+	static Timestamp now();
+private:
+	void updateCoefficients();
+	double nominalPeriod = 0; // ns
+	double bandwidth = 0.5;
+	double period = 0; // ns
+	double frameTime = 0; // ns, estimated time of lastFrameId
+	double b;
+	double c;
+	uint32_t lastFrameId;
+	unsigned int count = 0;
+};
@@ -35,6 +35,9 @@ public:
 	I2c(I2c&&) = delete;
 	int initI2C_RW(int bus, int address, int file);
 	int closeI2C();
+	int getFileHandle() const { return i2C_file; }
+	int getBus() const { return i2C_bus; }
+	int setTimeout(unsigned int ms);
 
 	virtual ~I2c();
 
@@ -79,6 +82,19 @@ inline int I2c::closeI2C()
 	return 0;
 }
 
+// Set the time after which the adapter gives up on a transfer, which then
+// fails with ETIMEDOUT. This applies to all devices on the same bus and is
+// rounded up to a multiple of 10ms.
+inline int I2c::setTimeout(unsigned int ms)
+{
+	if(ioctl(i2C_file, I2C_TIMEOUT, (ms + 9) / 10) < 0)
+	{
+		fprintf(stderr, "I2C_TIMEOUT failed...");
+		return 1;
+	}
+	return 0;
+}
+
 inline ssize_t I2c::readBytes(void *buf, size_t count)
 {
 	return read(i2C_file, buf, count);
@@ -0,0 +1,145 @@
+#include "TouchFilter.h"
+#include <math.h>
+
+TouchFilter::TouchFilter(Type type)
+{
+	setup(type);
+}
+
+int TouchFilter::setup(Type type)
+{
+	this->type = type;
+	reset();
+	return 0;
+}
+
+void TouchFilter::setOneEuroParameters(float minCutoff, float beta, float derivativeCutoff)
+{
+	this->minCutoff = minCutoff;
+	this->beta = beta;
+	this->derivativeCutoff = derivativeCutoff;
+}
+
+void TouchFilter::setAlphaBetaParameters(float alpha, float beta)
+{
+	this->alpha = alpha;
+	this->abBeta = beta;
+}
+
+void TouchFilter::setKalmanParameters(float processNoise, float measurementNoise)
+{
+	this->processNoise = processNoise;
+	this->measurementNoise = measurementNoise;
+}
+
+void TouchFilter::reset()
+{
+	numTouches = 0;
+	lastTimestamp = 0;
+}
+
+// smoothing factor of a one-pole low-pass with the given cutoff
+static float lowPassAlpha(float cutoff, float dt)
+{
+	float tau = 1.f / (2 * float(M_PI) * cutoff);
+	return 1.f / (1.f + tau / dt);
+}
+
+void TouchFilter::update(Axis& axis, float x, float dt)
+{
+	switch(type)
+	{
+	case kOneEuro:
+	{
+		// differentiating the measurements rather than the filtered
+		// values, so that the lag of the latter doesn't bias the
+		// velocity estimate
+		float dx = (x - axis.measured) / dt;
+		axis.dx += lowPassAlpha(derivativeCutoff, dt) * (dx - axis.dx);
+		float cutoff = minCutoff + beta * fabsf(axis.dx);
+		axis.x += lowPassAlpha(cutoff, dt) * (x - axis.x);
+		break;
+	}
+	case kAlphaBeta:
+	case kKalman:
+	{
+		float a = alpha;
+		float b = abBeta;
+		if(kKalman == type)
+		{
+			// steady-state gains from the tracking index (Kalata, 1984)
+			float lambda = processNoise * dt * dt / measurementNoise;
+			float r = (4 + lambda - sqrtf(8 * lambda + lambda * lambda)) / 4;
+			a = 1 - r * r;
+			b = 2 * (2 - a) - 4 * sqrtf(1 - a);
+		}
+		float predicted = axis.x + axis.dx * dt;
+		float residual = x - predicted;
+		axis.x = predicted + a * residual;
+		axis.dx += b * residual / dt;
+		break;
+	}
+	}
+	axis.measured = x;
+}
+
+void TouchFilter::process(const TouchTracker& tracker, FrameClock::Timestamp timestamp)
+{
+	// the first frame, or a timestamp going backwards, leaves no usable
+	// time reference. Frames too close to the previous one are not
+	// filtered, and their time is accumulated into the next one.
+	int64_t elapsed = int64_t(timestamp - lastTimestamp);
+	bool restart = !lastTimestamp || elapsed < 0;
+	float dt = restart ? 0 : elapsed / 1000000000.f;
+	const float kMinDt = 0.0001;
+	bool hold = !restart && dt < kMinDt;
+	if(!hold)
+		lastTimestamp = timestamp;
+	unsigned int numPastTouches = numTouches;
+	for(unsigned int n = 0; n < numPastTouches; ++n)
+	{
+		pastTouches[n] = touches[n];
+		pastAxes[n][0] = axes[n][0];
+		pastAxes[n][1] = axes[n][1];
+	}
+	numTouches = tracker.getNumTouches();
+	for(unsigned int n = 0; n < numTouches; ++n)
+	{
+		const TouchTracker::Touch& t = tracker.getTouch(n);
+		unsigned int p;
+		for(p = 0; p < numPastTouches; ++p)
+			if(pastTouches[p].id == t.id)
+				break;
+		Axis* axis = axes[n];
+		if(p == numPastTouches || restart)
+		{
+			// new touch, or no usable time reference: start from
+			// the measurement, at rest
+			axis[0] = { t.location, 0, t.location };
+			axis[1] = { t.horizontalLocation, 0, t.horizontalLocation };
+		} else {
+			axis[0] = pastAxes[p][0];
+			axis[1] = pastAxes[p][1];
+			if(!hold)
+			{
+				update(axis[0], t.location, dt);
+				update(axis[1], t.horizontalLocation, dt);
+			}
+		}
+		touches[n] = {
+			t.id,
+			axis[0].x,
+			axis[1].x,
+			t.size,
+			axis[0].dx,
+			axis[1].dx,
+		};
+	}
+}
+
+void TouchFilter::predict(unsigned int n, float horizon, float& location, float& horizontalLocation) const
+{
+	const Touch& t = touches[n];
+	location = t.location + t.velocity * horizon;
+	horizontalLocation = t.horizontalLocation + t.horizontalVelocity * horizon;
+}
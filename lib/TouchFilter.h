@@ -0,0 +1,116 @@
+#pragma once
+#include <TouchTracker.h>
+#include <FrameClock.h>
+
+/**
+ * \brief Smooth tracked touches and estimate their velocity.
+ *
+ * This runs on the output of a TouchTracker, keeping one filter state
+ * per touch ID in fixed-size storage. Besides the smoothed location, it
+ * provides an estimate of the velocity of each touch, which can be used
+ * to predict where the touch will be a short time in the future, e.g.:
+ * to compensate for the latency of scanning and I2C transfers.
+ *
+ * The available filters are:
+ * - #kOneEuro: the 1€ filter (Casiez et al., 2012), an adaptive low-pass
+ *   filter whose cutoff rises with speed, trading jitter at low speed
+ *   for lag at high speed.
+ * - #kAlphaBeta: a constant-velocity alpha-beta filter with fixed gains.
+ * - #kKalman: the same as #kAlphaBeta, but the gains are those of the
+ *   steady-state Kalman filter for the given process and measurement
+ *   noise, updated for the actual interval between frames.
+ */
+class TouchFilter
+{
+public:
+	typedef enum {
+		kOneEuro,
+		kAlphaBeta,
+		kKalman,
+	} Type;
+	struct Touch {
+		uint32_t id; ///< The ID assigned by the TouchTracker
+		float location; ///< The filtered (vertical) location
+		float horizontalLocation; ///< The filtered horizontal location
+		float size; ///< The size of the touch, unfiltered
+		float velocity; ///< The (vertical) velocity, in units per second
+		float horizontalVelocity; ///< The horizontal velocity, in units per second
+	};
+	TouchFilter() {};
+	TouchFilter(Type type);
+	int setup(Type type);
+	/**
+	 * Set the parameters of the #kOneEuro filter.
+	 *
+	 * @param minCutoff the cutoff frequency when the touch is still, in Hz.
+	 * @param beta how much the cutoff increases with the speed.
+	 * @param derivativeCutoff the cutoff frequency of the filter applied
+	 * to the velocity, in Hz.
+	 */
+	void setOneEuroParameters(float minCutoff, float beta, float derivativeCutoff = 1);
+	/**
+	 * Set the gains of the #kAlphaBeta filter.
+	 */
+	void setAlphaBetaParameters(float alpha, float beta);
+	/**
+	 * Set the parameters of the #kKalman filter.
+	 *
+	 * @param processNoise the standard deviation of the acceleration
+	 * of touches, in units per second squared.
+	 * @param measurementNoise the standard deviation of the noise on
+	 * the measured location, in units.
+	 */
+	void setKalmanParameters(float processNoise, float measurementNoise);
+	/**
+	 * Forget all touches.
+	 */
+	void reset();
+	/**
+	 * Process the current frame of a TouchTracker.
+	 *
+	 * @param timestamp the time of the frame, e.g.: as returned by
+	 * Trill::getFrameTimestamp().
+	 */
+	void process(const TouchTracker& tracker, FrameClock::Timestamp timestamp);
+	/**
+	 * Get the number of touches in the current frame.
+	 */
+	unsigned int getNumTouches() const { return numTouches; }
+	/**
+	 * Get a filtered touch. Touches are in the same order as in the
+	 * TouchTracker.
+	 */
+	const Touch& getTouch(unsigned int n) const { return touches[n]; }
+	/**
+	 * Predict the location of a touch, extrapolating linearly from
+	 * its filtered location and velocity.
+	 *
+	 * @param n the touch.
+	 * @param horizon how far after the time of the current frame to
+	 * predict, in seconds.
+	 * @param location the predicted (vertical) location.
+	 * @param horizontalLocation the predicted horizontal location.
+	 */
+	void predict(unsigned int n, float horizon, float& location, float& horizontalLocation) const;
+private:
+	struct Axis {
+		float x; // filtered location
+		float dx; // filtered velocity
+		float measured; // last unfiltered location
+	};
+	void update(Axis& axis, float x, float dt);
+	Touch touches[TouchTracker::kMaxTouches];
+	Axis axes[TouchTracker::kMaxTouches][2];
+	Touch pastTouches[TouchTracker::kMaxTouches];
+	Axis pastAxes[TouchTracker::kMaxTouches][2];
+	unsigned int numTouches = 0;
+	Type type = kOneEuro;
+	float minCutoff = 1;
+	float beta = 5;
+	float derivativeCutoff = 1;
+	float alpha = 0.5;
+	float abBeta = 0.1;
+	float processNoise = 10;
+	float measurementNoise = 0.005;
+	FrameClock::Timestamp lastTimestamp = 0;
+};
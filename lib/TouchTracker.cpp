@@ -0,0 +1,280 @@
+#include "TouchTracker.h"
+#include "Trill.h"
+#include "CentroidDetection.h"
+#include "CentroidDetection2D.h"
+#include <algorithm>
+#include <limits>
+
+TouchTracker::TouchTracker(float maxDistance)
+{
+	setup(maxDistance);
+}
+
+int TouchTracker::setup(float maxDistance)
+{
+	if(maxDistance <= 0)
+		return 1;
+	maxDistanceSquared = maxDistance * maxDistance;
+	reset();
+	return 0;
+}
+
+void TouchTracker::reset()
+{
+	nextId = 0;
+	numTouches = 0;
+	numPastTouches = 0;
+	numEvents = 0;
+}
+
+float TouchTracker::cost(const Touch& a, const Touch& b) const
+{
+	float d = a.location - b.location;
+	float cost = d * d;
+	if(is2D)
+	{
+		d = a.horizontalLocation - b.horizontalLocation;
+		cost += d * d;
+	}
+	return cost;
+}
+
+// Sort indices to the touches by location. n is small, so insertion sort
+// will do.
+static void sortByLocation(const TouchTracker::Touch* touches, unsigned int n, uint8_t* idx)
+{
+	for(unsigned int i = 0; i < n; ++i)
+	{
+		unsigned int j = i;
+		for(; j > 0 && touches[idx[j - 1]].location > touches[i].location; --j)
+			idx[j] = idx[j - 1];
+		idx[j] = i;
+	}
+}
+
+void TouchTracker::match1D()
+{
+	// On a line, the optimal matching between two sets of points
+	// doesn't cross over itself, so we can find it with a dynamic
+	// programming pass over the sorted touches, just like an edit
+	// distance. Leaving a touch unmatched costs half the maximum
+	// distance squared, so that matching two touches is preferred to
+	// ending one and starting the other whenever they are close
+	// enough.
+	uint8_t past[kMaxTouches];
+	uint8_t current[kMaxTouches];
+	sortByLocation(pastTouches, numPastTouches, past);
+	sortByLocation(touches, numTouches, current);
+	const float skip = maxDistanceSquared * 0.5f;
+	const unsigned int stride = numTouches + 1;
+	enum { kMatch, kSkipPast, kSkipCurrent };
+	for(unsigned int i = 0; i <= numPastTouches; ++i)
+	{
+		for(unsigned int j = 0; j <= numTouches; ++j)
+		{
+			float best = std::numeric_limits<float>::infinity();
+			int8_t c = kMatch;
+			if(!i && !j)
+				best = 0;
+			if(i && dp[(i - 1) * stride + j] + skip < best)
+			{
+				best = dp[(i - 1) * stride + j] + skip;
+				c = kSkipPast;
+			}
+			if(j && dp[i * stride + j - 1] + skip < best)
+			{
+				best = dp[i * stride + j - 1] + skip;
+				c = kSkipCurrent;
+			}
+			if(i && j)
+			{
+				float d = cost(pastTouches[past[i - 1]], touches[current[j - 1]]);
+				if(d <= maxDistanceSquared && dp[(i - 1) * stride + j - 1] + d < best)
+				{
+					best = dp[(i - 1) * stride + j - 1] + d;
+					c = kMatch;
+				}
+			}
+			dp[i * stride + j] = best;
+			choice[i * stride + j] = c;
+		}
+	}
+	unsigned int i = numPastTouches;
+	unsigned int j = numTouches;
+	while(i || j)
+	{
+		switch(choice[i * stride + j])
+		{
+		case kMatch:
+			--i;
+			--j;
+			matches[current[j]] = past[i];
+			break;
+		case kSkipPast:
+			--i;
+			break;
+		case kSkipCurrent:
+			--j;
+			break;
+		}
+	}
+}
+
+void TouchTracker::match2D()
+{
+	// dp[i * stride + mask] is the lowest cost of matching the first i
+	// past touches to the current touches in mask.
+	const float skip = maxDistanceSquared * 0.5f;
+	const unsigned int stride = 1 << numTouches;
+	const float inf = std::numeric_limits<float>::infinity();
+	std::fill(dp, dp + (numPastTouches + 1) * stride, inf);
+	dp[0] = 0;
+	for(unsigned int i = 0; i < numPastTouches; ++i)
+	{
+		for(unsigned int mask = 0; mask < stride; ++mask)
+		{
+			float base = dp[i * stride + mask];
+			if(inf == base)
+				continue;
+			// leave past touch i unmatched
+			unsigned int next = (i + 1) * stride + mask;
+			if(base + skip < dp[next])
+			{
+				dp[next] = base + skip;
+				choice[next] = -1;
+			}
+			// or match it to any of the current touches left
+			for(unsigned int j = 0; j < numTouches; ++j)
+			{
+				if(mask & (1 << j))
+					continue;
+				float d = cost(pastTouches[i], touches[j]);
+				if(d > maxDistanceSquared)
+					continue;
+				next = (i + 1) * stride + (mask | (1 << j));
+				if(base + d < dp[next])
+				{
+					dp[next] = base + d;
+					choice[next] = j;
+				}
+			}
+		}
+	}
+	// current touches not in the mask are unmatched
+	unsigned int bestMask = 0;
+	float best = inf;
+	for(unsigned int mask = 0; mask < stride; ++mask)
+	{
+		float c = dp[numPastTouches * stride + mask] + skip * (numTouches - __builtin_popcount(mask));
+		if(c < best)
+		{
+			best = c;
+			bestMask = mask;
+		}
+	}
+	unsigned int mask = bestMask;
+	for(unsigned int i = numPastTouches; i > 0; --i)
+	{
+		int8_t j = choice[i * stride + mask];
+		if(j >= 0)
+		{
+			matches[j] = i - 1;
+			mask &= ~(1 << j);
+		}
+	}
+}
+
+void TouchTracker::process(unsigned int numTouches, const float* locations, const float* sizes, const float* horizontalLocations)
+{
+	std::copy(touches, touches + this->numTouches, pastTouches);
+	numPastTouches = this->numTouches;
+	this->numTouches = std::min(numTouches, (unsigned int)kMaxTouches);
+	is2D = horizontalLocations;
+	for(unsigned int n = 0; n < this->numTouches; ++n)
+	{
+		touches[n].location = locations[n];
+		touches[n].horizontalLocation = is2D ? horizontalLocations[n] : 0;
+		touches[n].size = sizes[n];
+		matches[n] = -1;
+	}
+	if(is2D)
+		match2D();
+	else
+		match1D();
+
+	numEvents = 0;
+	bool matched[kMaxTouches] = {false};
+	for(unsigned int n = 0; n < this->numTouches; ++n)
+		if(matches[n] >= 0)
+			matched[matches[n]] = true;
+	for(unsigned int n = 0; n < numPastTouches; ++n)
+		if(!matched[n])
+			events[numEvents++] = {kEventUp, pastTouches[n]};
+	for(unsigned int n = 0; n < this->numTouches; ++n)
+	{
+		EventType type;
+		if(matches[n] >= 0) {
+			touches[n].id = pastTouches[matches[n]].id;
+			type = kEventMove;
+		} else {
+			touches[n].id = nextId++;
+			type = kEventDown;
+		}
+		events[numEvents++] = {type, touches[n]};
+	}
+}
+
+template <typename T>
+void TouchTracker::process2D(T& source)
+{
+	unsigned int numV = source.getNumTouches();
+	unsigned int numH = source.getNumHorizontalTouches();
+	unsigned int num = std::min(std::max(numV, numH), (unsigned int)kMaxTouches);
+	if(!numV || !numH)
+		num = 0;
+	float locations[kMaxTouches];
+	float horizontalLocations[kMaxTouches];
+	float sizes[kMaxTouches];
+	for(unsigned int n = 0; n < num; ++n)
+	{
+		unsigned int v = std::min(n, numV - 1);
+		unsigned int h = std::min(n, numH - 1);
+		locations[n] = source.touchLocation(v);
+		horizontalLocations[n] = source.touchHorizontalLocation(h);
+		sizes[n] = std::max(source.touchSize(v), source.touchHorizontalSize(h));
+	}
+	process(num, locations, sizes, horizontalLocations);
+}
+
+void TouchTracker::process(Trill& trill)
+{
+	if(trill.is2D())
+		return process2D(trill);
+	float locations[kMaxTouches];
+	float sizes[kMaxTouches];
+	unsigned int num = std::min(trill.getNumTouches(), (unsigned int)kMaxTouches);
+	for(unsigned int n = 0; n < num; ++n)
+	{
+		locations[n] = trill.touchLocation(n);
+		sizes[n] = trill.touchSize(n);
+	}
+	process(num, locations, sizes);
+}
+
+void TouchTracker::process(const CentroidDetection& detection)
+{
+	float locations[kMaxTouches];
+	float sizes[kMaxTouches];
+	unsigned int num = std::min(detection.getNumTouches(), (unsigned int)kMaxTouches);
+	for(unsigned int n = 0; n < num; ++n)
+	{
+		locations[n] = detection.touchLocation(n);
+		sizes[n] = detection.touchSize(n);
+	}
+	process(num, locations, sizes);
+}
+
+void TouchTracker::process(const CentroidDetection2D& detection)
+{
+	process2D(detection);
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+
+class Trill;
+class CentroidDetection;
+class CentroidDetection2D;
+
+/**
+ * \brief Assign persistent IDs to touches across frames.
+ *
+ * Detectors such as Trill and CentroidDetection report the touches in
+ * each frame as a list ordered by location, so the same finger may
+ * have a different index from one frame to the next. This class matches
+ * the touches in each frame to those in the previous frame, so that
+ * each touch keeps the same ID for as long as it lasts, and reports the
+ * corresponding down, move and up events.
+ *
+ * The matching minimises the total squared distance between matched
+ * touches, and touches that moved farther than the maximum distance
+ * set in setup() are never matched. On one axis, the optimal matching
+ * preserves the order of the touches and it is found in
+ * O(touches^2). On two axes, all the assignments are explored in
+ * O(touches^2 * 2^touches), which is still cheap for the number of
+ * touches that a Trill device can detect.
+ *
+ * All storage is allocated in the object and no memory is allocated
+ * during processing.
+ */
+class TouchTracker
+{
+public:
+	enum {
+		kMaxTouches = 8, ///< The maximum number of touches that can be tracked
+	};
+	struct Touch {
+		uint32_t id; ///< The ID of the touch, unique since the last reset()
+		float location; ///< The (vertical) location of the touch
+		float horizontalLocation; ///< The horizontal location of the touch, or 0 for 1D input
+		float size; ///< The size of the touch
+	};
+	typedef enum {
+		kEventDown, ///< A new touch has started
+		kEventMove, ///< A touch from the previous frame is still active
+		kEventUp, ///< A touch from the previous frame has ended
+	} EventType;
+	struct Event {
+		EventType type;
+		/**
+		 * For #kEventUp, this contains the last known state of the
+		 * touch.
+		 */
+		Touch touch;
+	};
+	TouchTracker() {};
+	/**
+	 * @param maxDistance the largest distance, expressed in the same
+	 * unit as the touch locations, that a touch can move between two
+	 * consecutive frames while still being considered the same touch.
+	 */
+	TouchTracker(float maxDistance);
+	/**
+	 * \copydoc TouchTracker::TouchTracker(float)
+	 */
+	int setup(float maxDistance);
+	/**
+	 * Forget about all touches and restart IDs from 0. No #kEventUp
+	 * events are generated.
+	 */
+	void reset();
+	/**
+	 * Process a new frame.
+	 *
+	 * @param numTouches the number of touches in the frame. Touches
+	 * in excess of #kMaxTouches are ignored.
+	 * @param locations the (vertical) location of each touch.
+	 * @param sizes the size of each touch.
+	 * @param horizontalLocations the horizontal location of each
+	 * touch, or `nullptr` for 1D input.
+	 */
+	void process(unsigned int numTouches, const float* locations, const float* sizes, const float* horizontalLocations = nullptr);
+	/**
+	 * Process the current frame of a Trill device in
+	 * Trill::CENTROID mode.
+	 *
+	 * On 2D devices, the two axes may report a different number of
+	 * touches. In that case, the touches with no corresponding
+	 * centroid on one axis get the location of the last centroid on
+	 * that axis.
+	 */
+	void process(Trill& trill);
+	/**
+	 * Process the current frame of a CentroidDetection.
+	 */
+	void process(const CentroidDetection& detection);
+	/**
+	 * Process the current frame of a CentroidDetection2D. Touches are
+	 * paired as in process(Trill&).
+	 */
+	void process(const CentroidDetection2D& detection);
+	/**
+	 * Get the number of touches in the current frame.
+	 */
+	unsigned int getNumTouches() const { return numTouches; }
+	/**
+	 * Get a touch in the current frame. Touches are in the same order
+	 * as they were passed to process().
+	 */
+	const Touch& getTouch(unsigned int n) const { return touches[n]; }
+	/**
+	 * Get the number of events generated by the last call to process().
+	 */
+	unsigned int getNumEvents() const { return numEvents; }
+	/**
+	 * Get an event generated by the last call to process(). All
+	 * #kEventUp events come first.
+	 */
+	const Event& getEvent(unsigned int n) const { return events[n]; }
+private:
+	template <typename T> void process2D(T& source);
+	float cost(const Touch& a, const Touch& b) const;
+	void match1D();
+	void match2D();
+	Touch touches[kMaxTouches];
+	Touch pastTouches[kMaxTouches];
+	Event events[kMaxTouches * 2];
+	int8_t matches[kMaxTouches]; // for each touch, the index of the matching past touch, or -1
+	float dp[(kMaxTouches + 1) * (1 << kMaxTouches)];
+	int8_t choice[(kMaxTouches + 1) * (1 << kMaxTouches)];
+	float maxDistanceSquared = 0;
+	uint32_t nextId = 0;
+	unsigned int numTouches = 0;
+	unsigned int numPastTouches = 0;
+	unsigned int numEvents = 0;
+	bool is2D = false;
+};
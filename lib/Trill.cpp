@@ -1,8 +1,11 @@
 #include "Trill.h"
+#include "TrillExecutor.h"
+#include "TrillTrace.h"
 #include <map>
 #include <vector>
 #include <string.h>
 #include <limits>
+#include <cmath>
 
 constexpr uint8_t Trill::speedValues[4];
 #define MAX_TOUCH_1D_OR_2D (((device_type_ == SQUARE || device_type_ == HEX) ? kMaxTouchNum2D : kMaxTouchNum1D))
@@ -127,10 +130,14 @@ void Trill::updateChannelMask(uint32_t mask)
 int Trill::setup(unsigned int i2c_bus, Device device, uint8_t i2c_address)
 {
 	dataBuffer.resize(0);
+	frame = nullptr;
+	frameSize = 0;
 	rawData.resize(0);
 	rawData.resize(kNumChannelsMax);
 	address = 0;
 	frameId = 0;
+	readStartTime = readEndTime = 0;
+	frameClock = FrameClock();
 	device_type_ = NONE;
 	TrillDefaults defaults = trillDefaults.at(device);
 	if(ANY == device && 255 == i2c_address) {
@@ -235,6 +242,33 @@ int Trill::setup(unsigned int i2c_bus, Device device, uint8_t i2c_address)
 	return 0;
 }
 
+int Trill::setupOffline(Device device, Mode mode, unsigned int numChannels, unsigned int transmissionWidth, float rawScale)
+{
+	if(NONE == device || ANY == device || AUTO == mode || numChannels > kNumChannelsMax || !(rawScale > 0)) {
+		fprintf(stderr, "Invalid offline setup\n");
+		return 1;
+	}
+	dataBuffer.resize(0);
+	frame = nullptr;
+	frameSize = 0;
+	rawData.resize(0);
+	rawData.resize(kNumChannelsMax);
+	address = 0;
+	frameId = 0;
+	readStartTime = readEndTime = 0;
+	frameClock.reset();
+	device_type_ = device;
+	mode_ = mode;
+	this->numChannels = numChannels;
+	this->transmissionWidth = transmissionWidth;
+	transmissionRightShift = 0;
+	numBits = std::max(9, std::min(16, int(std::round(-std::log2(rawScale)))));
+	updateRescale();
+	rawRescale = rawScale;
+	readErrorOccurred = false;
+	return 0;
+}
+
 Trill::Device Trill::probe(unsigned int i2c_bus, uint8_t i2c_address)
 {
 	Trill t;
@@ -338,6 +372,16 @@ static void printErrno(int ret)
 		fprintf(stderr, "errno %d, %s.\n", errno, strerror(errno));
 }
 int Trill::writeCommandAndHandle(const i2c_char_t* data, size_t size, const char* name) {
+	int ret = writeCommand(data, size, name);
+	if(ret)
+		return ret;
+	if(kCommandReset == data[0])
+		return sleepBeforeDeadline(500000); // it won't ack after reset ... (TODO: should it?)
+	else
+		return waitForAck(data[0], name);
+}
+
+int Trill::writeCommand(const i2c_char_t* data, size_t size, const char* name) {
 	constexpr size_t kMaxCommandBytes = 3;
 	if(size > kMaxCommandBytes)
 	{
@@ -355,7 +399,9 @@ int Trill::writeCommandAndHandle(const i2c_char_t* data, size_t size, const char
 			printf("%d ", buf[n]);
 		printf("\n");
 	}
-	int ret = writeBytes(buf, bytesToWrite);
+	int ret = transfer(buf, bytesToWrite, true);
+	if(-ETIMEDOUT == ret)
+		return ret;
 	if(ret != bytesToWrite)
 	{
 		if(!quiet)
@@ -363,10 +409,7 @@ int Trill::writeCommandAndHandle(const i2c_char_t* data, size_t size, const char
 		return 1;
 	}
 	currentReadOffset = buf[0];
-	if(kCommandReset == buf[1])
-		return usleep(500000); // it won't ack after reset ... (TODO: should it?)
-	else
-		return waitForAck(buf[1], name);
+	return 0;
 }
 
 int Trill::readBytesFrom(const uint8_t offset, i2c_char_t& byte, const char* name)
@@ -378,7 +421,10 @@ int Trill::readBytesFrom(const uint8_t offset, i2c_char_t* data, size_t size, co
 {
 	if(offset != currentReadOffset)
 	{
-		int ret = writeBytes(&offset, sizeof(offset));
+		i2c_char_t buf = offset;
+		int ret = transfer(&buf, sizeof(buf), true);
+		if(-ETIMEDOUT == ret)
+			return ret;
 		if(ret != sizeof(offset))
 		{
 			if(!quiet)
@@ -389,9 +435,11 @@ int Trill::readBytesFrom(const uint8_t offset, i2c_char_t* data, size_t size, co
 			return 1;
 		}
 		currentReadOffset = offset;
-		usleep(commandSleepTime);
+		sleepBeforeDeadline(commandSleepTime);
 	}
-	ssize_t bytesRead = readBytes(data, size);
+	ssize_t bytesRead = transfer(data, size, false);
+	if(-ETIMEDOUT == bytesRead)
+		return bytesRead;
 	if (bytesRead != ssize_t(size))
 	{
 		fprintf(stderr, "%s: failed to read %zd bytes. ret: %zd\n", name, size, bytesRead);
@@ -405,8 +453,7 @@ int Trill::waitForAck(const uint8_t command, const char* name)
 {
 	if(firmware_version_ < 3) {
 		// old or unknown firmware, use old sleep time for bw compatibility
-		usleep(10000);
-		return 0;
+		return sleepBeforeDeadline(10000);
 	}
 	size_t bytesToRead;
 	if(verbose)
@@ -418,9 +465,13 @@ int Trill::waitForAck(const uint8_t command, const char* name)
 	unsigned int totalSleep = 0;
 	while(totalSleep < 200000)
 	{
-		usleep(sleep);
-		if(readBytesFrom(kOffsetCommand, buf, sizeof(buf), name))
-			return 1;
+		sleepBeforeDeadline(sleep);
+		FrameClock::Timestamp start = TrillTrace::isEnabled() ? FrameClock::now() : 0;
+		int ret = readBytesFrom(kOffsetCommand, buf, sizeof(buf), name);
+		if(start)
+			TrillTrace::record(TrillTrace::kAckPoll, i2C_bus, i2C_address, command, sizeof(buf), start, FrameClock::now(), ret > 0 ? -EIO : ret);
+		if(ret)
+			return ret;
 		if(kCommandAck == buf[0])
 		{
 			// The device places the received command number in the
@@ -513,6 +564,17 @@ int Trill::setMode(Mode mode) {
 	return 0;
 }
 
+int Trill::requestMode(Mode mode) {
+	if(AUTO == mode)
+		mode = trillDefaults.at(device_type_).mode;
+	i2c_char_t buf[] = { kCommandMode, (i2c_char_t)mode };
+	int ret = writeCommand(buf, sizeof(buf), __PRETTY_FUNCTION__);
+	if(ret)
+		return ret;
+	mode_ = mode;
+	return 0;
+}
+
 int Trill::setScanSettings(uint8_t speed, uint8_t num_bits) {
 	if(speed > 3)
 		speed = 3;
@@ -584,6 +646,12 @@ int Trill::setTimerPeriod(float ms) {
 		i2c_char_t buf[] = { kCommandTimerPeriod, i2c_char_t(period), i2c_char_t(ticks) };
 		if(WRITE_COMMAND_BUF(buf))
 			return 1;
+		// the device's default period is not known, so the clock is
+		// only used once a period has been set here
+		if(ticks)
+			frameClock.setup(period * ticks / 32000.0);
+		else
+			frameClock = FrameClock();
 	} else {
 		// fw 2 had kCommandAutoScanInterval, which takes a WORD
 		// representing cycles of the 32kHz clock
@@ -616,6 +684,7 @@ int Trill::setAutoScanInterval(uint16_t interval)
 int Trill::setScanTrigger(ScanTriggerMode mode) {
 	REQUIRE_FW_AT_LEAST(3);
 	scanTriggerMode = mode;
+	frameClock.reset();
 	i2c_char_t buf[] = { kCommandScanTrigger, i2c_char_t(scanTriggerMode) };
 	return WRITE_COMMAND_BUF(buf);
 }
@@ -697,10 +766,23 @@ int Trill::readI2C(bool shouldReadStatusByte) {
 	// version here. On fw < 3, shouldReadStatusByte will read one more
 	// byte full of garbage.
 
-	ssize_t bytesToRead = getBytesToRead(shouldReadStatusByte);
-	dataBuffer.resize(bytesToRead);
+	// read into a separate buffer, so that the previous frame, which
+	// may be in dataBuffer, is kept intact if the read fails midway
+	readBuffer.resize(getBytesToRead(shouldReadStatusByte));
 	i2c_char_t offset = shouldReadStatusByte ? kOffsetStatusByte : kOffsetChannelData;
-	if(READ_BYTES_FROM(offset, dataBuffer.data(), dataBuffer.size()))
+	// set the offset first, so that the timestamps only cover the
+	// transfer of the data
+	int ret = prepareForDataRead(shouldReadStatusByte);
+	FrameClock::Timestamp start = FrameClock::now();
+	if(!ret)
+		ret = READ_BYTES_FROM(offset, readBuffer.data(), readBuffer.size());
+	FrameClock::Timestamp end = FrameClock::now();
+	if(-ETIMEDOUT == ret)
+	{
+		// a missed frame: keep the previous one
+		return ret;
+	}
+	if(ret)
 	{
 		num_touches_ = 0;
 		fprintf(stderr, "Trill: error while reading from device %s at address %#x (%d)\n",
@@ -708,24 +790,132 @@ int Trill::readI2C(bool shouldReadStatusByte) {
 		readErrorOccurred = true;
 		return 1;
 	}
-	parseNewData(shouldReadStatusByte);
+	readStartTime = start;
+	readEndTime = end;
+	std::swap(dataBuffer, readBuffer);
+	parseNewData(dataBuffer.data(), dataBuffer.size(), shouldReadStatusByte);
 	return 0;
 }
 
-void Trill::newData(const uint8_t* newData, size_t len, bool includesStatusByte)
+int Trill::readI2C(bool shouldReadStatusByte, FrameClock::Timestamp deadline)
 {
+	FrameClock::Timestamp previous = this->deadline;
+	this->deadline = deadline;
+	int ret = readI2C(shouldReadStatusByte);
+	this->deadline = previous;
+	return ret;
+}
+
+ssize_t Trill::transfer(i2c_char_t* data, size_t size, bool write)
+{
+	FrameClock::Timestamp start = FrameClock::now();
+	if(deadline && start >= deadline)
+	{
+		++transactionStats.timeouts;
+		return -ETIMEDOUT;
+	}
+	ssize_t ret = write ? writeBytes(data, size) : readBytes(data, size);
+	int err = errno;
+	FrameClock::Timestamp end = FrameClock::now();
+	recordTransaction(start, end, ret == ssize_t(size) ? 0 : -err);
+	if(TrillTrace::isEnabled())
+	{
+		// commands are written along with kOffsetCommand
+		TrillTrace::Kind kind = !write ? TrillTrace::kRead : 1 == size ? TrillTrace::kOffset : TrillTrace::kCommand;
+		uint8_t arg = !write ? currentReadOffset : data[size > 1];
+		TrillTrace::record(kind, i2C_bus, i2C_address, arg, size, start, end, ret == ssize_t(size) ? 0 : -err);
+	}
+	errno = err;
+	// the adapter gave up, see I2c::setTimeout()
+	if(ret < 0 && ETIMEDOUT == err)
+		return -ETIMEDOUT;
+	return ret;
+}
+
+int Trill::sleepBeforeDeadline(unsigned int us)
+{
+	if(deadline)
+	{
+		FrameClock::Timestamp now = FrameClock::now();
+		if(now >= deadline)
+			return 0;
+		us = std::min(FrameClock::Timestamp(us), (deadline - now + 999) / 1000);
+	}
+	if(!TrillTrace::isEnabled())
+		return TrillExecutor::sleep(us);
+	FrameClock::Timestamp start = FrameClock::now();
+	int ret = TrillExecutor::sleep(us);
+	TrillTrace::record(TrillTrace::kSleep, i2C_bus, i2C_address, 0, 0, start, FrameClock::now(), ret);
+	return ret;
+}
+
+void Trill::recordTransaction(FrameClock::Timestamp start, FrameClock::Timestamp end, int ret)
+{
+	TransactionStats& s = transactionStats;
+	++s.transactions;
+	if(-ETIMEDOUT == ret)
+		++s.timeouts;
+	else if(ret)
+		++s.errors;
+	else if(deadline && end > deadline)
+		++s.overruns;
+	s.maxDuration = std::max(s.maxDuration, end - start);
+}
+
+int Trill::prepareForDataRead(bool shouldReadStatusByte)
+{
+	if(NONE == device_type_)
+		return 1;
+	i2c_char_t offset = shouldReadStatusByte ? kOffsetStatusByte : kOffsetChannelData;
+	if(offset == currentReadOffset)
+		return 0;
+	int ret = transfer(&offset, sizeof(offset), true);
+	if(-ETIMEDOUT == ret)
+		return ret;
+	if(ret != sizeof(offset))
+	{
+		if(!quiet)
+		{
+			fprintf(stderr, "Trill: error while setting read offset\n");
+			printErrno(ret);
+		}
+		return 1;
+	}
+	currentReadOffset = offset;
+	sleepBeforeDeadline(commandSleepTime);
+	return 0;
+}
+
+void Trill::newData(const uint8_t* newData, size_t len, bool includesStatusByte, FrameClock::Timestamp timestamp)
+{
+	if(!timestamp)
+		timestamp = FrameClock::now();
+	readStartTime = readEndTime = timestamp;
 	// we ensure dataBuffer's size is consistent with readI2C(), regardless
 	// of how many bytes are actually passed here.
 	dataBuffer.resize(getBytesToRead(includesStatusByte));
 	memcpy(dataBuffer.data(), newData, std::min(len * sizeof(newData[0]), sizeof(dataBuffer[0]) * dataBuffer.size()));
-	parseNewData(includesStatusByte);
+	parseNewData(dataBuffer.data(), dataBuffer.size(), includesStatusByte);
+}
+
+int Trill::parse(const uint8_t* data, size_t len, bool includesStatusByte, FrameClock::Timestamp timestamp)
+{
+	size_t size = getBytesToRead(includesStatusByte);
+	if(len < size)
+		return 1;
+	if(!timestamp)
+		timestamp = FrameClock::now();
+	readStartTime = readEndTime = timestamp;
+	parseNewData(data, size, includesStatusByte);
+	return 0;
 }
 
-void Trill::parseNewData(bool includesStatusByte)
+// srcSize is as returned by getBytesToRead()
+void Trill::parseNewData(const uint8_t* src, size_t srcSize, bool includesStatusByte)
 {
-	// by the time this is called, dataBuffer will have been resized appropriately
-	uint8_t* src = this->dataBuffer.data();
-	size_t srcSize = this->dataBuffer.size();
+	frame = src;
+	frameSize = srcSize;
+	frameIncludesStatusByte = includesStatusByte;
 	if(!srcSize)
 		return;
 	if(includesStatusByte)
@@ -734,10 +924,9 @@ void Trill::parseNewData(bool includesStatusByte)
 		src++;
 		srcSize--;
 	}
-	dataBufferIncludesStatusByte = includesStatusByte;
 	if(CENTROID != mode_) {
 		// parse, rescale and copy data to public buffer
-		float rawRescale = this->rawRescale * (1 << transmissionRightShift);
+		float rawRescale = getRawScale();
 		switch(transmissionWidth)
 		{
 			default:
@@ -747,7 +936,7 @@ void Trill::parseNewData(bool includesStatusByte)
 				break;
 			case 12:
 				{
-					uint8_t* p = src;
+					const uint8_t* p = src;
 					const uint8_t* end = src + srcSize;
 					for (unsigned int i = 0; i < getNumChannels() && p < end; ++i)
 					{
@@ -800,18 +989,40 @@ void Trill::processStatusByte(uint8_t newStatusByte)
 	if(newFrameId < (frameId & 0x3f))
 		frameId += 0x40;
 	frameId = (frameId & 0xffffffc0) | (newFrameId);
+	// frame IDs are only evenly spaced in time if scanning is
+	// exclusively triggered by the timer
+	if(kScanTriggerTimer == scanTriggerMode)
+		frameClock.update(frameId, readStartTime);
 }
 
 int Trill::readStatusByte()
 {
 	REQUIRE_FW_AT_LEAST(3);
 	uint8_t newStatusByte;
-	if(READ_BYTE_FROM(kOffsetStatusByte, newStatusByte))
+	if(prepareForDataRead(true))
 		return -1;
+	FrameClock::Timestamp start = FrameClock::now();
+	int ret = READ_BYTE_FROM(kOffsetStatusByte, newStatusByte);
+	FrameClock::Timestamp end = FrameClock::now();
+	if(ret)
+		return -1;
+	readStartTime = start;
+	readEndTime = end;
 	processStatusByte(newStatusByte);
 	return newStatusByte;
 }
 
+int Trill::triggerScan()
+{
+	if(NONE == device_type_)
+		return 1;
+	i2c_char_t byte;
+	ssize_t ret = transfer(&byte, sizeof(byte), false);
+	if(-ETIMEDOUT == ret)
+		return ret;
+	return ret != sizeof(byte);
+}
+
 bool Trill::hasReset()
 {
 	return !TrillStatusByte::parse(statusByte).initialised;
@@ -830,6 +1041,13 @@ uint32_t Trill::getFrameIdUnwrapped() {
 	return frameId;
 }
 
+FrameClock::Timestamp Trill::getFrameTimestamp() const
+{
+	if(kScanTriggerTimer == scanTriggerMode && frameClock.isLocked())
+		return frameClock.getFrameTime(frameId);
+	return readStartTime;
+}
+
 bool Trill::is1D()
 {
 	if(CENTROID != mode_)
@@ -875,7 +1093,7 @@ unsigned int Trill::getNumHorizontalTouches()
 	// Upper 4 bits hold number of horizontal touches
 	return (num_touches_ >> 4);
 }
-#define dbOffset (dataBufferIncludesStatusByte * sizeof(TrillStatusByte))
+#define dbOffset (frameIncludesStatusByte * sizeof(TrillStatusByte))
 
 float Trill::touchLocation(uint8_t touch_num)
 {
@@ -884,8 +1102,8 @@ float Trill::touchLocation(uint8_t touch_num)
 	if(touch_num >= MAX_TOUCH_1D_OR_2D)
 		return -1;
 
-	int location = dataBuffer[dbOffset + 2 * touch_num] * 256;
-	location += dataBuffer[dbOffset + 2 * touch_num + 1];
+	int location = frame[dbOffset + 2 * touch_num] * 256;
+	location += frame[dbOffset + 2 * touch_num + 1];
 
 	return location * posRescale;
 }
@@ -900,8 +1118,8 @@ float Trill::getButtonValue(uint8_t button_num)
 		return -1;
 
 	return ((
-		(dataBuffer[dbOffset + 4 * MAX_TOUCH_1D_OR_2D + 2 * button_num] << 8)
-		+ dataBuffer[dbOffset + 4 * MAX_TOUCH_1D_OR_2D + 2 * button_num + 1]
+		(frame[dbOffset + 4 * MAX_TOUCH_1D_OR_2D + 2 * button_num] << 8)
+		+ frame[dbOffset + 4 * MAX_TOUCH_1D_OR_2D + 2 * button_num + 1]
 		) & 0x0FFF) * rawRescale;
 }
 
@@ -912,8 +1130,8 @@ float Trill::touchSize(uint8_t touch_num)
 	if(touch_num >= MAX_TOUCH_1D_OR_2D)
 		return -1;
 
-	int size = dataBuffer[dbOffset + 2 * touch_num + 2 * MAX_TOUCH_1D_OR_2D] * 256;
-	size += dataBuffer[dbOffset + 2 * touch_num + 2 * MAX_TOUCH_1D_OR_2D + 1];
+	int size = frame[dbOffset + 2 * touch_num + 2 * MAX_TOUCH_1D_OR_2D] * 256;
+	size += frame[dbOffset + 2 * touch_num + 2 * MAX_TOUCH_1D_OR_2D + 1];
 
 	return size * sizeRescale;
 }
@@ -925,8 +1143,8 @@ float Trill::touchHorizontalLocation(uint8_t touch_num)
 	if(touch_num >= MAX_TOUCH_1D_OR_2D)
 		return -1;
 
-	int location = dataBuffer[dbOffset + 2 * touch_num + 4 * MAX_TOUCH_1D_OR_2D] * 256;
-	location += dataBuffer[dbOffset + 2 * touch_num + 4 * MAX_TOUCH_1D_OR_2D+ 1];
+	int location = frame[dbOffset + 2 * touch_num + 4 * MAX_TOUCH_1D_OR_2D] * 256;
+	location += frame[dbOffset + 2 * touch_num + 4 * MAX_TOUCH_1D_OR_2D+ 1];
 
 	return location * posHRescale;
 }
@@ -938,8 +1156,8 @@ float Trill::touchHorizontalSize(uint8_t touch_num)
 	if(touch_num >= MAX_TOUCH_1D_OR_2D)
 		return -1;
 
-	int size = dataBuffer[dbOffset + 2 * touch_num + 6 * MAX_TOUCH_1D_OR_2D] * 256;
-	size += dataBuffer[dbOffset + 2 * touch_num + 6* MAX_TOUCH_1D_OR_2D + 1];
+	int size = frame[dbOffset + 2 * touch_num + 6 * MAX_TOUCH_1D_OR_2D] * 256;
+	size += frame[dbOffset + 2 * touch_num + 6* MAX_TOUCH_1D_OR_2D + 1];
 
 	return size * sizeRescale;
 }
@@ -975,6 +1193,13 @@ float Trill::compoundTouchSize()
 	return size;
 }
 
+const uint8_t* Trill::getPayload(size_t& size) const
+{
+	size_t offset = frameIncludesStatusByte * sizeof(TrillStatusByte);
+	size = frameSize > offset ? frameSize - offset : 0;
+	return frame + offset;
+}
+
 unsigned int Trill::getNumChannels() const
 {
 	return numChannels;
@@ -1,5 +1,6 @@
 #pragma once
 #include <I2c.h>
+#include <FrameClock.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -7,6 +8,10 @@
 /**
  * \brief A class to use the Trill family of capacitive sensors.
  * http://bela.io/trill
+ *
+ * Methods that wait for the device, e.g.: for a command to be
+ * acknowledged, suspend the calling task instead of sleeping when
+ * called from a task of a TrillExecutor.
  * \nosubgrouping
  */
 
@@ -70,9 +75,14 @@ class Trill : public I2c
 		uint8_t address;
 		uint8_t firmware_version_ = 0; // Firmware version running on the device
 		uint8_t num_touches_; // Number of touches on last read
-		bool dataBufferIncludesStatusByte = false;
+		bool frameIncludesStatusByte = false;
 		bool quiet = false;
 		std::vector<uint8_t> dataBuffer;
+		std::vector<uint8_t> readBuffer; // swapped with dataBuffer when readI2C() succeeds
+		// the data last parsed: either dataBuffer or the buffer passed
+		// to parse()
+		const uint8_t* frame = nullptr;
+		size_t frameSize = 0;
 		uint16_t commandSleepTime = 1000;
 		size_t currentReadOffset = -1;
 		bool shouldReadFrameId = false;
@@ -85,21 +95,41 @@ class Trill : public I2c
 		float posHRescale;
 		float sizeRescale;
 		float rawRescale;
-		ScanTriggerMode scanTriggerMode;
+		ScanTriggerMode scanTriggerMode = kScanTriggerI2c;
+		FrameClock::Timestamp readStartTime = 0;
+		FrameClock::Timestamp readEndTime = 0;
+		FrameClock frameClock;
 		int identify();
 		void updateRescale();
-		void parseNewData(bool includesStatusByte);
+		void parseNewData(const uint8_t* src, size_t srcSize, bool includesStatusByte);
 		void processStatusByte(uint8_t newStatusByte);
+		int writeCommand(const i2c_char_t* data, size_t size, const char* name);
 		int writeCommandAndHandle(const i2c_char_t* data, size_t size, const char* name);
 		int writeCommandAndHandle(i2c_char_t command, const char* name);
 		int readBytesFrom(uint8_t offset, i2c_char_t* data, size_t size, const char* name);
 		int readBytesFrom(uint8_t offset, i2c_char_t& byte, const char* name);
+		ssize_t transfer(i2c_char_t* data, size_t size, bool write);
+		int sleepBeforeDeadline(unsigned int us);
 		int waitForAck(uint8_t command, const char* name);
 		void updateChannelMask(uint32_t mask);
 		int verbose = 0;
 		uint8_t cmdCounter = 0;
 		bool readErrorOccurred;
 		bool enableVersionCheck = true;
+		FrameClock::Timestamp deadline = 0;
+	public:
+		/**
+		 * Counters of the I2C transfers with the device.
+		 */
+		struct TransactionStats {
+			uint32_t transactions = 0; ///< transfers performed
+			uint32_t errors = 0; ///< transfers that failed, other than timeouts
+			uint32_t timeouts = 0; ///< transfers abandoned or aborted because of a deadline or timeout
+			uint32_t overruns = 0; ///< transfers that completed after the deadline
+			FrameClock::Timestamp maxDuration = 0; ///< the duration of the longest transfer, in nanoseconds
+		};
+	private:
+		TransactionStats transactionStats;
 	public:
 		/**
 		 * @name RAW, BASELINE or DIFF mode
@@ -178,6 +208,22 @@ class Trill : public I2c
 		 * \copydoc TAGS_canonical_return
 		 */
 		int setup(unsigned int i2c_bus, Device device = ANY, uint8_t i2c_address = 255);
+		/**
+		 * Set up an object that isn't connected to a device, so that
+		 * frames recorded elsewhere can be passed to newData() or
+		 * parse(), e.g.: when replaying a TrillArchiveReader file. No
+		 * command can be sent to the device.
+		 *
+		 * @param device the type of the device that was recorded.
+		 * @param mode the mode it was in.
+		 * @param numChannels the number of channels it transmitted.
+		 * @param transmissionWidth the width of each channel, as in
+		 * setTransmissionFormat().
+		 * @param rawScale the value of getRawScale() at the time.
+		 *
+		 * \copydoc TAGS_canonical_return
+		 */
+		int setupOffline(Device device, Mode mode, unsigned int numChannels, unsigned int transmissionWidth, float rawScale);
 
 		/**
 		 * Probe the bus for a device at the specified address.
@@ -223,6 +269,17 @@ class Trill : public I2c
 		 * \copydoc TAGS_canonical_return
 		 */
 		int readI2C(bool shouldReadStatusByte = false);
+		/**
+		 * \brief Read data from the device, within a deadline.
+		 *
+		 * Same as readI2C(bool), but giving up if the data can't be
+		 * read before @p deadline, see setDeadline(). In that case
+		 * the previous frame is kept.
+		 *
+		 * @return 0 on success, `-ETIMEDOUT` if the deadline expired
+		 * or another error code.
+		 */
+		int readI2C(bool shouldReadStatusByte, FrameClock::Timestamp deadline);
 
 		/**
 		 * \brief Set data retrieved from the device.
@@ -237,8 +294,52 @@ class Trill : public I2c
 		 * should be the value returned from getBytesToRead().
 		 * @param includesStatusByte whether #newData includes the
 		 * status byte or not.
+		 * @param timestamp the CLOCK_MONOTONIC time at which the data
+		 * was received, in nanoseconds. If this is 0, the time at
+		 * which this method is called is used instead.
+		 */
+		void newData(const uint8_t* newData, size_t len, bool includesStatusByte = false, FrameClock::Timestamp timestamp = 0);
+
+		/**
+		 * \brief Parse data retrieved from the device, in place.
+		 *
+		 * Same as newData(), but without copying the data: in
+		 * #CENTROID mode the touches are decoded from @p data when
+		 * they are requested, and getPayload() points into it. The
+		 * buffer must therefore remain valid and unchanged until the
+		 * next call to parse(), newData() or readI2C(), e.g.: by
+		 * returning it to its pool only after the frame has been
+		 * used. In all other modes, #rawData is filled right away.
+		 *
+		 * @param data A pointer to the data.
+		 * @param len The length of the data, which must be at least
+		 * getBytesToRead().
+		 * @param includesStatusByte whether @p data includes the
+		 * status byte or not.
+		 * @param timestamp as in newData().
+		 *
+		 * @return 0 on success, or 1 if @p len is too short, in
+		 * which case the previous frame is kept.
+		 */
+		int parse(const uint8_t* data, size_t len, bool includesStatusByte = false, FrameClock::Timestamp timestamp = 0);
+
+		/**
+		 * \brief Prepare the device for reads performed elsewhere.
+		 *
+		 * Set the read offset of the device so that each subsequent
+		 * read of getBytesToRead() bytes from getFileHandle() retrieves
+		 * new data, to be passed to newData(). This is only needed
+		 * when performing the reads outside of readI2C() (e.g.:
+		 * asynchronously, see TrillUring), and it has to be called
+		 * again after any other method that communicates with the
+		 * device. It does nothing if the offset is already set.
+		 *
+		 * @param shouldReadStatusByte whether or not the reads
+		 * will include the status byte.
+		 *
+		 * \copydoc TAGS_canonical_return
 		 */
-		void newData(const uint8_t* newData, size_t len, bool includesStatusByte = false);
+		int prepareForDataRead(bool shouldReadStatusByte = false);
 
 		/**
 		 * Get the device type.
@@ -306,6 +407,20 @@ class Trill : public I2c
 		 * \copydoc TAGS_canonical_return
 		 */
 		int setMode(Mode mode);
+		/**
+		 * Same as setMode(), but without waiting for the device to
+		 * acknowledge the command, so that the mode can be changed
+		 * while streaming (see TrillMultiMode). The device switches
+		 * after it has processed the command, so the frame being
+		 * scanned at that time, and those scanned before it, are in
+		 * the previous mode. Use the frame ID, see
+		 * getFrameIdUnwrapped(), to tell them apart. Switching to or
+		 * from #CENTROID mode changes the size of the frame, so it
+		 * is better done with setMode().
+		 *
+		 * \copydoc TAGS_canonical_return
+		 */
+		int requestMode(Mode mode);
 		/**
 		 * Set the speed and bit depth of the capacitive scanning.
 		 * This triggers a call to `CSD_SetScanMode(speed, num_bits)`
@@ -372,6 +487,10 @@ class Trill : public I2c
 		 * \copydoc TAGS_canonical_return
 		 */
 		int setScanTrigger(ScanTriggerMode scanTriggerMode);
+		/**
+		 * Get the scan trigger mode last set with setScanTrigger().
+		 */
+		ScanTriggerMode getScanTrigger() const { return scanTriggerMode; }
 		/**
 		 * Set the interval for scanning capacitive channels when the
 		 * device's scanning is triggered by the timer.
@@ -384,6 +503,8 @@ class Trill : public I2c
 		 * above 2032 ms.
 		 * Scanning on timer has to be separately enabled via setScanTrigger().
 		 * When @p ms is not greater than zero, the timer is disabled.
+		 * The period is also used to configure the FrameClock used by
+		 * getFrameTimestamp().
 		 *
 		 * \note The 32kHz clock often deviates by 10% or more from its
 		 * nominal frequency, thus affecting the accuracy of the timer.
@@ -450,6 +571,15 @@ class Trill : public I2c
 		 * \copydoc TAGS_firmware_3_undef
 		 */
 		int readStatusByte();
+		/**
+		 * Perform the shortest possible transaction with the device,
+		 * reading one byte, so that a device set to
+		 * #kScanTriggerI2c starts a new scan. This doesn't change the
+		 * data of the current frame.
+		 *
+		 * \copydoc TAGS_canonical_return
+		 */
+		int triggerScan();
 		/**
 		 * Whether the device has reset since a identify command was
 		 * last written to it.
@@ -490,6 +620,120 @@ class Trill : public I2c
 		 * @}
 		 */
 
+		/**
+		 * @name Deadlines
+		 * @{
+		 *
+		 * By default, a transaction with the device waits as long as
+		 * it takes, which for a command includes up to 200ms of
+		 * polling for its ack. When a deadline is set, no transfer
+		 * starts and no wait extends past it: the transaction is
+		 * abandoned and the method returns `-ETIMEDOUT` instead.
+		 *
+		 * A transfer that has already started can't be interrupted,
+		 * so it may complete after the deadline: this is counted as
+		 * an overrun in getTransactionStats(). The duration of a
+		 * single transfer can be bounded with I2c::setTimeout().
+		 */
+		/**
+		 * Set the time, as returned by FrameClock::now(), after
+		 * which transactions are abandoned. Use 0 for no deadline.
+		 */
+		void setDeadline(FrameClock::Timestamp deadline) { this->deadline = deadline; }
+		/**
+		 * Get the current deadline, or 0 if there is none.
+		 */
+		FrameClock::Timestamp getDeadline() const { return deadline; }
+		/**
+		 * Get the counters of all transfers with the device, including
+		 * timeouts and overruns.
+		 */
+		const TransactionStats& getTransactionStats() const { return transactionStats; }
+		/**
+		 * Reset the counters returned by getTransactionStats().
+		 */
+		void resetTransactionStats() { transactionStats = TransactionStats(); }
+		/**
+		 * Add a transfer performed outside of this class (e.g.: by
+		 * TrillUring) to the counters returned by
+		 * getTransactionStats().
+		 *
+		 * @param start the time at which the transfer started
+		 * @param end the time at which it completed
+		 * @param ret 0 on success, `-ETIMEDOUT` if it timed out, or
+		 * another error code.
+		 */
+		void recordTransaction(FrameClock::Timestamp start, FrameClock::Timestamp end, int ret);
+		/** @} */
+
+		/**
+		 * @name Timestamps
+		 * @{
+		 *
+		 * All timestamps are CLOCK_MONOTONIC times expressed in
+		 * nanoseconds, as returned by FrameClock::now().
+		 */
+		/**
+		 * Get the time at which the I2C transaction that retrieved
+		 * the current frame started.
+		 */
+		FrameClock::Timestamp getReadStartTime() const { return readStartTime; }
+		/**
+		 * Get the time at which the I2C transaction that retrieved
+		 * the current frame ended.
+		 */
+		FrameClock::Timestamp getReadEndTime() const { return readEndTime; }
+		/**
+		 * Get the best available estimate of the time at which the
+		 * current frame was acquired.
+		 *
+		 * When the device scans only on its timer (#kScanTriggerTimer)
+		 * and the status byte is read with every frame, the frame IDs
+		 * are fed to a FrameClock, which recovers a smoothed timeline
+		 * of the device's clock, free of bus and scheduling jitter
+		 * and corrected for the drift of the device's clock.
+		 * As the device's default timer period is not known, the
+		 * FrameClock is only in use after setTimerPeriod() has been
+		 * called with a non-zero period (firmware 3 or above).
+		 * Until the FrameClock is locked, or when it is not in use,
+		 * this returns the same as getReadStartTime().
+		 */
+		FrameClock::Timestamp getFrameTimestamp() const;
+		/**
+		 * Get the FrameClock used to estimate frame timestamps.
+		 */
+		const FrameClock& getFrameClock() const { return frameClock; }
+		/** @} */
+
+		/**
+		 * @name Payload
+		 * @{
+		 *
+		 * Access to the data exactly as transmitted by the device,
+		 * e.g.: to forward it without converting it to floats.
+		 */
+		/**
+		 * Get the data received in the last call to readI2C(),
+		 * newData() or parse(), excluding the status byte. In #CENTROID mode,
+		 * this contains the centroids; in all other modes, it
+		 * contains one value per channel, packed according to
+		 * getTransmissionWidth().
+		 *
+		 * @param size the number of valid bytes.
+		 */
+		const uint8_t* getPayload(size_t& size) const;
+		/**
+		 * Get the number of bits used to transmit each channel, as
+		 * set by setTransmissionFormat().
+		 */
+		unsigned int getTransmissionWidth() const { return transmissionWidth; }
+		/**
+		 * Get the factor by which the values transmitted for each
+		 * channel are multiplied to obtain the values in #rawData.
+		 */
+		float getRawScale() const { return rawRescale * (1 << transmissionRightShift); }
+		/** @} */
+
 		/**
 		 * @name Centroid Mode
 		 * @{
@@ -0,0 +1,606 @@
+#include "TrillArchive.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+using namespace TrillArchive;
+
+static const char kFileMagic[4] = { 'T', 'R', 'L', 'A' };
+static const char kTrailerMagic[8] = { 'T', 'R', 'L', 'A', 'I', 'D', 'X', '\0' };
+// blocks are also closed when their body reaches this size, so that
+// they can be read in one go
+static constexpr size_t kMaxBodySize = 1 << 20;
+
+static void put(uint8_t* dest, uint64_t value, unsigned int bytes)
+{
+	for(unsigned int n = 0; n < bytes; ++n)
+		dest[n] = value >> (8 * n);
+}
+
+static uint64_t get(const uint8_t* src, unsigned int bytes)
+{
+	uint64_t value = 0;
+	for(unsigned int n = 0; n < bytes; ++n)
+		value |= uint64_t(src[n]) << (8 * n);
+	return value;
+}
+
+static void putVarint(std::vector<uint8_t>& dest, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		dest.push_back(value | 0x80);
+		value >>= 7;
+	}
+	dest.push_back(value);
+}
+
+// returns false if src ends before the varint
+static bool getVarint(const uint8_t*& src, const uint8_t* end, uint64_t& value)
+{
+	value = 0;
+	for(unsigned int shift = 0; src < end && shift < 64; shift += 7)
+	{
+		uint8_t byte = *src++;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// map signed values to unsigned ones, so that small differences in
+// either direction take few bytes
+static uint64_t zigzag(int64_t value)
+{
+	return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+	return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+static size_t getChannelsSize(unsigned int numChannels, unsigned int width)
+{
+	switch(width)
+	{
+		case 8:
+			return numChannels;
+		case 12:
+			return numChannels + (numChannels + 1) / 2;
+		default:
+			return numChannels * 2;
+	}
+}
+
+// the values of the channels, packed as in Trill::parseNewData()
+static void unpackChannels(const uint8_t* p, unsigned int numChannels, unsigned int width, uint16_t* slots)
+{
+	for(unsigned int n = 0; n < numChannels; ++n)
+	{
+		switch(width)
+		{
+		case 8:
+			slots[n] = *p++;
+			break;
+		case 12:
+			if(n & 1) {
+				slots[n] = ((*p++) & 0xf0) << 4;
+				slots[n] |= *p++;
+			} else {
+				slots[n] = *p++ << 4;
+				slots[n] |= (*p & 0xf);
+			}
+			break;
+		default:
+			slots[n] = (p[0] << 8) | p[1];
+			p += 2;
+			break;
+		}
+	}
+}
+
+static void packChannels(const uint16_t* slots, unsigned int numChannels, unsigned int width, uint8_t* p)
+{
+	for(unsigned int n = 0; n < numChannels; ++n)
+	{
+		switch(width)
+		{
+		case 8:
+			*p++ = slots[n];
+			break;
+		case 12:
+			if(n & 1) {
+				*p++ |= (slots[n] >> 4) & 0xf0;
+				*p++ = slots[n];
+			} else {
+				*p++ = slots[n] >> 4;
+				*p = slots[n] & 0xf;
+			}
+			break;
+		default:
+			*p++ = slots[n] >> 8;
+			*p++ = slots[n];
+			break;
+		}
+	}
+}
+
+// big-endian 16-bit words, the last one padded if the size is odd
+static void unpackWords(const uint8_t* p, size_t size, uint16_t* slots)
+{
+	for(size_t n = 0; n < size; n += 2)
+		slots[n / 2] = (p[n] << 8) | (n + 1 < size ? p[n + 1] : 0);
+}
+
+static void packWords(const uint16_t* slots, size_t size, uint8_t* p)
+{
+	for(size_t n = 0; n < size; n += 2)
+	{
+		p[n] = slots[n / 2] >> 8;
+		if(n + 1 < size)
+			p[n + 1] = slots[n / 2];
+	}
+}
+
+TrillArchiveWriter::~TrillArchiveWriter()
+{
+	close();
+}
+
+int TrillArchiveWriter::open(const std::string& path)
+{
+	close();
+	file = fopen(path.c_str(), "wb");
+	if(!file)
+	{
+		fprintf(stderr, "TrillArchiveWriter: unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	offset = 0;
+	devices.clear();
+	index.clear();
+	body.clear();
+	block.numFrames = 0;
+	uint8_t header[kFileHeaderSize] = {0};
+	memcpy(header, kFileMagic, sizeof(kFileMagic));
+	header[4] = kVersion;
+	return write(header, sizeof(header));
+}
+
+int TrillArchiveWriter::close()
+{
+	if(!file)
+		return 0;
+	int ret = flush();
+	uint64_t indexOffset = offset;
+	std::vector<uint8_t> buf(8 + index.size() * kIndexEntrySize + kTrailerSize);
+	uint8_t* p = buf.data();
+	p[0] = 'T';
+	p[1] = 'I';
+	p[2] = p[3] = 0;
+	put(p + 4, index.size(), 4);
+	p += 8;
+	for(auto& e : index)
+	{
+		put(p, e.offset, 8);
+		put(p + 8, e.numFrames, 4);
+		put(p + 12, e.minTimestamp, 8);
+		put(p + 20, e.maxTimestamp, 8);
+		put(p + 28, e.minFrameId, 4);
+		put(p + 32, e.maxFrameId, 4);
+		p += kIndexEntrySize;
+	}
+	put(p, indexOffset, 8);
+	memcpy(p + 8, kTrailerMagic, sizeof(kTrailerMagic));
+	ret |= write(buf.data(), buf.size());
+	if(fclose(file))
+		ret = 1;
+	file = nullptr;
+	return ret;
+}
+
+int TrillArchiveWriter::write(const void* data, size_t size)
+{
+	if(fwrite(data, 1, size, file) != size)
+	{
+		fprintf(stderr, "TrillArchiveWriter: error while writing: %s\n", strerror(errno));
+		return 1;
+	}
+	offset += size;
+	return 0;
+}
+
+unsigned int TrillArchiveWriter::getDevice(const TrillStreamPacket& packet)
+{
+	for(unsigned int n = 0; n < devices.size(); ++n)
+	{
+		const Device& d = devices[n];
+		if(d.mode == packet.mode && d.type == packet.device && d.width == packet.width
+			&& d.numChannels == packet.numChannels && d.scale == packet.scale
+			&& d.payloadSize == packet.payloadSize
+			&& d.id.size() == packet.idLength && !memcmp(d.id.data(), packet.id, packet.idLength))
+			return n;
+	}
+	devices.emplace_back();
+	Device& d = devices.back();
+	d.id.assign(packet.id, packet.idLength);
+	d.mode = packet.mode;
+	d.type = packet.device;
+	d.width = packet.width;
+	d.numChannels = packet.numChannels;
+	d.scale = packet.scale;
+	d.payloadSize = packet.payloadSize;
+	d.isDescribed = false;
+	return devices.size() - 1;
+}
+
+int TrillArchiveWriter::add(const TrillStreamPacket& packet)
+{
+	if(!file)
+		return 1;
+	// frames may come slightly out of order, e.g.: from different
+	// threads, so the time elapsed is signed
+	if(block.numFrames && (int64_t(packet.timestamp - block.minTimestamp) >= int64_t(blockDuration) || body.size() >= kMaxBodySize))
+	{
+		if(flush())
+			return 1;
+	}
+	unsigned int n = getDevice(packet);
+	if(n >= kMaxDevices)
+	{
+		devices.pop_back();
+		fprintf(stderr, "TrillArchiveWriter: too many devices or changes of their settings\n");
+		return 1;
+	}
+	Device& d = devices[n];
+	if(!d.isDescribed)
+	{
+		body.push_back(kRecordDevice);
+		putVarint(body, n);
+		body.push_back(d.type);
+		body.push_back(d.mode);
+		body.push_back(d.width);
+		body.push_back(d.numChannels);
+		uint32_t scaleBits;
+		memcpy(&scaleBits, &d.scale, sizeof(scaleBits));
+		size_t pos = body.size();
+		body.resize(pos + 4);
+		put(body.data() + pos, scaleBits, 4);
+		putVarint(body, d.payloadSize);
+		body.push_back(d.id.size());
+		body.insert(body.end(), d.id.begin(), d.id.end());
+		d.isDescribed = true;
+		d.lastRecord = kRecordDevice;
+		d.lastTimestamp = 0;
+		d.lastFrameId = 0;
+	}
+	// channels are coded by value if they can be packed back to
+	// the same payload, and as words otherwise
+	uint8_t record = kRecordWords;
+	unsigned int numSlots = (packet.payloadSize + 1) / 2;
+	slots.resize(std::max(numSlots, unsigned(packet.numChannels)));
+	if(TrillStreamPacket::kModeCentroid != packet.mode && getChannelsSize(packet.numChannels, packet.width) == packet.payloadSize)
+	{
+		unpackChannels(packet.payload, packet.numChannels, packet.width, slots.data());
+		uint8_t packed[TrillStreamPacket::kMaxSize];
+		packChannels(slots.data(), packet.numChannels, packet.width, packed);
+		if(!memcmp(packed, packet.payload, packet.payloadSize))
+		{
+			record = kRecordChannels;
+			numSlots = packet.numChannels;
+		}
+	}
+	if(kRecordWords == record)
+		unpackWords(packet.payload, packet.payloadSize, slots.data());
+	if(record != d.lastRecord)
+		d.last.assign(numSlots, 0);
+	body.push_back(record);
+	putVarint(body, n);
+	putVarint(body, zigzag(int64_t(packet.timestamp - d.lastTimestamp)));
+	putVarint(body, zigzag(int32_t(packet.frameId - d.lastFrameId)));
+	for(unsigned int s = 0; s < numSlots; ++s)
+		putVarint(body, zigzag(int32_t(slots[s]) - int32_t(d.last[s])));
+	std::copy(slots.begin(), slots.begin() + numSlots, d.last.begin());
+	d.lastRecord = record;
+	d.lastTimestamp = packet.timestamp;
+	d.lastFrameId = packet.frameId;
+	if(!block.numFrames)
+	{
+		block.minTimestamp = block.maxTimestamp = packet.timestamp;
+		block.minFrameId = block.maxFrameId = packet.frameId;
+	}
+	++block.numFrames;
+	block.minTimestamp = std::min(block.minTimestamp, packet.timestamp);
+	block.maxTimestamp = std::max(block.maxTimestamp, packet.timestamp);
+	block.minFrameId = std::min(block.minFrameId, packet.frameId);
+	block.maxFrameId = std::max(block.maxFrameId, packet.frameId);
+	return 0;
+}
+
+int TrillArchiveWriter::flush()
+{
+	if(!file)
+		return 1;
+	if(!block.numFrames)
+		return 0;
+	block.offset = offset;
+	uint8_t header[kBlockHeaderSize];
+	header[0] = 'T';
+	header[1] = 'B';
+	header[2] = header[3] = 0;
+	put(header + 4, body.size(), 4);
+	put(header + 8, block.numFrames, 4);
+	put(header + 12, block.minTimestamp, 8);
+	put(header + 20, block.maxTimestamp, 8);
+	put(header + 28, block.minFrameId, 4);
+	put(header + 32, block.maxFrameId, 4);
+	int ret = write(header, sizeof(header)) || write(body.data(), body.size());
+	// so that the block can be recovered if we don't get to close()
+	fflush(file);
+	index.push_back(block);
+	body.clear();
+	block.numFrames = 0;
+	for(auto& d : devices)
+		d.isDescribed = false;
+	return ret;
+}
+
+TrillArchiveReader::~TrillArchiveReader()
+{
+	close();
+}
+
+void TrillArchiveReader::close()
+{
+	if(file)
+		fclose(file);
+	file = nullptr;
+	index.clear();
+	devices.clear();
+	pos = end = nullptr;
+	nextBlock = 0;
+	hasPending = false;
+}
+
+int TrillArchiveReader::open(const std::string& path)
+{
+	close();
+	file = fopen(path.c_str(), "rb");
+	if(!file)
+	{
+		fprintf(stderr, "TrillArchiveReader: unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	uint8_t header[kFileHeaderSize];
+	if(fread(header, 1, sizeof(header), file) != sizeof(header)
+		|| memcmp(header, kFileMagic, sizeof(kFileMagic)) || kVersion != header[4])
+	{
+		fprintf(stderr, "TrillArchiveReader: %s is not a Trill archive\n", path.c_str());
+		close();
+		return 1;
+	}
+	fseeko(file, 0, SEEK_END);
+	fileSize = ftello(file);
+	uint8_t trailer[kTrailerSize];
+	if(fileSize >= kFileHeaderSize + kTrailerSize + 8)
+	{
+		fseeko(file, fileSize - kTrailerSize, SEEK_SET);
+		if(fread(trailer, 1, sizeof(trailer), file) == sizeof(trailer)
+			&& !memcmp(trailer + 8, kTrailerMagic, sizeof(kTrailerMagic)))
+		{
+			uint64_t indexOffset = get(trailer, 8);
+			uint8_t indexHeader[8];
+			fseeko(file, indexOffset, SEEK_SET);
+			// the entries have to fit between the header of the index
+			// and the trailer
+			if(indexOffset + sizeof(indexHeader) + kTrailerSize <= fileSize
+				&& fread(indexHeader, 1, sizeof(indexHeader), file) == sizeof(indexHeader) && 'T' == indexHeader[0] && 'I' == indexHeader[1]
+				&& get(indexHeader + 4, 4) * kIndexEntrySize == fileSize - indexOffset - sizeof(indexHeader) - kTrailerSize)
+			{
+				std::vector<uint8_t> buf(get(indexHeader + 4, 4) * kIndexEntrySize);
+				if(fread(buf.data(), 1, buf.size(), file) == buf.size())
+				{
+					for(const uint8_t* p = buf.data(); p < buf.data() + buf.size(); p += kIndexEntrySize)
+					{
+						IndexEntry e;
+						e.offset = get(p, 8);
+						e.numFrames = get(p + 8, 4);
+						e.minTimestamp = get(p + 12, 8);
+						e.maxTimestamp = get(p + 20, 8);
+						e.minFrameId = get(p + 28, 4);
+						e.maxFrameId = get(p + 32, 4);
+						index.push_back(e);
+					}
+					return 0;
+				}
+			}
+		}
+	}
+	// the writer didn't get to close the file, or the index is corrupted
+	return buildIndex(fileSize);
+}
+
+int TrillArchiveReader::buildIndex(uint64_t fileSize)
+{
+	index.clear();
+	uint64_t offset = kFileHeaderSize;
+	uint8_t header[kBlockHeaderSize];
+	while(offset + kBlockHeaderSize <= fileSize)
+	{
+		fseeko(file, offset, SEEK_SET);
+		if(fread(header, 1, sizeof(header), file) != sizeof(header) || 'T' != header[0] || 'B' != header[1])
+			break;
+		uint64_t size = get(header + 4, 4);
+		if(offset + kBlockHeaderSize + size > fileSize)
+			break; // incomplete
+		IndexEntry e;
+		e.offset = offset;
+		e.numFrames = get(header + 8, 4);
+		e.minTimestamp = get(header + 12, 8);
+		e.maxTimestamp = get(header + 20, 8);
+		e.minFrameId = get(header + 28, 4);
+		e.maxFrameId = get(header + 32, 4);
+		index.push_back(e);
+		offset += kBlockHeaderSize + size;
+	}
+	return 0;
+}
+
+int TrillArchiveReader::loadBlock(size_t n)
+{
+	uint8_t header[kBlockHeaderSize];
+	fseeko(file, index[n].offset, SEEK_SET);
+	if(fread(header, 1, sizeof(header), file) != sizeof(header) || 'T' != header[0] || 'B' != header[1])
+		return -1;
+	uint64_t size = get(header + 4, 4);
+	if(index[n].offset + kBlockHeaderSize + size > fileSize)
+		return -1;
+	body.resize(size);
+	if(fread(body.data(), 1, body.size(), file) != body.size())
+		return -1;
+	pos = body.data();
+	end = body.data() + body.size();
+	nextBlock = n + 1;
+	// each block describes its devices again
+	for(auto& d : devices)
+		d.isDescribed = false;
+	return 0;
+}
+
+int TrillArchiveReader::read(TrillStreamPacket& packet)
+{
+	if(!file)
+		return -1;
+	if(hasPending)
+	{
+		packet = pending;
+		hasPending = false;
+		return 1;
+	}
+	while(1)
+	{
+		if(pos == end)
+		{
+			if(nextBlock >= index.size())
+				return 0;
+			if(loadBlock(nextBlock))
+				return -1;
+			continue;
+		}
+		uint8_t record = *pos++;
+		uint64_t n;
+		if(!getVarint(pos, end, n))
+			return -1;
+		if(kRecordDevice == record)
+		{
+			if(n >= kMaxDevices)
+				return -1;
+			if(n >= devices.size())
+				devices.resize(n + 1);
+			Device& d = devices[n];
+			uint64_t payloadSize;
+			if(end - pos < 8)
+				return -1;
+			TrillStreamPacket& p = d.packet;
+			p.device = pos[0];
+			p.mode = pos[1];
+			p.width = pos[2];
+			p.numChannels = pos[3];
+			uint32_t scaleBits = get(pos + 4, 4);
+			memcpy(&p.scale, &scaleBits, sizeof(p.scale));
+			pos += 8;
+			if(!getVarint(pos, end, payloadSize) || pos == end || payloadSize > TrillStreamPacket::kMaxSize)
+				return -1;
+			p.payloadSize = payloadSize;
+			size_t idLength = *pos++;
+			if(size_t(end - pos) < idLength)
+				return -1;
+			d.id.assign((const char*)pos, idLength);
+			pos += idLength;
+			p.idLength = idLength;
+			p.timestamp = 0;
+			p.frameId = 0;
+			d.payload.resize(payloadSize);
+			d.lastRecord = kRecordDevice;
+			d.isDescribed = true;
+			continue;
+		}
+		if(kRecordChannels != record && kRecordWords != record)
+			return -1;
+		if(n >= devices.size() || !devices[n].isDescribed)
+			return -1;
+		Device& d = devices[n];
+		TrillStreamPacket& p = d.packet;
+		// the writer only codes channels that pack back to the payload
+		if(kRecordChannels == record && getChannelsSize(p.numChannels, p.width) != p.payloadSize)
+			return -1;
+		unsigned int numSlots = kRecordChannels == record ? p.numChannels : (p.payloadSize + 1) / 2;
+		if(record != d.lastRecord)
+			d.last.assign(numSlots, 0);
+		uint64_t value;
+		if(!getVarint(pos, end, value))
+			return -1;
+		p.timestamp += unzigzag(value);
+		if(!getVarint(pos, end, value))
+			return -1;
+		p.frameId += unzigzag(value);
+		uint16_t* slots = d.last.data();
+		for(unsigned int s = 0; s < numSlots; ++s)
+		{
+			// the fast path of getVarint(), for the common case of
+			// small differences
+			if(pos < end && !(*pos & 0x80))
+				value = *pos++;
+			else if(!getVarint(pos, end, value))
+				return -1;
+			slots[s] += unzigzag(value);
+		}
+		if(kRecordChannels == record)
+			packChannels(slots, numSlots, p.width, d.payload.data());
+		else
+			packWords(slots, p.payloadSize, d.payload.data());
+		d.lastRecord = record;
+		packet = p;
+		packet.id = d.id.data();
+		packet.payload = d.payload.data();
+		return 1;
+	}
+}
+
+int TrillArchiveReader::seek(bool byTimestamp, uint64_t value)
+{
+	hasPending = false;
+	pos = end = nullptr;
+	// the first block that may contain the frame
+	size_t n;
+	for(n = 0; n < index.size(); ++n)
+	{
+		if(byTimestamp ? index[n].maxTimestamp >= value : index[n].maxFrameId >= value)
+			break;
+	}
+	nextBlock = n;
+	TrillStreamPacket packet;
+	int ret;
+	while((ret = read(packet)) > 0)
+	{
+		if(byTimestamp ? packet.timestamp >= value : packet.frameId >= value)
+		{
+			pending = packet;
+			hasPending = true;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int TrillArchiveReader::seekToTimestamp(uint64_t timestamp)
+{
+	return seek(true, timestamp);
+}
+
+int TrillArchiveReader::seekToFrameId(uint32_t frameId)
+{
+	return seek(false, frameId);
+}
@@ -0,0 +1,226 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "TrillStream.h"
+
+/**
+ * \brief A compressed file format for long recordings of Trill frames.
+ *
+ * Frames are stored as TrillStreamPacket, so the frames of any number of
+ * devices, in any mode, can be interleaved in one file, and they decode
+ * to exactly the payload the device transmitted.
+ *
+ * Consecutive frames of a device differ little from each other, so each
+ * channel is stored as the difference from its value in the previous
+ * frame of the same device, as a zigzag varint: channels that didn't
+ * change take one byte, whatever the transmission width. Timestamps and
+ * frame IDs are stored the same way. In #TrillStreamPacket::kModeCentroid,
+ * the payload is coded as 16-bit words, i.e.: the locations and sizes
+ * of the touches.
+ *
+ * Frames are grouped in blocks of up to one second (see
+ * TrillArchiveWriter::setBlockDuration()), which can be decoded on their
+ * own. When the file is closed, an index of the blocks by timestamp and
+ * frame ID is appended, so that a reader can seek to any point in a
+ * long recording by decoding at most one block. If the writer didn't
+ * close the file, e.g.: because it crashed, the reader rebuilds the
+ * index from the blocks that were written completely.
+ *
+ * All multi-byte fields are little endian. The file is made of:
+ *
+ * - a header: 'T' 'R' 'L' 'A', the version and 3 reserved bytes
+ * - the blocks, each made of a 36-byte header: 'T' 'B', 2 reserved
+ *   bytes, the size of the body (4), the number of frames (4), the
+ *   lowest and highest timestamp (8 + 8), the lowest and highest frame
+ *   ID (4 + 4), followed by the body, i.e.: a sequence of records.
+ *   Each record starts with its type, followed by the varint index of
+ *   the device it refers to:
+ *   - TrillArchive::kRecordDevice: the description of a device, which precedes its
+ *     first frame in each block: type, mode, transmission width,
+ *     number of channels (1 each), scale (4), payload size (varint),
+ *     ID length (1) and the ID.
+ *   - TrillArchive::kRecordChannels or TrillArchive::kRecordWords: a frame, with the
+ *     differences of its timestamp, frame ID and channels (or words)
+ *     from the previous frame of the same device in the block, or from
+ *     0 for the first one.
+ * - the index: 'T' 'I', 2 reserved bytes, the number of blocks (4) and,
+ *   for each block, its offset in the file (8), number of frames (4),
+ *   lowest and highest timestamp (8 + 8) and lowest and highest frame ID
+ *   (4 + 4)
+ * - the offset of the index (8), followed by 'T' 'R' 'L' 'A' 'I' 'D'
+ *   'X' '\0'
+ */
+namespace TrillArchive {
+	enum {
+		kVersion = 1,
+		kFileHeaderSize = 8,
+		kBlockHeaderSize = 36,
+		kIndexEntrySize = 40,
+		kTrailerSize = 16,
+		kMaxDevices = 1024, ///< distinct combinations of ID and settings in a file
+	};
+	enum {
+		kRecordDevice = 0,
+		kRecordChannels = 1,
+		kRecordWords = 2,
+	};
+	struct IndexEntry {
+		uint64_t offset;
+		uint32_t numFrames;
+		uint64_t minTimestamp;
+		uint64_t maxTimestamp;
+		uint32_t minFrameId;
+		uint32_t maxFrameId;
+	};
+}
+
+/**
+ * \brief Write frames to a TrillArchive file.
+ */
+class TrillArchiveWriter
+{
+public:
+	TrillArchiveWriter() {};
+	~TrillArchiveWriter();
+	TrillArchiveWriter(const TrillArchiveWriter&) = delete;
+	TrillArchiveWriter& operator=(const TrillArchiveWriter&) = delete;
+	/**
+	 * Create a file, overwriting it if it exists.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int open(const std::string& path);
+	/**
+	 * Write the last block and the index, then close the file.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int close();
+	/**
+	 * Set the longest time spanned by a block, in seconds, which is
+	 * the most that a reader has to decode after a seek.
+	 */
+	void setBlockDuration(double seconds) { blockDuration = seconds * 1000000000; }
+	/**
+	 * Add a frame. Frames are written to the file whenever a block is
+	 * complete.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int add(const TrillStreamPacket& packet);
+	/**
+	 * Write the current block to the file, even if it isn't complete.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int flush();
+	/**
+	 * Get the number of bytes written so far.
+	 */
+	uint64_t getSize() const { return offset; }
+private:
+	struct Device {
+		std::string id;
+		int8_t mode;
+		int8_t type;
+		uint8_t width;
+		uint8_t numChannels;
+		float scale;
+		uint16_t payloadSize;
+		// the state of the current block
+		bool isDescribed;
+		uint8_t lastRecord;
+		uint64_t lastTimestamp;
+		uint32_t lastFrameId;
+		std::vector<uint16_t> last;
+	};
+	unsigned int getDevice(const TrillStreamPacket& packet);
+	int write(const void* data, size_t size);
+	FILE* file = nullptr;
+	uint64_t offset = 0;
+	uint64_t blockDuration = 1000000000;
+	std::vector<Device> devices;
+	std::vector<uint8_t> body;
+	std::vector<uint16_t> slots;
+	TrillArchive::IndexEntry block;
+	std::vector<TrillArchive::IndexEntry> index;
+};
+
+/**
+ * \brief Read frames from a TrillArchive file.
+ *
+ * Frames can be replayed through a Trill object set up with
+ * Trill::setupOffline(), e.g.:
+ *
+ *     TrillStreamPacket packet;
+ *     while(reader.read(packet) > 0)
+ *         trill.newData(packet.payload, packet.payloadSize, false, packet.timestamp);
+ */
+class TrillArchiveReader
+{
+public:
+	TrillArchiveReader() {};
+	~TrillArchiveReader();
+	TrillArchiveReader(const TrillArchiveReader&) = delete;
+	TrillArchiveReader& operator=(const TrillArchiveReader&) = delete;
+	/**
+	 * Open a file and load its index, or rebuild it if the file wasn't
+	 * closed properly.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int open(const std::string& path);
+	void close();
+	/**
+	 * Read the next frame. The ID and the payload of @p packet point
+	 * into memory owned by the reader, which remains valid until the
+	 * next call to read() or seek().
+	 *
+	 * @return 1 if a frame was read, 0 at the end of the file or -1 on
+	 * error.
+	 */
+	int read(TrillStreamPacket& packet);
+	/**
+	 * Position the reader on the first frame whose timestamp is at
+	 * or after @p timestamp.
+	 *
+	 * @return 0 on success, or 1 if there is no such frame.
+	 */
+	int seekToTimestamp(uint64_t timestamp);
+	/**
+	 * Position the reader on the first frame whose frame ID is at or
+	 * after @p frameId. Frame IDs are only meaningful within a device,
+	 * so this is mostly useful for recordings of one device.
+	 *
+	 * @return 0 on success, or 1 if there is no such frame.
+	 */
+	int seekToFrameId(uint32_t frameId);
+	/**
+	 * Get the index of the blocks in the file.
+	 */
+	const std::vector<TrillArchive::IndexEntry>& getIndex() const { return index; }
+private:
+	struct Device {
+		TrillStreamPacket packet; // the description and the last frame
+		std::string id;
+		std::vector<uint8_t> payload;
+		std::vector<uint16_t> last;
+		uint8_t lastRecord;
+		bool isDescribed;
+	};
+	int loadBlock(size_t n);
+	int buildIndex(uint64_t end);
+	int seek(bool byTimestamp, uint64_t value);
+	FILE* file = nullptr;
+	uint64_t fileSize = 0;
+	std::vector<TrillArchive::IndexEntry> index;
+	std::vector<uint8_t> body;
+	const uint8_t* pos = nullptr;
+	const uint8_t* end = nullptr;
+	size_t nextBlock = 0;
+	std::vector<Device> devices;
+	TrillStreamPacket pending;
+	bool hasPending = false;
+};
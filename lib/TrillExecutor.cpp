@@ -0,0 +1,169 @@
+#include "TrillExecutor.h"
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static thread_local TrillExecutor* gCurrent = nullptr;
+static constexpr unsigned int kWheelSlots = 512;
+
+TrillExecutor::TrillExecutor(unsigned int tickUs, size_t stackSize) :
+	wheel(kWheelSlots, nullptr),
+	start(FrameClock::now()),
+	tickNs(tickUs ? tickUs * 1000ull : 1000),
+	stackSize(stackSize)
+{}
+
+TrillExecutor::~TrillExecutor()
+{}
+
+TrillExecutor* TrillExecutor::getCurrent()
+{
+	return gCurrent;
+}
+
+void TrillExecutor::spawn(const Task& task)
+{
+	Fiber* f;
+	if(unused.size())
+	{
+		// reuse the stack of a task that completed
+		f = unused.back();
+		unused.pop_back();
+	} else {
+		fibers.emplace_back(new Fiber);
+		f = fibers.back().get();
+		f->stack.reset(new char[stackSize]);
+	}
+	f->task = task;
+	f->done = false;
+	f->next = nullptr;
+	getcontext(&f->context);
+	f->context.uc_stack.ss_sp = f->stack.get();
+	f->context.uc_stack.ss_size = stackSize;
+	f->context.uc_link = &scheduler;
+	// makecontext() only passes int arguments
+	uintptr_t ptr = (uintptr_t)this;
+	makecontext(&f->context, (void(*)())trampoline, 2, (unsigned int)ptr, (unsigned int)((uint64_t)ptr >> 32));
+	ready.push_back(f);
+	++numTasks;
+}
+
+void TrillExecutor::trampoline(unsigned int lo, unsigned int hi)
+{
+	TrillExecutor* that = (TrillExecutor*)(uintptr_t)(lo | ((uint64_t)hi << 32));
+	Fiber* f = that->current;
+	try {
+		f->task();
+	} catch (...) {
+		fprintf(stderr, "TrillExecutor: a task threw an exception\n");
+	}
+	f->done = true;
+	// returning resumes uc_link, i.e.: the scheduler
+}
+
+int TrillExecutor::sleep(unsigned int us)
+{
+	TrillExecutor* that = gCurrent;
+	if(that && that->current)
+		that->suspend(us);
+	else if(us)
+		usleep(us);
+	return 0;
+}
+
+void TrillExecutor::suspend(unsigned int us)
+{
+	Fiber* f = current;
+	if(us) {
+		// round up, so that we sleep at least as long as requested
+		f->wakeTick = getTick(FrameClock::now() + us * 1000ull) + 1;
+		Fiber*& slot = wheel[f->wakeTick % wheel.size()];
+		f->next = slot;
+		slot = f;
+		++numSleeping;
+	} else {
+		ready.push_back(f);
+	}
+	swapcontext(&f->context, &scheduler);
+}
+
+uint64_t TrillExecutor::getTick(FrameClock::Timestamp time) const
+{
+	return (time - start) / tickNs;
+}
+
+// move the fibers whose time has come from the wheel to the ready list
+void TrillExecutor::advance(uint64_t tick)
+{
+	if(tick <= lastTick)
+		return;
+	uint64_t numSlots = std::min(tick - lastTick, uint64_t(wheel.size()));
+	for(uint64_t n = 1; n <= numSlots; ++n)
+	{
+		Fiber** prev = &wheel[(lastTick + n) % wheel.size()];
+		while(Fiber* f = *prev)
+		{
+			if(f->wakeTick <= tick)
+			{
+				*prev = f->next;
+				ready.push_back(f);
+				--numSleeping;
+			} else
+				prev = &f->next;
+		}
+	}
+	lastTick = tick;
+}
+
+FrameClock::Timestamp TrillExecutor::getNextWakeup()
+{
+	advance(getTick(FrameClock::now()));
+	if(ready.size() || !numSleeping)
+		return 0;
+	uint64_t first = UINT64_MAX;
+	for(Fiber* slot : wheel)
+		for(Fiber* f = slot; f; f = f->next)
+			first = std::min(first, f->wakeTick);
+	return start + first * tickNs;
+}
+
+unsigned int TrillExecutor::runOnce(bool block)
+{
+	FrameClock::Timestamp wakeup = getNextWakeup();
+	if(block && wakeup)
+	{
+		struct timespec ts;
+		ts.tv_sec = wakeup / 1000000000;
+		ts.tv_nsec = wakeup % 1000000000;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr))
+			;
+		advance(getTick(FrameClock::now()));
+	}
+	// tasks that become ready while these run wait for the next call
+	running.swap(ready);
+	TrillExecutor* previous = gCurrent;
+	gCurrent = this;
+	for(Fiber* f : running)
+	{
+		current = f;
+		swapcontext(&scheduler, &f->context);
+		current = nullptr;
+		if(f->done)
+		{
+			f->task = Task();
+			unused.push_back(f);
+			--numTasks;
+		}
+	}
+	gCurrent = previous;
+	unsigned int count = running.size();
+	running.clear();
+	return count;
+}
+
+void TrillExecutor::run()
+{
+	while(numTasks)
+		runOnce(true);
+}
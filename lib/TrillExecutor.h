@@ -0,0 +1,122 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <ucontext.h>
+#include "FrameClock.h"
+
+/**
+ * \brief Run many Trill sequences concurrently on a single thread.
+ *
+ * Most Trill methods that talk to the device wait for it: each command
+ * waits for an ack with an exponential backoff, reset() waits for the
+ * device to restart and setup() chains over a dozen of these. Called
+ * from a task of a TrillExecutor, those waits suspend the task instead
+ * of sleeping, and the executor resumes another task in the meantime.
+ * This way, a single thread can set up and service dozens of devices
+ * concurrently, using the same blocking API:
+ *
+ *     TrillExecutor executor;
+ *     std::vector<Trill> touchSensors(addresses.size());
+ *     for(unsigned int n = 0; n < addresses.size(); ++n)
+ *         executor.spawn([&touchSensors, &addresses, n]() {
+ *             touchSensors[n].setup(1, Trill::ANY, addresses[n]);
+ *         });
+ *     executor.run(); // returns when all devices are set up
+ *
+ * Tasks are cooperative user-space threads with their own stack, which
+ * switch only when they call sleep(), directly or through a Trill
+ * method. The I2C transfers themselves still block the thread, but
+ * they are much shorter than the waits between them.
+ *
+ * Sleeping tasks are kept in a timer wheel with a resolution of one
+ * tick, so the cost of scheduling doesn't grow with the number of
+ * tasks.
+ *
+ * An executor and its tasks must all be used from the same thread.
+ * Destroying an executor abandons the tasks that haven't completed.
+ */
+class TrillExecutor
+{
+public:
+	typedef std::function<void()> Task;
+	/**
+	 * @param tickUs the resolution of the timer wheel, in
+	 * microseconds. Sleeps are rounded up to a multiple of this.
+	 * @param stackSize the size of the stack of each task, in bytes.
+	 */
+	TrillExecutor(unsigned int tickUs = 250, size_t stackSize = 65536);
+	~TrillExecutor();
+	TrillExecutor(const TrillExecutor&) = delete;
+	TrillExecutor& operator=(const TrillExecutor&) = delete;
+	/**
+	 * Add a task, which will start running the next time the
+	 * executor runs. This can also be called from within a task.
+	 * Tasks should not throw.
+	 */
+	void spawn(const Task& task);
+	/**
+	 * Run the tasks until all of them have completed.
+	 */
+	void run();
+	/**
+	 * Run the tasks that are ready, once each.
+	 *
+	 * @param block if no task is ready, wait for the first one that
+	 * becomes ready.
+	 *
+	 * @return the number of tasks that were resumed.
+	 */
+	unsigned int runOnce(bool block = false);
+	/**
+	 * Get the number of tasks that have not completed yet.
+	 */
+	unsigned int getNumTasks() const { return numTasks; }
+	/**
+	 * Get the time at which the next task becomes ready, e.g.: to
+	 * wait for it alongside other events. This is 0 if a task is
+	 * ready already, or if there are no tasks.
+	 */
+	FrameClock::Timestamp getNextWakeup();
+	/**
+	 * Wait for at least @p us microseconds. If called from a task,
+	 * this suspends the task, otherwise it sleeps. A task can call
+	 * sleep(0) to let the other tasks run.
+	 *
+	 * @return 0
+	 */
+	static int sleep(unsigned int us);
+	/**
+	 * Get the executor running the calling task, or `nullptr` if
+	 * not called from a task.
+	 */
+	static TrillExecutor* getCurrent();
+private:
+	struct Fiber {
+		ucontext_t context;
+		std::unique_ptr<char[]> stack;
+		Task task;
+		uint64_t wakeTick;
+		Fiber* next;
+		bool done;
+	};
+	static void trampoline(unsigned int lo, unsigned int hi);
+	void suspend(unsigned int us);
+	void advance(uint64_t tick);
+	uint64_t getTick(FrameClock::Timestamp time) const;
+	std::vector<std::unique_ptr<Fiber>> fibers;
+	std::vector<Fiber*> unused;
+	std::vector<Fiber*> ready;
+	std::vector<Fiber*> running;
+	std::vector<Fiber*> wheel; // a list of sleeping fibers in each slot
+	ucontext_t scheduler;
+	Fiber* current = nullptr;
+	FrameClock::Timestamp start;
+	uint64_t lastTick = 0;
+	uint64_t tickNs;
+	size_t stackSize;
+	unsigned int numTasks = 0;
+	unsigned int numSleeping = 0;
+};
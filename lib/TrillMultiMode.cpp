@@ -0,0 +1,115 @@
+#include "TrillMultiMode.h"
+#include <algorithm>
+#include <stdio.h>
+
+TrillMultiMode::TrillMultiMode(Trill& trill, const std::vector<Step>& pattern)
+{
+	setup(trill, pattern);
+}
+
+int TrillMultiMode::setup(Trill& trill, const std::vector<Step>& pattern)
+{
+	this->trill = nullptr;
+	for(auto& s : pattern)
+	{
+		if(Trill::RAW != s.mode && Trill::BASELINE != s.mode && Trill::DIFF != s.mode)
+		{
+			fprintf(stderr, "TrillMultiMode: only RAW, BASELINE and DIFF can be used\n");
+			return 1;
+		}
+	}
+	if(pattern.empty())
+		return 1;
+	if(trill.firmwareVersion() < 3)
+	{
+		fprintf(stderr, "TrillMultiMode: requires firmware version 3 or above\n");
+		return 1;
+	}
+	this->trill = &trill;
+	this->pattern = pattern;
+	for(auto& s : streams)
+	{
+		s.values.assign(trill.getNumChannels(), 0);
+		s.timestamp = 0;
+		s.frameId = 0;
+		s.count = 0;
+	}
+	step = 0;
+	framesInStep = 0;
+	shouldSwitch = true;
+	isFirstAfterSwitch = false;
+	hasFrame = false;
+	numDropped = 0;
+	numSwitches = 0;
+	return 0;
+}
+
+unsigned int TrillMultiMode::getStreamIndex(Trill::Mode mode)
+{
+	switch(mode)
+	{
+	case Trill::RAW:
+		return 0;
+	case Trill::BASELINE:
+		return 1;
+	default:
+	case Trill::DIFF:
+		return 2;
+	}
+}
+
+int TrillMultiMode::read()
+{
+	if(!trill)
+		return 1;
+	Trill& t = *trill;
+	Trill::Mode mode = pattern[step].mode;
+	if(shouldSwitch)
+	{
+		if(mode != t.getMode() || !numSwitches)
+		{
+			int ret = t.requestMode(mode);
+			if(ret)
+				return ret;
+			++numSwitches;
+			isFirstAfterSwitch = true;
+		}
+		shouldSwitch = false;
+	}
+	int ret = t.readI2C(true);
+	if(ret)
+		return ret;
+	uint32_t frameId = t.getFrameIdUnwrapped();
+	bool isNew = !hasFrame || frameId != lastFrameId;
+	lastFrameId = frameId;
+	hasFrame = true;
+	if(isFirstAfterSwitch)
+	{
+		// this frame may have been scanned before the command
+		// arrived, and the next one while it was being processed
+		// (the device may only process it between scans)
+		switchFrameId = frameId + 1;
+		isFirstAfterSwitch = false;
+	}
+	// compared as a difference, so that it survives wrapping
+	if(!isNew || int32_t(frameId - switchFrameId) <= 0)
+	{
+		++numDropped;
+		return 0;
+	}
+	Stream& s = streams[getStreamIndex(mode)];
+	unsigned int numChannels = std::min(s.values.size(), t.rawData.size());
+	std::copy(t.rawData.begin(), t.rawData.begin() + numChannels, s.values.begin());
+	s.timestamp = t.getFrameTimestamp();
+	s.frameId = frameId;
+	++s.count;
+	if(++framesInStep >= pattern[step].frames)
+	{
+		framesInStep = 0;
+		step = (step + 1) % pattern.size();
+		shouldSwitch = true;
+	}
+	if(callback)
+		callback(mode, s);
+	return 0;
+}
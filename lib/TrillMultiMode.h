@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "FrameClock.h"
+#include "Trill.h"
+
+/**
+ * \brief Stream the RAW, BASELINE and DIFF data of a device at once.
+ *
+ * A device only reports one of Trill::RAW, Trill::BASELINE and
+ * Trill::DIFF at a time. This class cycles the mode of the device
+ * through a pattern of steps, each reading a number of frames in one
+ * mode, and demultiplexes the frames into one stream per mode. Each
+ * stream then runs at a fraction of the frame rate, e.g.: the default
+ * pattern of one frame per mode gives each of them a third of it.
+ *
+ * To keep the cost of each switch low, the mode is changed with
+ * Trill::requestMode(), which doesn't wait for the device to acknowledge
+ * it, and no command is sent between steps in the same mode. The frames
+ * that may have been scanned before the device switched are dropped,
+ * based on their frame ID, so the device must have firmware version 3
+ * or above. These are the first frame read after the switch and the
+ * one after it, which may have been scanned while the command was
+ * being processed, so each switch costs two frames.
+ *
+ * The device should not be in Trill::CENTROID mode, and nothing else
+ * should change its mode while it's in use.
+ */
+class TrillMultiMode
+{
+public:
+	struct Step {
+		Trill::Mode mode; ///< Trill::RAW, Trill::BASELINE or Trill::DIFF
+		unsigned int frames; ///< how many frames to read in this mode
+	};
+	/**
+	 * The last frame received in one of the modes.
+	 */
+	struct Stream {
+		std::vector<float> values; ///< one value per channel
+		FrameClock::Timestamp timestamp; ///< as Trill::getFrameTimestamp()
+		uint32_t frameId; ///< as Trill::getFrameIdUnwrapped()
+		unsigned int count; ///< the number of frames received so far
+	};
+	/**
+	 * Called for each frame that is kept, after its stream has been
+	 * updated.
+	 */
+	typedef std::function<void(Trill::Mode mode, const Stream& stream)> Callback;
+	TrillMultiMode() {};
+	/**
+	 * @param trill the device, which must outlive this object.
+	 * @param pattern the steps to cycle through.
+	 */
+	TrillMultiMode(Trill& trill, const std::vector<Step>& pattern = {{Trill::RAW, 1}, {Trill::BASELINE, 1}, {Trill::DIFF, 1}});
+	/**
+	 * \copydoc TrillMultiMode::TrillMultiMode(Trill&, const std::vector<Step>&)
+	 */
+	int setup(Trill& trill, const std::vector<Step>& pattern = {{Trill::RAW, 1}, {Trill::BASELINE, 1}, {Trill::DIFF, 1}});
+	/**
+	 * Set the function to call for each frame that is kept.
+	 */
+	void setCallback(const Callback& callback) { this->callback = callback; }
+	/**
+	 * Switch the mode if the current step is complete, then read a
+	 * frame. Call this at least as often as the device scans, so
+	 * that no frame is missed.
+	 *
+	 * @return 0 if a frame was read, whether it was kept or not, or
+	 * an error code otherwise.
+	 */
+	int read();
+	/**
+	 * Get the stream of a mode.
+	 */
+	const Stream& getStream(Trill::Mode mode) const { return streams[getStreamIndex(mode)]; }
+	/**
+	 * Get the number of frames dropped because they may have been
+	 * scanned before a switch, or were read again before the device
+	 * scanned a new one.
+	 */
+	unsigned int getNumDropped() const { return numDropped; }
+	/**
+	 * Get the number of times the mode was switched.
+	 */
+	unsigned int getNumSwitches() const { return numSwitches; }
+private:
+	static unsigned int getStreamIndex(Trill::Mode mode);
+	Trill* trill = nullptr;
+	std::vector<Step> pattern;
+	Stream streams[3];
+	Callback callback;
+	unsigned int step = 0;
+	unsigned int framesInStep = 0;
+	uint32_t lastFrameId = 0;
+	uint32_t switchFrameId = 0; // the last frame that may predate the switch
+	bool shouldSwitch = true;
+	bool isFirstAfterSwitch = false;
+	bool hasFrame = false;
+	unsigned int numDropped = 0;
+	unsigned int numSwitches = 0;
+};
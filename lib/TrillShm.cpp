@@ -0,0 +1,137 @@
+#include "TrillShm.h"
+#include "Trill.h"
+#include <algorithm>
+#include <new>
+
+TrillShmPublisher::TrillShmPublisher(const std::string& name, unsigned int numSlots)
+{
+	setup(name, numSlots);
+}
+
+TrillShmPublisher::~TrillShmPublisher()
+{
+	cleanup();
+}
+
+// mark an existing object as closed, so that its readers notice that
+// it is being replaced, even if its publisher didn't exit cleanly
+static void markClosed(const std::string& name)
+{
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if(fd < 0)
+		return;
+	struct stat st;
+	void* ptr = MAP_FAILED;
+	if(!fstat(fd, &st) && size_t(st.st_size) >= sizeof(TrillShmHeader))
+		ptr = mmap(nullptr, sizeof(TrillShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == ptr)
+		return;
+	TrillShmHeader* stale = (TrillShmHeader*)ptr;
+	if(TrillShmHeader::kMagic == stale->magic.load(std::memory_order_acquire)
+		&& TrillShmHeader::kVersion == stale->version)
+		stale->closed.store(1, std::memory_order_release);
+	munmap(ptr, sizeof(TrillShmHeader));
+}
+
+void TrillShmPublisher::cleanup()
+{
+	if(header)
+	{
+		header->closed.store(1, std::memory_order_release);
+		munmap(header, size);
+		shm_unlink(name.c_str());
+	}
+	header = nullptr;
+}
+
+int TrillShmPublisher::setup(const std::string& name, unsigned int numSlots)
+{
+	cleanup();
+	if(!numSlots)
+		return 1;
+	this->name = name;
+	// start afresh: readers of a stale object keep it mapped, and
+	// can tell from TrillShmReader::isClosed() that it was replaced
+	markClosed(name);
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0)
+	{
+		fprintf(stderr, "TrillShmPublisher: unable to create %s: %s\n", name.c_str(), strerror(errno));
+		return 1;
+	}
+	size = sizeof(TrillShmHeader) + numSlots * sizeof(TrillShmSlot);
+	if(ftruncate(fd, size))
+	{
+		fprintf(stderr, "TrillShmPublisher: unable to resize %s: %s\n", name.c_str(), strerror(errno));
+		close(fd);
+		shm_unlink(name.c_str());
+		return 1;
+	}
+	void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == ptr)
+	{
+		fprintf(stderr, "TrillShmPublisher: unable to map %s: %s\n", name.c_str(), strerror(errno));
+		shm_unlink(name.c_str());
+		return 1;
+	}
+	// the object is zero-filled, so all sequence counters start even
+	header = new (ptr) TrillShmHeader;
+	header->numSlots = numSlots;
+	header->slotSize = sizeof(TrillShmSlot);
+	header->version = TrillShmHeader::kVersion;
+	header->writeCount.store(0);
+	header->closed.store(0);
+	// store the magic last: readers check it first, and only then
+	// look at the rest of the header
+	header->magic.store(TrillShmHeader::kMagic, std::memory_order_release);
+	return 0;
+}
+
+int TrillShmPublisher::publish(const TrillShmFrame& frame)
+{
+	if(!header)
+		return 1;
+	uint64_t count = header->writeCount.load(std::memory_order_relaxed);
+	TrillShmSlot& slot = header->getSlots()[count % header->numSlots];
+	uint32_t seq = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy((void*)&slot.frame, &frame, sizeof(frame));
+	slot.frame.count = count;
+	slot.sequence.store(seq + 2, std::memory_order_release);
+	header->writeCount.store(count + 1, std::memory_order_release);
+	return 0;
+}
+
+int TrillShmPublisher::publish(Trill& trill)
+{
+	frame.timestamp = trill.getFrameTimestamp();
+	frame.frameId = trill.getFrameIdUnwrapped();
+	frame.mode = trill.getMode();
+	frame.device = trill.deviceType();
+	if(Trill::CENTROID == trill.getMode())
+	{
+		frame.numTouches = std::min(trill.getNumTouches(), (unsigned int)TrillShmFrame::kMaxTouches);
+		frame.numHorizontalTouches = std::min(trill.getNumHorizontalTouches(), (unsigned int)TrillShmFrame::kMaxTouches);
+		for(unsigned int n = 0; n < frame.numTouches; ++n)
+		{
+			frame.touchLocations[n] = trill.touchLocation(n);
+			frame.touchSizes[n] = trill.touchSize(n);
+		}
+		for(unsigned int n = 0; n < frame.numHorizontalTouches; ++n)
+		{
+			frame.touchHorizontalLocations[n] = trill.touchHorizontalLocation(n);
+			frame.touchHorizontalSizes[n] = trill.touchHorizontalSize(n);
+		}
+		frame.numChannels = 0;
+	} else {
+		frame.numTouches = 0;
+		frame.numHorizontalTouches = 0;
+		frame.numChannels = std::min(trill.getNumChannels(), (unsigned int)TrillShmFrame::kMaxChannels);
+		std::copy(trill.rawData.begin(), trill.rawData.begin() + frame.numChannels, frame.rawData);
+	}
+	return publish(frame);
+}
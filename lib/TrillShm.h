@@ -0,0 +1,262 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \brief Shared-memory publishing of Trill frames to other processes.
+ *
+ * A TrillShmPublisher writes frames into a ring of slots in a POSIX
+ * shared memory object. Any number of TrillShmReader objects in other
+ * processes can map the same object and read the latest frame or every
+ * frame, without any system call and without ever blocking the
+ * publisher.
+ *
+ * Each slot is protected by a sequence counter (seqlock): the publisher
+ * makes the counter odd before writing the slot and even again after;
+ * readers copy the slot and retry if the counter was odd or changed in
+ * the meantime.
+ *
+ * The reader is header-only, so that it can be used without linking
+ * against the rest of the library.
+ */
+
+struct TrillShmFrame {
+	enum {
+		kMaxTouches = 5,
+		kMaxChannels = 32,
+	};
+	uint64_t count; ///< The index of this frame since the publisher started
+	uint64_t timestamp; ///< CLOCK_MONOTONIC time of the frame, in nanoseconds
+	uint32_t frameId; ///< The unwrapped frame ID
+	int8_t mode; ///< The Trill::Mode of the device
+	int8_t device; ///< The Trill::Device type
+	uint8_t numTouches; ///< The number of (vertical) touches
+	uint8_t numHorizontalTouches; ///< The number of horizontal touches
+	uint8_t numChannels; ///< The number of valid elements in rawData
+	float touchLocations[kMaxTouches];
+	float touchSizes[kMaxTouches];
+	float touchHorizontalLocations[kMaxTouches];
+	float touchHorizontalSizes[kMaxTouches];
+	float rawData[kMaxChannels];
+};
+
+struct TrillShmSlot {
+	std::atomic<uint32_t> sequence;
+	TrillShmFrame frame;
+};
+
+struct TrillShmHeader {
+	enum {
+		kMagic = 0x5452534d, // "TRSM"
+		kVersion = 2,
+	};
+	std::atomic<uint32_t> magic; ///< Stored last by the publisher, once the rest of the header is valid
+	uint32_t version;
+	uint32_t numSlots;
+	uint32_t slotSize;
+	std::atomic<uint32_t> closed; ///< Set once the publisher stops publishing to this object
+	std::atomic<uint64_t> writeCount; ///< The number of frames published so far
+	// the slots follow immediately after the header
+	TrillShmSlot* getSlots() { return (TrillShmSlot*)(this + 1); }
+	const TrillShmSlot* getSlots() const { return (const TrillShmSlot*)(this + 1); }
+};
+
+class Trill;
+
+class TrillShmPublisher
+{
+public:
+	TrillShmPublisher() {};
+	/**
+	 * @param name the name of the shared memory object, e.g.:
+	 * `/trill-bar`. An existing object with the same name is replaced.
+	 * @param numSlots the number of frames kept in the ring. Readers
+	 * that want every frame have to keep up within this many frames.
+	 */
+	TrillShmPublisher(const std::string& name, unsigned int numSlots = 64);
+	~TrillShmPublisher();
+	TrillShmPublisher(const TrillShmPublisher&) = delete;
+	TrillShmPublisher& operator=(const TrillShmPublisher&) = delete;
+	/**
+	 * \copydoc TrillShmPublisher::TrillShmPublisher(const std::string&, unsigned int)
+	 *
+	 * @return 0 on success, or an error code otherwise.
+	 */
+	int setup(const std::string& name, unsigned int numSlots = 64);
+	/**
+	 * Publish a frame. The `count` field is filled in automatically.
+	 */
+	int publish(const TrillShmFrame& frame);
+	/**
+	 * Publish the current frame of a Trill device.
+	 */
+	int publish(Trill& trill);
+private:
+	void cleanup();
+	std::string name;
+	TrillShmHeader* header = nullptr;
+	size_t size = 0;
+	TrillShmFrame frame;
+};
+
+class TrillShmReader
+{
+public:
+	enum {
+		kMaxRetries = 64, ///< How many times a read is retried while the publisher is writing the frame
+	};
+	TrillShmReader() {};
+	/**
+	 * @param name the name of the shared memory object, as passed to
+	 * TrillShmPublisher::setup().
+	 */
+	TrillShmReader(const std::string& name)
+	{
+		setup(name);
+	}
+	~TrillShmReader()
+	{
+		cleanup();
+	}
+	TrillShmReader(const TrillShmReader&) = delete;
+	TrillShmReader& operator=(const TrillShmReader&) = delete;
+	/**
+	 * \copydoc TrillShmReader::TrillShmReader(const std::string&)
+	 *
+	 * @return 0 on success, or an error code otherwise.
+	 */
+	int setup(const std::string& name)
+	{
+		cleanup();
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if(fd < 0)
+			return 1;
+		struct stat st;
+		if(fstat(fd, &st) || size_t(st.st_size) < sizeof(TrillShmHeader))
+		{
+			close(fd);
+			return 1;
+		}
+		size = st.st_size;
+		void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(MAP_FAILED == ptr)
+			return 1;
+		header = (const TrillShmHeader*)ptr;
+		if(TrillShmHeader::kMagic != header->magic.load(std::memory_order_acquire)
+			|| TrillShmHeader::kVersion != header->version
+			|| sizeof(TrillShmSlot) != header->slotSize
+			|| size < sizeof(TrillShmHeader) + header->numSlots * sizeof(TrillShmSlot))
+		{
+			cleanup();
+			return 2;
+		}
+		cursor = header->writeCount.load(std::memory_order_acquire);
+		dropped = 0;
+		return 0;
+	}
+	/**
+	 * Read the most recent frame.
+	 *
+	 * @return `true` if a frame was read, or `false` if nothing has
+	 * been published yet or if no consistent frame could be read
+	 * within #kMaxRetries attempts.
+	 */
+	bool readLatest(TrillShmFrame& frame)
+	{
+		if(!header)
+			return false;
+		for(unsigned int n = 0; n < kMaxRetries; ++n)
+		{
+			uint64_t count = header->writeCount.load(std::memory_order_acquire);
+			if(!count)
+				return false;
+			if(readSlot(count - 1, frame))
+				return true;
+		}
+		return false;
+	}
+	/**
+	 * Read the frame after the last one read with readNext(). The first
+	 * call returns the first frame published after setup().
+	 *
+	 * @return `true` if a frame was read, or `false` if there is no new
+	 * frame or if no consistent frame could be read within
+	 * #kMaxRetries attempts, in which case it can be retried later.
+	 * If the reader fell behind by more than the number of slots
+	 * in the ring, the oldest frames are skipped and counted in
+	 * getDropped().
+	 */
+	bool readNext(TrillShmFrame& frame)
+	{
+		if(!header)
+			return false;
+		for(unsigned int n = 0; n < kMaxRetries; ++n)
+		{
+			uint64_t count = header->writeCount.load(std::memory_order_acquire);
+			if(cursor >= count)
+				return false;
+			if(count - cursor > header->numSlots)
+			{
+				dropped += count - header->numSlots - cursor;
+				cursor = count - header->numSlots;
+			}
+			if(readSlot(cursor, frame))
+			{
+				++cursor;
+				return true;
+			}
+		}
+		return false;
+	}
+	/**
+	 * Whether the publisher has stopped publishing to the object, e.g.:
+	 * because it was destroyed or because a new publisher replaced the
+	 * object with one with the same name. No more frames will be
+	 * published to it, and setup() has to be called again to map the
+	 * new object, if any.
+	 */
+	bool isClosed() const
+	{
+		return !header || header->closed.load(std::memory_order_acquire);
+	}
+	/**
+	 * Get how many frames were skipped by readNext() so far.
+	 */
+	uint64_t getDropped() const { return dropped; }
+private:
+	// returns false if the slot has been reused for a newer frame, or
+	// if it was being written at each of kMaxRetries attempts (e.g.:
+	// because the publisher died while writing it)
+	bool readSlot(uint64_t count, TrillShmFrame& frame)
+	{
+		const TrillShmSlot& slot = header->getSlots()[count % header->numSlots];
+		for(unsigned int n = 0; n < kMaxRetries; ++n)
+		{
+			uint32_t seq = slot.sequence.load(std::memory_order_acquire);
+			if(seq & 1)
+				continue;
+			memcpy(&frame, (const void*)&slot.frame, sizeof(frame));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(seq == slot.sequence.load(std::memory_order_relaxed))
+				return frame.count == count;
+		}
+		return false;
+	}
+	void cleanup()
+	{
+		if(header)
+			munmap((void*)header, size);
+		header = nullptr;
+	}
+	const TrillShmHeader* header = nullptr;
+	size_t size = 0;
+	uint64_t cursor = 0;
+	uint64_t dropped = 0;
+};
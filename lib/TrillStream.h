@@ -0,0 +1,189 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * \brief A compact binary format to stream Trill frames.
+ *
+ * Each packet carries one frame of one device, with the payload exactly
+ * as transmitted by the device, i.e.: 1 to 2 bytes per channel instead
+ * of the 4 bytes of a float plus the type tag of an OSC message.
+ *
+ * A packet is made of a fixed-size header, the ID of the device and the
+ * payload. All multi-byte fields in the header are little endian:
+ *
+ * | offset | size | field
+ * |--------|------|------
+ * | 0      | 2    | magic: 'T' 'S'
+ * | 2      | 1    | version
+ * | 3      | 1    | reserved, 0
+ * | 4      | 2    | size of the whole packet, in bytes
+ * | 6      | 1    | mode (Trill::Mode)
+ * | 7      | 1    | device type (Trill::Device)
+ * | 8      | 1    | transmission width, in bits (8, 12 or 16)
+ * | 9      | 1    | number of channels
+ * | 10     | 1    | length of the device ID
+ * | 11     | 1    | reserved, 0
+ * | 12     | 4    | frame ID
+ * | 16     | 8    | timestamp (CLOCK_MONOTONIC of the sender, in nanoseconds)
+ * | 24     | 4    | scale: the factor that converts channel values to floats
+ * | 28     | -    | device ID, not null-terminated, followed by the payload
+ *
+ * As packets are self-delimiting, several of them can be sent in one
+ * datagram, or back to back on a stream socket.
+ *
+ * This header has no dependencies on the rest of the library, so that
+ * it can be used on its own to decode the stream on the receiving end.
+ */
+struct TrillStreamPacket
+{
+	enum {
+		kVersion = 1,
+		kHeaderSize = 28,
+		kMaxSize = 65535,
+		kModeCentroid = 0, ///< The value of Trill::CENTROID
+	};
+	uint64_t timestamp = 0;
+	uint32_t frameId = 0;
+	float scale = 1;
+	int8_t mode = 0;
+	int8_t device = 0;
+	uint8_t width = 16;
+	uint8_t numChannels = 0;
+	const char* id = nullptr; ///< Not null-terminated
+	uint8_t idLength = 0;
+	const uint8_t* payload = nullptr;
+	uint16_t payloadSize = 0;
+
+	size_t getSize() const
+	{
+		return kHeaderSize + idLength + payloadSize;
+	}
+	/**
+	 * Write the packet to @p dest.
+	 *
+	 * @return the number of bytes written, or 0 if the packet doesn't
+	 * fit in @p size bytes.
+	 */
+	size_t encode(uint8_t* dest, size_t size) const
+	{
+		size_t packetSize = getSize();
+		if(packetSize > size || packetSize > kMaxSize)
+			return 0;
+		uint32_t scaleBits;
+		memcpy(&scaleBits, &scale, sizeof(scaleBits));
+		dest[0] = 'T';
+		dest[1] = 'S';
+		dest[2] = kVersion;
+		dest[3] = 0;
+		put(dest + 4, packetSize, 2);
+		dest[6] = mode;
+		dest[7] = device;
+		dest[8] = width;
+		dest[9] = numChannels;
+		dest[10] = idLength;
+		dest[11] = 0;
+		put(dest + 12, frameId, 4);
+		put(dest + 16, timestamp, 8);
+		put(dest + 24, scaleBits, 4);
+		memcpy(dest + kHeaderSize, id, idLength);
+		memcpy(dest + kHeaderSize + idLength, payload, payloadSize);
+		return packetSize;
+	}
+	/**
+	 * Decode a packet from @p src. On success, #id and #payload point
+	 * into @p src.
+	 *
+	 * @return the number of bytes used, 0 if @p src doesn't contain a
+	 * whole packet yet, or -1 if @p src doesn't start with a valid
+	 * packet.
+	 */
+	long decode(const uint8_t* src, size_t size)
+	{
+		if(size < 6)
+			return 0;
+		if('T' != src[0] || 'S' != src[1] || kVersion != src[2])
+			return -1;
+		size_t packetSize = get(src + 4, 2);
+		if(packetSize < kHeaderSize)
+			return -1;
+		if(size < packetSize)
+			return 0;
+		if(packetSize < kHeaderSize + size_t(src[10]))
+			return -1;
+		mode = src[6];
+		device = src[7];
+		width = src[8];
+		numChannels = src[9];
+		idLength = src[10];
+		frameId = get(src + 12, 4);
+		timestamp = get(src + 16, 8);
+		uint32_t scaleBits = get(src + 24, 4);
+		memcpy(&scale, &scaleBits, sizeof(scale));
+		id = (const char*)src + kHeaderSize;
+		payload = src + kHeaderSize + idLength;
+		payloadSize = packetSize - kHeaderSize - idLength;
+		return packetSize;
+	}
+	/**
+	 * Unpack the channels in the payload, for all modes other than
+	 * #kModeCentroid, applying #scale. The values are the same as
+	 * those in Trill::rawData on the sender.
+	 *
+	 * @return the number of values written to @p values.
+	 */
+	unsigned int getChannels(float* values, unsigned int maxValues) const
+	{
+		if(kModeCentroid == mode)
+			return 0;
+		unsigned int n;
+		const uint8_t* p = payload;
+		const uint8_t* end = payload + payloadSize;
+		for(n = 0; n < numChannels && n < maxValues; ++n)
+		{
+			uint16_t val;
+			switch(width)
+			{
+			case 8:
+				if(p + 1 > end)
+					return n;
+				val = *p++;
+				break;
+			case 12:
+				if(p + 2 > end)
+					return n;
+				if(n & 1) {
+					val = ((*p++) & 0xf0) << 4;
+					val |= *p++;
+				} else {
+					val = *p++ << 4;
+					val |= (*p & 0xf);
+				}
+				break;
+			default:
+			case 16:
+				if(p + 2 > end)
+					return n;
+				val = (p[0] << 8) | p[1];
+				p += 2;
+				break;
+			}
+			values[n] = val * scale;
+		}
+		return n;
+	}
+private:
+	static void put(uint8_t* dest, uint64_t value, unsigned int bytes)
+	{
+		for(unsigned int n = 0; n < bytes; ++n)
+			dest[n] = value >> (8 * n);
+	}
+	static uint64_t get(const uint8_t* src, unsigned int bytes)
+	{
+		uint64_t value = 0;
+		for(unsigned int n = 0; n < bytes; ++n)
+			value |= uint64_t(src[n]) << (8 * n);
+		return value;
+	}
+};
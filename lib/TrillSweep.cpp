@@ -0,0 +1,79 @@
+#include "TrillSweep.h"
+#include "Trill.h"
+#include "TrillExecutor.h"
+#include <algorithm>
+
+void TrillSweep::add(Trill& t)
+{
+	if(std::find(devices.begin(), devices.end(), &t) == devices.end())
+		devices.push_back(&t);
+}
+
+void TrillSweep::remove(Trill& t)
+{
+	devices.erase(std::remove(devices.begin(), devices.end(), &t), devices.end());
+	inWindow.erase(std::remove(inWindow.begin(), inWindow.end(), &t), inWindow.end());
+	primed.erase(std::remove(primed.begin(), primed.end(), &t), primed.end());
+}
+
+int TrillSweep::setup()
+{
+	int ret = 0;
+	for(auto t : devices)
+		ret |= t->setScanTrigger(Trill::kScanTriggerI2c);
+	return ret;
+}
+
+int TrillSweep::sweep(unsigned int settleUs)
+{
+	FrameClock::Timestamp start;
+	FrameClock::Timestamp end;
+	inWindow.clear();
+	if(settleUs) {
+		start = FrameClock::now();
+		for(auto t : devices)
+			if(!t->triggerScan())
+				inWindow.push_back(t);
+		end = FrameClock::now();
+		TrillExecutor::sleep(settleUs);
+	} else {
+		// the frames were acquired when the last sweep read them,
+		// except those of the devices it didn't read
+		start = readsStart;
+		end = readsEnd;
+		for(auto t : devices)
+			if(std::find(primed.begin(), primed.end(), t) != primed.end())
+				inWindow.push_back(t);
+	}
+	int failed = 0;
+	primed.clear();
+	readsStart = FrameClock::now();
+	for(auto t : devices)
+	{
+		if(t->readI2C())
+			++failed;
+		else
+			primed.push_back(t);
+	}
+	readsEnd = FrameClock::now();
+	id = nextId++;
+	if(inWindow.empty())
+	{
+		// no frame was acquired at a known time: report when they
+		// were read instead
+		start = end = readsStart + (readsEnd - readsStart) / 2;
+	}
+	timestamp = start + (end - start) / 2;
+	window = end - start;
+	return failed;
+}
+
+bool TrillSweep::isInWindow(const Trill& t) const
+{
+	return std::find(inWindow.begin(), inWindow.end(), &t) != inWindow.end();
+}
+
+FrameClock::Timestamp TrillSweep::getTimestamp(const Trill& t) const
+{
+	return isInWindow(t) ? timestamp : t.getReadStartTime();
+}
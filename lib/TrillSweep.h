@@ -0,0 +1,126 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "FrameClock.h"
+
+class Trill;
+
+/**
+ * \brief Sample several devices at the same time.
+ *
+ * A device set to Trill::kScanTriggerI2c scans right after it is read,
+ * so when devices are read at unrelated times their frames are
+ * acquired at unrelated times, too. A sweep reads all of its devices
+ * back to back, so that their frames can be used together as one
+ * coherent snapshot, tagged with a common sweep ID and timestamp.
+ *
+ * The frames read in a sweep were acquired by the scans triggered in a
+ * short window, either:
+ * - by the reads of the previous sweep. This requires no additional
+ *   traffic, and the window is as long as the reads of a sweep.
+ * - by a trigger phase at the start of the same sweep, if a settle
+ *   time is passed to sweep(): each device is sent the shortest
+ *   possible transaction (see Trill::triggerScan()), then the sweep
+ *   waits for the scans to complete before reading. The window is
+ *   then only a fraction of the duration of the reads, but each
+ *   sweep takes longer. The time between sweeps should be longer than
+ *   the duration of a scan, so that the scans triggered by the reads
+ *   are complete by the next trigger phase.
+ *
+ * Devices can be on different buses, in which case the sweep accesses
+ * the buses one after the other. For tighter synchronisation across
+ * buses, run one sweep per bus from different threads, with their
+ * timing and IDs derived from a common clock (see setNextSweepId()).
+ *
+ * Without a settle time, the frame of a device that wasn't read by the
+ * previous sweep, e.g.: on the first sweep or when it was just added,
+ * comes from a scan that wasn't triggered by the sweep. Such frames are
+ * not in the window, see isInWindow().
+ *
+ * The devices should be set to Trill::kScanTriggerI2c, see setup().
+ */
+class TrillSweep
+{
+public:
+	/**
+	 * Add a device to the sweep. The device must outlive its
+	 * removal.
+	 */
+	void add(Trill& t);
+	/**
+	 * Remove a device from the sweep.
+	 */
+	void remove(Trill& t);
+	/**
+	 * Remove all devices. Unlike remove(), this keeps track of which
+	 * devices were read by the last sweep, so that the sweep can be
+	 * rebuilt before each call to sweep().
+	 */
+	void clear() { devices.clear(); }
+	/**
+	 * Get the number of devices in the sweep.
+	 */
+	size_t size() const { return devices.size(); }
+	/**
+	 * Set all devices to scan after each transaction.
+	 *
+	 * \copydoc Trill::TAGS_canonical_return
+	 */
+	int setup();
+	/**
+	 * Read all devices.
+	 *
+	 * @param settleUs if not 0, trigger a scan on all devices first,
+	 * then wait this long for the scans to complete before reading.
+	 * Use the scan time of the devices, which depends on their scan
+	 * settings and number of channels.
+	 *
+	 * @return the number of devices that could not be read, i.e.: 0
+	 * on success.
+	 */
+	int sweep(unsigned int settleUs = 0);
+	/**
+	 * Set the ID of the next sweep. By default, IDs are consecutive.
+	 */
+	void setNextSweepId(uint32_t id) { nextId = id; }
+	/**
+	 * Get the ID of the last sweep.
+	 */
+	uint32_t getSweepId() const { return id; }
+	/**
+	 * Get the time at the middle of the window in which the current
+	 * frames were acquired. If no frame was acquired in a known
+	 * window, e.g.: on the first sweep without a settle time, this is
+	 * the middle of the reads of the last sweep.
+	 */
+	FrameClock::Timestamp getTimestamp() const { return timestamp; }
+	/**
+	 * Get the length, in nanoseconds, of the window in which the
+	 * current frames were acquired, or 0 if no frame was acquired in
+	 * a known window.
+	 */
+	FrameClock::Timestamp getWindow() const { return window; }
+	/**
+	 * Whether the current frame of @p t was acquired in the window of
+	 * the last sweep.
+	 */
+	bool isInWindow(const Trill& t) const;
+	/**
+	 * Get the best estimate of the time at which the current frame of
+	 * @p t was acquired: getTimestamp() if it is in the window, or the
+	 * time it was read otherwise.
+	 */
+	FrameClock::Timestamp getTimestamp(const Trill& t) const;
+private:
+	std::vector<Trill*> devices;
+	std::vector<Trill*> inWindow; // those whose current frame was acquired in the window
+	std::vector<Trill*> primed; // those whose scan was triggered by the last reads
+	uint32_t id = 0;
+	uint32_t nextId = 0;
+	FrameClock::Timestamp timestamp = 0;
+	FrameClock::Timestamp window = 0;
+	// the window of the triggers performed by the reads of the last sweep
+	FrameClock::Timestamp readsStart = 0;
+	FrameClock::Timestamp readsEnd = 0;
+};
@@ -0,0 +1,210 @@
+#include "TrillTrace.h"
+#include <algorithm>
+#include <errno.h>
+#include <memory>
+#include <mutex>
+#include <string.h>
+
+std::atomic<bool> TrillTrace::gEnabled{false};
+
+static const char kFileMagic[8] = { 'T', 'R', 'L', 'T', 'R', 'A', 'C', 'E' };
+static constexpr uint32_t kFileVersion = 1;
+
+namespace {
+struct Ring {
+	std::vector<TrillTrace::Event> events;
+	std::atomic<uint64_t> head{0}; // the number of events recorded
+	uint16_t thread;
+};
+}
+
+static std::mutex gRingsMutex;
+static std::vector<std::unique_ptr<Ring>> gRings;
+static size_t gCapacity = 1 << 16;
+static thread_local Ring* tRing;
+
+static Ring* createRing()
+{
+	std::unique_ptr<Ring> ring(new Ring);
+	std::lock_guard<std::mutex> lock(gRingsMutex);
+	ring->events.resize(gCapacity);
+	ring->thread = gRings.size();
+	gRings.push_back(std::move(ring));
+	return gRings.back().get();
+}
+
+void TrillTrace::setCapacity(size_t events)
+{
+	size_t capacity = 1;
+	while(capacity < events)
+		capacity <<= 1;
+	std::lock_guard<std::mutex> lock(gRingsMutex);
+	gCapacity = capacity;
+}
+
+void TrillTrace::recordEnabled(Kind kind, unsigned int bus, unsigned int address, unsigned int arg, size_t size,
+		FrameClock::Timestamp start, FrameClock::Timestamp end, int ret)
+{
+	if(!tRing)
+		tRing = createRing();
+	Ring& r = *tRing;
+	uint64_t head = r.head.load(std::memory_order_relaxed);
+	Event& e = r.events[head & (r.events.size() - 1)];
+	e.start = start;
+	e.duration = std::min(end > start ? end - start : 0, FrameClock::Timestamp(UINT32_MAX));
+	e.ret = ret;
+	e.size = std::min(size, size_t(UINT16_MAX));
+	e.thread = r.thread;
+	e.kind = kind;
+	e.bus = bus;
+	e.address = address;
+	e.arg = arg;
+	r.head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<TrillTrace::Event> TrillTrace::getEvents()
+{
+	std::vector<Event> events;
+	std::lock_guard<std::mutex> lock(gRingsMutex);
+	for(auto& ring : gRings)
+	{
+		Ring& r = *ring;
+		uint64_t size = r.events.size();
+		uint64_t head = r.head.load(std::memory_order_acquire);
+		uint64_t first = head > size ? head - size : 0;
+		size_t start = events.size();
+		for(uint64_t n = first; n < head; ++n)
+			events.push_back(r.events[n & (size - 1)]);
+		// the events the thread recorded in the meantime, and the one
+		// it may be recording, may have overwritten some of those we
+		// copied
+		uint64_t newHead = r.head.load(std::memory_order_acquire) + 1;
+		if(newHead > first + size)
+		{
+			size_t overwritten = std::min(newHead - size - first, head - first);
+			events.erase(events.begin() + start, events.begin() + start + overwritten);
+		}
+	}
+	std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+		return a.start < b.start;
+	});
+	return events;
+}
+
+int TrillTrace::save(const std::string& path)
+{
+	std::vector<Event> events = getEvents();
+	FILE* file = fopen(path.c_str(), "wb");
+	if(!file)
+	{
+		fprintf(stderr, "TrillTrace: unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	uint32_t header[2] = { kFileVersion, uint32_t(sizeof(Event)) };
+	uint64_t count = events.size();
+	int ret = 0;
+	if(fwrite(kFileMagic, sizeof(kFileMagic), 1, file) != 1
+		|| fwrite(header, sizeof(header), 1, file) != 1
+		|| fwrite(&count, sizeof(count), 1, file) != 1
+		|| fwrite(events.data(), sizeof(Event), count, file) != count)
+	{
+		fprintf(stderr, "TrillTrace: error while writing %s: %s\n", path.c_str(), strerror(errno));
+		ret = 1;
+	}
+	if(fclose(file))
+		ret = 1;
+	return ret;
+}
+
+int TrillTrace::load(const std::string& path, std::vector<Event>& events)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if(!file)
+	{
+		fprintf(stderr, "TrillTrace: unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	char magic[sizeof(kFileMagic)];
+	uint32_t header[2];
+	uint64_t count;
+	int ret = 0;
+	if(fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, kFileMagic, sizeof(magic))
+		|| fread(header, sizeof(header), 1, file) != 1
+		|| kFileVersion != header[0] || sizeof(Event) != header[1]
+		|| fread(&count, sizeof(count), 1, file) != 1)
+	{
+		fprintf(stderr, "TrillTrace: %s is not a trace\n", path.c_str());
+		ret = 1;
+	} else {
+		// check the count against what is left in the file before
+		// allocating for it
+		long pos = ftell(file);
+		long size = -1;
+		if(pos >= 0 && !fseek(file, 0, SEEK_END))
+			size = ftell(file);
+		if(size < pos || fseek(file, pos, SEEK_SET) || count > uint64_t(size - pos) / sizeof(Event))
+		{
+			fprintf(stderr, "TrillTrace: %s is truncated\n", path.c_str());
+			ret = 1;
+		} else {
+			events.resize(count);
+			if(fread(events.data(), sizeof(Event), count, file) != count)
+			{
+				fprintf(stderr, "TrillTrace: %s is truncated\n", path.c_str());
+				ret = 1;
+			}
+		}
+	}
+	fclose(file);
+	return ret;
+}
+
+const char* TrillTrace::getKindName(unsigned int kind)
+{
+	switch(kind)
+	{
+		case kOffset: return "offset";
+		case kCommand: return "command";
+		case kRead: return "read";
+		case kAckPoll: return "ack poll";
+		case kSleep: return "sleep";
+		default: return "unknown";
+	}
+}
+
+int TrillTrace::writeChromeJson(FILE* file, const std::vector<Event>& events)
+{
+	// each bus is a process and each device a thread, so that the
+	// timeline of a bus shows all of its devices together
+	std::vector<std::pair<unsigned int, unsigned int>> devices;
+	for(auto& e : events)
+		devices.emplace_back(e.bus, e.address);
+	std::sort(devices.begin(), devices.end());
+	devices.erase(std::unique(devices.begin(), devices.end()), devices.end());
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	const char* separator = "";
+	unsigned int lastBus = ~0u;
+	for(auto& d : devices)
+	{
+		if(d.first != lastBus)
+		{
+			fprintf(file, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,\"args\":{\"name\":\"i2c-%u\"}}",
+				separator, d.first, d.first);
+			separator = ",\n";
+			lastBus = d.first;
+		}
+		fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%#x\"}}",
+			separator, d.first, d.second, d.second);
+	}
+	for(auto& e : events)
+	{
+		fprintf(file, "%s{\"ph\":\"X\",\"cat\":\"i2c\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%u.%03u,"
+			"\"args\":{\"thread\":%u,\"size\":%u,\"arg\":%u,\"ret\":%d}}",
+			separator, getKindName(e.kind), e.bus, e.address,
+			(unsigned long long)(e.start / 1000), unsigned(e.start % 1000), e.duration / 1000, e.duration % 1000,
+			e.thread, e.size, e.arg, e.ret);
+		separator = ",\n";
+	}
+	fprintf(file, "\n]}\n");
+	return ferror(file) ? 1 : 0;
+}
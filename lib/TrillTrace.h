@@ -0,0 +1,107 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "FrameClock.h"
+
+/**
+ * \brief A low-overhead trace of the I2C traffic with Trill devices.
+ *
+ * When enabled, every Trill object records each transfer with its
+ * device (offset writes, commands and reads, including those completed
+ * by TrillUring), each poll for the ack of a command and each sleep,
+ * with the time it started and ended, the bus and address of the
+ * device, the number of bytes and the result. This shows where the
+ * time on a bus goes, e.g.: devices waiting for each other or commands
+ * taking long to be acknowledged, without the printf() of
+ * Trill::setVerbose(), which changes the timing it is meant to show.
+ *
+ * Events are written to a ring of fixed size per thread, without locks
+ * or system calls, so the oldest ones are overwritten once the ring is
+ * full. When tracing is disabled, which is the default, recording an
+ * event costs a single relaxed atomic load.
+ *
+ * Rings are kept when their thread exits, so that the events of all
+ * threads can be saved at any time. The saved file can be converted
+ * for Chrome's about://tracing or https://ui.perfetto.dev with
+ * writeChromeJson(), e.g.: by the trace-export example, where each bus
+ * is shown as a process and each device as a thread in it.
+ */
+class TrillTrace
+{
+public:
+	typedef enum {
+		kOffset, ///< a write of the read offset
+		kCommand, ///< a write of a command
+		kRead, ///< a read of data from the current offset
+		kAckPoll, ///< a poll for the ack of a command, including its transfers
+		kSleep, ///< a sleep between transfers
+	} Kind;
+	enum {
+		kUnknownOffset = 255, ///< the #Event::arg of reads whose offset isn't known, e.g.: from TrillUring
+	};
+	struct Event {
+		uint64_t start; ///< CLOCK_MONOTONIC time, in nanoseconds
+		uint32_t duration; ///< in nanoseconds
+		int32_t ret; ///< 0 on success, or a negative errno
+		uint16_t size; ///< the number of bytes transferred or polled
+		uint16_t thread; ///< the index of the thread that recorded it
+		uint8_t kind; ///< one of #Kind
+		uint8_t bus; ///< the I2C bus of the device
+		uint8_t address; ///< the I2C address of the device
+		uint8_t arg; ///< the offset for #kOffset and #kRead, the command for #kCommand and #kAckPoll
+	};
+	/**
+	 * Start or stop recording events.
+	 */
+	static void enable(bool enabled) { gEnabled.store(enabled, std::memory_order_relaxed); }
+	static bool isEnabled() { return gEnabled.load(std::memory_order_relaxed); }
+	/**
+	 * Set the number of events retained per thread, which is rounded
+	 * up to a power of 2. This only affects threads that haven't
+	 * recorded any event yet.
+	 */
+	static void setCapacity(size_t events);
+	/**
+	 * Record an event, if tracing is enabled.
+	 */
+	static void record(Kind kind, unsigned int bus, unsigned int address, unsigned int arg, size_t size,
+			FrameClock::Timestamp start, FrameClock::Timestamp end, int ret)
+	{
+		if(isEnabled())
+			recordEnabled(kind, bus, address, arg, size, start, end, ret);
+	}
+	/**
+	 * Get the events retained by all threads, in order of start time.
+	 * This can be called while other threads are recording.
+	 */
+	static std::vector<Event> getEvents();
+	/**
+	 * Save the events retained by all threads to @p path.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	static int save(const std::string& path);
+	/**
+	 * Load events saved by save().
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	static int load(const std::string& path, std::vector<Event>& events);
+	/**
+	 * Write @p events as a Chrome / Perfetto JSON trace.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	static int writeChromeJson(FILE* file, const std::vector<Event>& events);
+	/**
+	 * Get a short name for @p kind.
+	 */
+	static const char* getKindName(unsigned int kind);
+private:
+	static void recordEnabled(Kind kind, unsigned int bus, unsigned int address, unsigned int arg, size_t size,
+			FrameClock::Timestamp start, FrameClock::Timestamp end, int ret);
+	static std::atomic<bool> gEnabled;
+};
@@ -0,0 +1,393 @@
+#include "TrillUring.h"
+#include "Trill.h"
+#include "TrillTrace.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+#define TRILL_HAS_IO_URING
+#else
+// just enough for the class to compile
+struct io_uring_sqe {};
+struct io_uring_cqe {
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+#endif
+
+// the ring indices are shared with the kernel
+static uint32_t loadAcquire(const uint32_t* p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(uint32_t* p, uint32_t value)
+{
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+TrillUring::TrillUring(unsigned int entries)
+{
+	setup(entries);
+}
+
+TrillUring::~TrillUring()
+{
+	cleanup();
+}
+
+void TrillUring::cleanup()
+{
+	// make sure the kernel is done with our buffers
+	while(numInFlight && processCompletions(1) >= 0)
+		;
+	for(auto& d : devices)
+	{
+		release(*d);
+		if(d->inFlight)
+			retire(d);
+	}
+	devices.clear();
+	// if we couldn't wait for them, the kernel may still write into
+	// the buffers of the reads in flight after the ring is closed, so
+	// they are never freed
+	for(auto& d : retired)
+		d.release();
+	retired.clear();
+	numInFlight = 0;
+	if(sqes)
+		munmap(sqes, sqesSize);
+	if(cqPtr && cqPtr != sqPtr)
+		munmap(cqPtr, cqSize);
+	if(sqPtr)
+		munmap(sqPtr, sqSize);
+	if(ringFd >= 0)
+		close(ringFd);
+	sqes = nullptr;
+	cqPtr = nullptr;
+	sqPtr = nullptr;
+	ringFd = -1;
+}
+
+int TrillUring::setup(unsigned int entries)
+{
+	cleanup();
+#ifdef TRILL_HAS_IO_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringFd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ringFd < 0)
+	{
+		fprintf(stderr, "TrillUring: unable to set up io_uring: %s\n", strerror(errno));
+		return 1;
+	}
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(singleMmap)
+		sqSize = cqSize = std::max(sqSize, cqSize);
+	sqPtr = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if(MAP_FAILED == sqPtr)
+	{
+		sqPtr = nullptr;
+		fprintf(stderr, "TrillUring: unable to map the submission queue: %s\n", strerror(errno));
+		cleanup();
+		return 1;
+	}
+	if(singleMmap)
+		cqPtr = sqPtr;
+	else {
+		cqPtr = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if(MAP_FAILED == cqPtr)
+		{
+			cqPtr = nullptr;
+			fprintf(stderr, "TrillUring: unable to map the completion queue: %s\n", strerror(errno));
+			cleanup();
+			return 1;
+		}
+	}
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* ptr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if(MAP_FAILED == ptr)
+	{
+		fprintf(stderr, "TrillUring: unable to map the submission entries: %s\n", strerror(errno));
+		cleanup();
+		return 1;
+	}
+	sqes = (io_uring_sqe*)ptr;
+	uint8_t* sq = (uint8_t*)sqPtr;
+	sqHead = (uint32_t*)(sq + params.sq_off.head);
+	sqTail = (uint32_t*)(sq + params.sq_off.tail);
+	sqMask = (uint32_t*)(sq + params.sq_off.ring_mask);
+	sqArray = (uint32_t*)(sq + params.sq_off.array);
+	uint8_t* cq = (uint8_t*)cqPtr;
+	cqHead = (uint32_t*)(cq + params.cq_off.head);
+	cqTail = (uint32_t*)(cq + params.cq_off.tail);
+	cqMask = (uint32_t*)(cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+	return 0;
+#else
+	fprintf(stderr, "TrillUring: io_uring is not supported by this build\n");
+	return 1;
+#endif
+}
+
+int TrillUring::add(Trill& t, bool shouldReadStatusByte)
+{
+	if(ringFd < 0)
+		return 1;
+	if(t.prepareForDataRead(shouldReadStatusByte))
+		return 1;
+	remove(t);
+	std::unique_ptr<Device> dev(new Device);
+	dev->t = &t;
+	dev->next = 0;
+	dev->parsed = 0;
+	dev->size = 0;
+	dev->submitted = 0;
+	dev->shouldReadStatusByte = shouldReadStatusByte;
+	dev->inFlight = false;
+	devices.push_back(std::move(dev));
+	return 0;
+}
+
+void TrillUring::remove(Trill& t)
+{
+	for(auto it = devices.begin(); it != devices.end(); ++it)
+	{
+		if(&t != (*it)->t)
+			continue;
+		// the kernel may still be writing to the buffer
+		while((*it)->inFlight)
+			if(processCompletions(1) < 0)
+				break;
+		release(**it);
+		// if it still is, the buffer is freed once the read completes
+		if((*it)->inFlight)
+			retire(*it);
+		devices.erase(it);
+		return;
+	}
+}
+
+void TrillUring::retire(std::unique_ptr<Device>& dev)
+{
+	dev->t = nullptr;
+	retired.push_back(std::move(dev));
+}
+
+// the device may still be using the frame it parsed from our buffer:
+// hand it a copy before the buffer goes away
+void TrillUring::release(Device& dev)
+{
+	const std::vector<uint8_t>& buffer = dev.buffers[!dev.next];
+	size_t size;
+	const uint8_t* payload = dev.t->getPayload(size);
+	if(buffer.empty() || payload < buffer.data() || payload >= buffer.data() + buffer.size())
+		return;
+	dev.t->newData(buffer.data(), buffer.size(), dev.shouldReadStatusByte, dev.parsed);
+}
+
+int TrillUring::submitReads(FrameClock::Timestamp deadline)
+{
+#ifdef TRILL_HAS_IO_URING
+	if(ringFd < 0)
+		return -1;
+	uint32_t firstTail = *sqTail;
+	uint32_t tail = firstTail;
+	uint32_t head = loadAcquire(sqHead);
+	uint32_t mask = *sqMask;
+	// with a deadline, each read is followed by a linked timeout
+	uint32_t entriesPerRead = deadline ? 2 : 1;
+	if(deadline)
+	{
+		// absolute timeouts are on CLOCK_MONOTONIC, like FrameClock
+		timeout[0] = deadline / 1000000000;
+		timeout[1] = deadline % 1000000000;
+	}
+	unsigned int toSubmit = 0;
+	unsigned int numReads = 0;
+	for(auto& d : devices)
+	{
+		Device& dev = *d;
+		if(dev.inFlight)
+			continue;
+		if(tail - head + entriesPerRead > mask + 1)
+			break; // the submission queue is full
+		if(dev.t->prepareForDataRead(dev.shouldReadStatusByte))
+			continue;
+		// this only allocates if the frame size grew, e.g.: after
+		// a change of mode
+		dev.size = dev.t->getBytesToRead(dev.shouldReadStatusByte);
+		std::vector<uint8_t>& buffer = dev.buffers[dev.next];
+		if(buffer.size() < dev.size)
+			buffer.resize(dev.size);
+		uint32_t idx = tail & mask;
+		io_uring_sqe& sqe = sqes[idx];
+		memset(&sqe, 0, sizeof(sqe));
+		// IORING_OP_READV is supported by all kernels with io_uring,
+		// unlike IORING_OP_READ
+		dev.iov.iov_base = buffer.data();
+		dev.iov.iov_len = dev.size;
+		sqe.opcode = IORING_OP_READV;
+		sqe.fd = dev.t->getFileHandle();
+		sqe.addr = (uint64_t)(uintptr_t)&dev.iov;
+		sqe.len = 1;
+		sqe.off = -1; // i2c-dev files are not seekable
+		sqe.user_data = (uint64_t)(uintptr_t)&dev;
+		sqArray[idx] = idx;
+		dev.sqe = tail;
+		++tail;
+		if(deadline)
+		{
+			sqe.flags |= IOSQE_IO_LINK;
+			idx = tail & mask;
+			io_uring_sqe& timeoutSqe = sqes[idx];
+			memset(&timeoutSqe, 0, sizeof(timeoutSqe));
+			timeoutSqe.opcode = IORING_OP_LINK_TIMEOUT;
+			timeoutSqe.addr = (uint64_t)(uintptr_t)timeout;
+			timeoutSqe.len = 1;
+			timeoutSqe.timeout_flags = IORING_TIMEOUT_ABS;
+			timeoutSqe.user_data = 0; // its completion is ignored
+			sqArray[idx] = idx;
+			++tail;
+		}
+		dev.submitted = FrameClock::now();
+		dev.deadline = deadline;
+		dev.inFlight = true;
+		toSubmit += entriesPerRead;
+		++numReads;
+	}
+	if(!toSubmit)
+		return 0;
+	storeRelease(sqTail, tail);
+	int ret = enter(toSubmit, 0);
+	// the kernel consumes the entries in order, and may stop early,
+	// e.g.: with EBUSY when the completion queue is full. Take back
+	// the entries it didn't consume, so that their devices are not
+	// waited for and are submitted again next time
+	uint32_t consumed = loadAcquire(sqHead);
+	if(consumed != tail)
+	{
+		storeRelease(sqTail, consumed);
+		for(auto& d : devices)
+		{
+			Device& dev = *d;
+			if(dev.inFlight && int32_t(dev.sqe - firstTail) >= 0 && int32_t(dev.sqe - consumed) >= 0)
+			{
+				dev.inFlight = false;
+				--numReads;
+			}
+		}
+	}
+	numInFlight += numReads;
+	if(ret < 0 && !numReads)
+		return -1;
+	return numReads;
+#else
+	return -1;
+#endif
+}
+
+int TrillUring::enter(unsigned int toSubmit, unsigned int minComplete)
+{
+#ifdef TRILL_HAS_IO_URING
+	while(1)
+	{
+		int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if(ret >= 0)
+			return ret;
+		if(EINTR == errno)
+		{
+			// whatever was consumed before the interruption has
+			// been submitted
+			continue;
+		}
+		fprintf(stderr, "TrillUring: io_uring_enter failed: %s\n", strerror(errno));
+		return -1;
+	}
+#else
+	return -1;
+#endif
+}
+
+int TrillUring::processCompletions(unsigned int minComplete)
+{
+	if(ringFd < 0)
+		return -1;
+	minComplete = std::min(minComplete, numInFlight);
+	uint32_t head = *cqHead;
+	if(minComplete && loadAcquire(cqTail) - head < minComplete)
+	{
+		if(enter(0, minComplete) < 0)
+			return -1;
+	}
+	uint32_t tail = loadAcquire(cqTail);
+	uint32_t mask = *cqMask;
+	int count = 0;
+	while(head != tail)
+	{
+		// copy it, so that the slot can be released before calling
+		// back, which may submit more reads
+		io_uring_cqe cqe = cqes[head & mask];
+		++head;
+		storeRelease(cqHead, head);
+		complete(cqe);
+		++count;
+	}
+	return count;
+}
+
+void TrillUring::complete(const io_uring_cqe& cqe)
+{
+	if(!cqe.user_data)
+		return; // a linked timeout
+	Device& dev = *(Device*)(uintptr_t)cqe.user_data;
+	dev.inFlight = false;
+	--numInFlight;
+	if(!dev.t)
+	{
+		// removed while in flight: the buffer can go now
+		retired.erase(std::find_if(retired.begin(), retired.end(), [&dev](const std::unique_ptr<Device>& d) {
+			return d.get() == &dev;
+		}));
+		return;
+	}
+	Trill& t = *dev.t;
+	int ret = cqe.res;
+	if(ret >= 0 && size_t(ret) != dev.size)
+		ret = -EIO;
+	if(ret > 0)
+		ret = 0;
+	// cancelled by the linked timeout
+	if(dev.deadline && (-ECANCELED == ret || -EINTR == ret))
+		ret = -ETIMEDOUT;
+	FrameClock::Timestamp deadline = t.getDeadline();
+	t.setDeadline(dev.deadline);
+	FrameClock::Timestamp end = FrameClock::now();
+	t.recordTransaction(dev.submitted, end, ret);
+	TrillTrace::record(TrillTrace::kRead, t.getBus(), t.getAddress(), TrillTrace::kUnknownOffset, dev.size, dev.submitted, end, ret);
+	t.setDeadline(deadline);
+	if(!ret)
+	{
+		// this fails if the frame size has grown since the read was
+		// submitted, e.g.: because of a change of mode
+		if(t.parse(dev.buffers[dev.next].data(), dev.size, dev.shouldReadStatusByte, dev.submitted))
+		{
+			ret = -EIO;
+		} else {
+			dev.parsed = dev.submitted;
+			dev.next = !dev.next;
+		}
+	}
+	if(callback)
+		callback(t, ret);
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+#include "FrameClock.h"
+
+class Trill;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * \brief Read several Trill devices asynchronously through io_uring.
+ *
+ * Instead of blocking in one readI2C() at a time, submitReads() queues
+ * a read on the i2c-dev file of each device and submits all of them
+ * with a single system call. The kernel performs the transactions in
+ * the background, concurrently on different buses, while transactions
+ * on the same bus are serialised by the bus driver as usual. The
+ * completions are then reaped in batches by processCompletions(), which
+ * passes the data of each one to Trill::parse(). Each device has two
+ * buffers used in turn, so that the frame being parsed is never the one
+ * the kernel is writing to, and no copy is needed.
+ *
+ * This way a single thread can drive any number of devices on any
+ * number of buses, with two system calls per sweep.
+ *
+ * Only reads of new data go through the ring: the read offset is set
+ * with a blocking write by Trill::prepareForDataRead() when a device is
+ * added and whenever it changed since the last read, e.g.: because a
+ * command was sent to the device. Commands can be sent to a device
+ * only while it doesn't have a read in flight.
+ *
+ * An instance is meant to be used from one thread at a time.
+ */
+class TrillUring
+{
+public:
+	/**
+	 * Called for each completed read, after its data has been passed
+	 * to the device. `ret` is 0 on success or a negative errno value.
+	 * Reads are also accounted for in Trill::getTransactionStats().
+	 */
+	typedef std::function<void(Trill& t, int ret)> Callback;
+	TrillUring() {};
+	/**
+	 * @param entries the maximum number of reads in flight.
+	 */
+	TrillUring(unsigned int entries);
+	~TrillUring();
+	TrillUring(const TrillUring&) = delete;
+	TrillUring& operator=(const TrillUring&) = delete;
+	/**
+	 * Create the ring. This fails if the kernel doesn't support
+	 * io_uring.
+	 *
+	 * @param entries the maximum number of reads in flight.
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int setup(unsigned int entries = 64);
+	/**
+	 * Add a device to read from. The device must outlive its
+	 * removal.
+	 *
+	 * @param t the device
+	 * @param shouldReadStatusByte whether or not to read the status
+	 * byte with every frame, as in Trill::readI2C().
+	 *
+	 * @return 0 on success, an error code otherwise.
+	 */
+	int add(Trill& t, bool shouldReadStatusByte = false);
+	/**
+	 * Remove a device, waiting for its read in flight to complete,
+	 * if any. If waiting fails, the buffer of the read is kept
+	 * until it completes.
+	 */
+	void remove(Trill& t);
+	/**
+	 * Set the function to call for each completed read.
+	 */
+	void setCallback(const Callback& callback) { this->callback = callback; }
+	/**
+	 * Queue and submit a read for each device that doesn't already
+	 * have one in flight.
+	 *
+	 * @param deadline if not 0, the time, as returned by
+	 * FrameClock::now(), at which the reads that haven't completed
+	 * yet are cancelled. These complete with `-ETIMEDOUT`.
+	 *
+	 * @return the number of reads submitted, or -1 on error.
+	 */
+	int submitReads(FrameClock::Timestamp deadline = 0);
+	/**
+	 * Process the reads that have completed.
+	 *
+	 * @param minComplete how many completions to wait for before
+	 * returning. Use 0 to only process what is already available.
+	 *
+	 * @return the number of completions processed, or -1 on error.
+	 */
+	int processCompletions(unsigned int minComplete = 0);
+	/**
+	 * Get the number of reads in flight.
+	 */
+	unsigned int getNumInFlight() const { return numInFlight; }
+	/**
+	 * Get a file descriptor that becomes readable when completions
+	 * are available, e.g.: to wait for them with epoll.
+	 */
+	int getFd() const { return ringFd; }
+private:
+	struct Device {
+		Trill* t; // null once removed
+		// the frame last parsed is in one, the next read goes into
+		// the other
+		std::vector<uint8_t> buffers[2];
+		unsigned int next;
+		struct iovec iov;
+		size_t size;
+		FrameClock::Timestamp submitted;
+		FrameClock::Timestamp parsed; // when the frame last parsed was submitted
+		FrameClock::Timestamp deadline;
+		bool shouldReadStatusByte;
+		bool inFlight;
+		uint32_t sqe; // the position of its last read in the submission queue
+	};
+	void cleanup();
+	int enter(unsigned int toSubmit, unsigned int minComplete);
+	void complete(const io_uring_cqe& cqe);
+	void release(Device& dev);
+	void retire(std::unique_ptr<Device>& dev);
+	std::vector<std::unique_ptr<Device>> devices;
+	std::vector<std::unique_ptr<Device>> retired; // removed with a read in flight
+	Callback callback;
+	unsigned int numInFlight = 0;
+	int64_t timeout[2]; // a struct __kernel_timespec for the linked timeouts
+	int ringFd = -1;
+	// the rings shared with the kernel
+	void* sqPtr = nullptr;
+	size_t sqSize = 0;
+	void* cqPtr = nullptr;
+	size_t cqSize = 0;
+	io_uring_sqe* sqes = nullptr;
+	size_t sqesSize = 0;
+	uint32_t* sqHead;
+	uint32_t* sqTail;
+	uint32_t* sqMask;
+	uint32_t* sqArray;
+	uint32_t* cqHead;
+	uint32_t* cqTail;
+	uint32_t* cqMask;
+	io_uring_cqe* cqes;
+};
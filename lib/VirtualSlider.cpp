@@ -0,0 +1,128 @@
+#include "VirtualSlider.h"
+#include "Trill.h"
+#include <algorithm>
+
+VirtualSlider::VirtualSlider(const std::vector<Trill*>& devices, const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale)
+{
+	setup(devices, order, maxNumCentroids, sizeScale);
+}
+
+int VirtualSlider::setup(const std::vector<Trill*>& devices, const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale)
+{
+	this->devices.clear();
+	numDeviceChannels.clear();
+	unsigned int numChannels = 0;
+	unsigned int numRaw = 0;
+	for(auto d : devices)
+	{
+		Trill::Mode mode = d->getMode();
+		if(Trill::DIFF != mode && Trill::RAW != mode)
+		{
+			fprintf(stderr, "VirtualSlider: devices must be in diff or raw mode. Device at address %#x is in %s mode\n",
+				d->getAddress(), Trill::getNameFromMode(mode).c_str());
+			return 1;
+		}
+		numRaw += Trill::RAW == mode;
+		numDeviceChannels.push_back(d->getNumChannels());
+		numChannels += numDeviceChannels.back();
+	}
+	if(numRaw && numRaw != devices.size())
+	{
+		fprintf(stderr, "VirtualSlider: devices must be all in diff or all in raw mode\n");
+		return 1;
+	}
+	usesRaw = numRaw;
+	this->devices = devices;
+	joined.assign(numChannels, 0);
+	std::vector<unsigned int> actualOrder = order;
+	if(!actualOrder.size())
+	{
+		for(unsigned int n = 0; n < numChannels; ++n)
+			actualOrder.push_back(n);
+	}
+	for(auto o : actualOrder)
+	{
+		if(o >= numChannels)
+		{
+			fprintf(stderr, "VirtualSlider: order contains channel %u, but only %u are available\n", o, numChannels);
+			return 1;
+		}
+	}
+	if(actualOrder.size() > 255)
+	{
+		fprintf(stderr, "VirtualSlider: at most 255 channels are supported\n");
+		return 1;
+	}
+	if(usesRaw)
+	{
+		const float kTimeConstant = 1000; // frames
+		const float kTouchThreshold = 0.02;
+		baselineTracker.setup(numChannels, kTimeConstant, kTouchThreshold, 0);
+	}
+	return detection.setup(actualOrder, maxNumCentroids, sizeScale);
+}
+
+int VirtualSlider::readI2C()
+{
+	int errors = 0;
+	for(auto d : devices)
+		errors += (0 != d->readI2C());
+	process();
+	return errors;
+}
+
+void VirtualSlider::process()
+{
+	if(devices.empty())
+		return; // not set up
+	// the layout of joined is fixed at setup(): if the number of
+	// channels of a device has changed since, e.g.: because of
+	// Trill::setChannelMask(), copy what fits and zero the rest
+	DATA_T* dst = joined.data();
+	for(unsigned int n = 0; n < devices.size(); ++n)
+	{
+		const std::vector<float>& rawData = devices[n]->rawData;
+		unsigned int numChannels = numDeviceChannels[n];
+		unsigned int available = std::min(numChannels, std::min(devices[n]->getNumChannels(), (unsigned int)rawData.size()));
+		std::copy(rawData.begin(), rawData.begin() + available, dst);
+		std::fill(dst + available, dst + numChannels, 0);
+		dst += numChannels;
+	}
+	if(usesRaw)
+	{
+		baselineTracker.process(joined.data());
+		detection.process(baselineTracker.getDiff());
+	} else {
+		detection.process(joined.data());
+	}
+}
+
+const VirtualSlider::DATA_T* VirtualSlider::getData() const
+{
+	return usesRaw ? baselineTracker.getDiff() : joined.data();
+}
+
+unsigned int VirtualSlider::getNumTouches() const
+{
+	return detection.getNumTouches();
+}
+
+VirtualSlider::DATA_T VirtualSlider::touchLocation(unsigned int touch_num) const
+{
+	return detection.touchLocation(touch_num);
+}
+
+VirtualSlider::DATA_T VirtualSlider::touchSize(unsigned int touch_num) const
+{
+	return detection.touchSize(touch_num);
+}
+
+VirtualSlider::DATA_T VirtualSlider::compoundTouchLocation() const
+{
+	return detection.compoundTouchLocation();
+}
+
+VirtualSlider::DATA_T VirtualSlider::compoundTouchSize() const
+{
+	return detection.compoundTouchSize();
+}
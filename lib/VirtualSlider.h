@@ -0,0 +1,86 @@
+#pragma once
+#include <CentroidDetection.h>
+#include <BaselineTracker.h>
+#include <vector>
+
+class Trill;
+
+/**
+ * \brief Join several Trill devices into one long virtual slider.
+ *
+ * The channels of all devices are concatenated, in the order in which
+ * devices are passed to setup(), into one array, and touch detection is
+ * performed on the joined array with a single CentroidDetection. This
+ * way, a touch that crosses the seam between two devices is detected
+ * once, at the right location.
+ *
+ * The devices have to be in Trill::DIFF or Trill::RAW mode. For devices
+ * in Trill::RAW mode, a BaselineTracker converts the readings to their
+ * DIFF equivalent before detection.
+ */
+class VirtualSlider
+{
+public:
+	typedef CentroidDetection::DATA_T DATA_T;
+	VirtualSlider() {};
+	/**
+	 * @param devices the devices, which have to be already set up.
+	 * They are not owned by this object and must outlive it.
+	 * @param order the order of the channels along the slider, as
+	 * indices into the joined array, as in CentroidDetection::setup().
+	 * If empty, all channels of all devices are used in order.
+	 * @param maxNumCentroids the maximum number of touches to detect.
+	 * @param sizeScale the value that a touch size is divided by.
+	 */
+	VirtualSlider(const std::vector<Trill*>& devices, const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale);
+	/**
+	 * \copydoc VirtualSlider::VirtualSlider(const std::vector<Trill*>&, const std::vector<unsigned int>&, unsigned int, float)
+	 *
+	 * @return 0 on success, or an error code otherwise.
+	 */
+	int setup(const std::vector<Trill*>& devices, const std::vector<unsigned int>& order, unsigned int maxNumCentroids, float sizeScale);
+	/**
+	 * Read a new frame from all devices in one sweep, then process()
+	 * it.
+	 *
+	 * @return 0 on success, or the number of devices that could not be
+	 * read. If any read fails, the previous frame of that device is
+	 * used.
+	 */
+	int readI2C();
+	/**
+	 * Join the current frames of all devices and detect touches on
+	 * them. Use this if the devices' data is retrieved elsewhere, e.g.:
+	 * through Trill::newData().
+	 */
+	void process();
+	/**
+	 * Get the total number of channels of all devices.
+	 */
+	unsigned int getNumChannels() const { return joined.size(); }
+	/**
+	 * Get the joined DIFF data of the current frame, before reordering.
+	 */
+	const DATA_T* getData() const;
+	/**
+	 * Get the detector, e.g.: to change its settings.
+	 */
+	CentroidDetection& getCentroidDetection() { return detection; }
+	/**
+	 * Get the baseline tracker used for devices in Trill::RAW mode,
+	 * e.g.: to change its settings.
+	 */
+	BaselineTracker& getBaselineTracker() { return baselineTracker; }
+	unsigned int getNumTouches() const;
+	DATA_T touchLocation(unsigned int touch_num) const;
+	DATA_T touchSize(unsigned int touch_num) const;
+	DATA_T compoundTouchLocation() const;
+	DATA_T compoundTouchSize() const;
+private:
+	std::vector<Trill*> devices;
+	std::vector<unsigned int> numDeviceChannels; // the channels of each device at setup()
+	std::vector<DATA_T> joined;
+	CentroidDetection detection;
+	BaselineTracker baselineTracker;
+	bool usesRaw = false;
+};
@@ -0,0 +1,150 @@
+#include "WorkStealingPool.h"
+#include <algorithm>
+
+static inline uint64_t packRange(uint32_t begin, uint32_t end)
+{
+	return (uint64_t(begin) << 32) | end;
+}
+
+static inline uint32_t rangeBegin(uint64_t range)
+{
+	return range >> 32;
+}
+
+static inline uint32_t rangeEnd(uint64_t range)
+{
+	return range & 0xffffffff;
+}
+
+WorkStealingPool::WorkStealingPool(unsigned int numWorkers)
+{
+	if(!numWorkers)
+		numWorkers = std::thread::hardware_concurrency();
+	if(!numWorkers)
+		numWorkers = 1;
+	this->numWorkers = numWorkers;
+	ranges = std::unique_ptr<Range[]>(new Range[numWorkers]);
+	for(unsigned int n = 0; n < numWorkers; ++n)
+		ranges[n] = 0;
+	for(unsigned int n = 1; n < numWorkers; ++n)
+		threads.emplace_back(&WorkStealingPool::threadLoop, this, n);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		shouldStop = true;
+	}
+	startCv.notify_all();
+	for(auto& t : threads)
+		t.join();
+}
+
+unsigned int WorkStealingPool::getNumWorkers() const
+{
+	return numWorkers;
+}
+
+void WorkStealingPool::parallelFor(size_t n, size_t grain, const Function& fn)
+{
+	if(!n)
+		return;
+	if(!grain)
+		grain = 1;
+	// ranges are packed as two 32-bit indices
+	for(size_t start = 0; start < n; start += 0xffffffff)
+	{
+		size_t count = std::min(n - start, size_t(0xffffffff));
+		Function offsetFn = [&fn, start](unsigned int worker, size_t begin, size_t end) {
+			fn(worker, start + begin, start + end);
+		};
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			this->fn = start ? &offsetFn : &fn;
+			this->grain = grain;
+			for(unsigned int w = 0; w < numWorkers; ++w)
+				ranges[w] = packRange(count * w / numWorkers, count * (w + 1) / numWorkers);
+			busy = numWorkers - 1;
+			++generation;
+		}
+		startCv.notify_all();
+		work(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCv.wait(lock, [this]{ return 0 == busy; });
+	}
+}
+
+void WorkStealingPool::threadLoop(unsigned int worker)
+{
+	unsigned int lastGeneration = 0;
+	while(1)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startCv.wait(lock, [this, lastGeneration]{ return shouldStop || generation != lastGeneration; });
+			if(shouldStop)
+				return;
+			lastGeneration = generation;
+		}
+		work(worker);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			--busy;
+		}
+		doneCv.notify_one();
+	}
+}
+
+void WorkStealingPool::work(unsigned int worker)
+{
+	Range& range = ranges[worker];
+	do {
+		uint64_t r = range.load();
+		while(rangeBegin(r) < rangeEnd(r))
+		{
+			uint32_t begin = rangeBegin(r);
+			uint32_t end = std::min(uint64_t(rangeEnd(r)), uint64_t(begin) + grain);
+			if(range.compare_exchange_weak(r, packRange(end, rangeEnd(r))))
+			{
+				(*fn)(worker, begin, end);
+				r = range.load();
+			}
+		}
+	} while(steal(worker));
+}
+
+bool WorkStealingPool::steal(unsigned int worker)
+{
+	while(1)
+	{
+		// pick the victim with the most work left
+		unsigned int victim = worker;
+		uint32_t largest = 0;
+		for(unsigned int w = 0; w < numWorkers; ++w)
+		{
+			uint64_t r = ranges[w].load();
+			uint32_t size = rangeEnd(r) > rangeBegin(r) ? rangeEnd(r) - rangeBegin(r) : 0;
+			if(size > largest)
+			{
+				largest = size;
+				victim = w;
+			}
+		}
+		if(!largest)
+			return false;
+		uint64_t r = ranges[victim].load();
+		uint32_t begin = rangeBegin(r);
+		uint32_t end = rangeEnd(r);
+		if(begin >= end)
+			continue;
+		// take the back half, or all of it if it's too small to split
+		uint32_t mid = end - begin > grain ? begin + (end - begin) / 2 : begin;
+		if(ranges[victim].compare_exchange_strong(r, packRange(begin, mid)))
+		{
+			// our own range is empty, so nobody is stealing from it
+			ranges[worker] = packRange(mid, end);
+			return true;
+		}
+	}
+}
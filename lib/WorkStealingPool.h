@@ -0,0 +1,67 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief A pool of threads that cooperate on data-parallel loops.
+ *
+ * Each call to parallelFor() splits the index range evenly among the
+ * workers. Each worker consumes its own range from the front in small
+ * chunks and, once it runs out of work, steals the back half of the
+ * largest range left to another worker. Ranges are claimed with a
+ * single compare-and-swap, so there are no locks on the fast path.
+ *
+ * The thread calling parallelFor() takes part in the work as worker 0.
+ */
+class WorkStealingPool
+{
+public:
+	/**
+	 * A function processing the indices in [begin, end). `worker` is
+	 * between 0 and getNumWorkers() - 1 and it can be used to access
+	 * per-worker state: no two calls with the same `worker` run
+	 * concurrently.
+	 */
+	typedef std::function<void(unsigned int worker, size_t begin, size_t end)> Function;
+	/**
+	 * @param numWorkers the number of workers, including the calling
+	 * thread. If 0, one worker per hardware thread is used.
+	 */
+	WorkStealingPool(unsigned int numWorkers = 0);
+	~WorkStealingPool();
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+	/**
+	 * Get the number of workers, including the calling thread.
+	 */
+	unsigned int getNumWorkers() const;
+	/**
+	 * Call @p fn on chunks of at most @p grain indices until all
+	 * indices in [0, n) have been processed. Returns when all calls
+	 * have completed.
+	 */
+	void parallelFor(size_t n, size_t grain, const Function& fn);
+private:
+	typedef std::atomic<uint64_t> Range; // begin in the high word, end in the low word
+	void threadLoop(unsigned int worker);
+	void work(unsigned int worker);
+	bool steal(unsigned int worker);
+	std::vector<std::thread> threads;
+	std::unique_ptr<Range[]> ranges;
+	unsigned int numWorkers;
+	const Function* fn = nullptr;
+	size_t grain;
+	std::mutex mutex;
+	std::condition_variable startCv;
+	std::condition_variable doneCv;
+	unsigned int generation = 0;
+	unsigned int busy = 0;
+	bool shouldStop = false;
+};